@@ -42,8 +42,11 @@
    more for other allocations.  We need to support at least 4 disks,
    so we need 4*4=16 pages.  Add an extra couple of pages just to be
    safe, since running out of memory in the austere heap usually leads
-   to a crash. */
-#define AUSTERE_HEAP_PAGES 23
+   to a crash.
+   The dump/hiber target may also use a 2 page ring (one more page) and
+   an indirect context (four pages of segment state and the indirect
+   page itself), so allow another 7 pages. */
+#define AUSTERE_HEAP_PAGES 30
 #define AUSTERE_MAX_ALLOC_SIZE  (8*PAGE_SIZE)
 //
 // Cause the emergency heap to be allocated in its own section with
@@ -56,8 +56,8 @@
 // Global Constants
 #define XENVBD_MAX_TARGETS              (128)
 
-#define XENVBD_MAX_RING_PAGE_ORDER      (0)
-#define XENVBD_MAX_RING_PAGES           (1)
+#define XENVBD_MAX_RING_PAGE_ORDER      (1)
+#define XENVBD_MAX_RING_PAGES           (1 << XENVBD_MAX_RING_PAGE_ORDER)
 
 #define XENVBD_MAX_SEGMENTS_PER_REQUEST (BLKIF_MAX_SEGMENTS_PER_REQUEST)
 #define XENVBD_MAX_REQUESTS_PER_SRB     (2)
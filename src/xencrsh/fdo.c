@@ -375,6 +375,8 @@ FdoFindAdapter(
     IN OUT PPORT_CONFIGURATION_INFORMATION  ConfigInfo
     )
 {
+    ULONG   MaxSegments;
+
     LogTrace("===> (Irql=%d)\n", KeGetCurrentIrql());
 
     if (!FdoInitialize(Fdo)) {
@@ -382,9 +384,15 @@ FdoFindAdapter(
         return SP_RETURN_BAD_CONFIG;
     }
 
+    // target is already connected, so indirect support is known
+    MaxSegments = XENVBD_MAX_SEGMENTS_PER_SRB;
+    if (Fdo->Target)
+        MaxSegments = PdoMaxSegments(Fdo->Target);
+    LogVerbose("MaxTransfer = %d KB\n", (MaxSegments * PAGE_SIZE) / 1024);
+
     // setup config info
-    ConfigInfo->MaximumTransferLength       = XENVBD_MAX_TRANSFER_LENGTH;
-    ConfigInfo->NumberOfPhysicalBreaks      = XENVBD_MAX_PHYSICAL_BREAKS;
+    ConfigInfo->MaximumTransferLength       = MaxSegments * PAGE_SIZE;
+    ConfigInfo->NumberOfPhysicalBreaks      = MaxSegments - 1;
     ConfigInfo->AlignmentMask               = 0; // Byte-Aligned
     ConfigInfo->NumberOfBuses               = 1;
     ConfigInfo->InitiatorBusId[0]           = 1;
@@ -45,6 +45,7 @@
 #include "util.h"
 
 #include <stdlib.h>
+#include <Ntstrsafe.h>
 
 #define DOMID_INVALID (0x7FF4U)
 // States in XenStore (Note - numbers must match!)
@@ -256,8 +257,29 @@ FrontendInsertRequestOnRing(
     //    break;
     case BLKIF_OP_READ:
     case BLKIF_OP_WRITE:
+        if (Request->Indirect) {
+            blkif_request_indirect_t*       Indirect = (blkif_request_indirect_t*)RingReq;
+            struct blkif_request_segment*   Segments = Request->Indirect->Page;
+
+            for (Index = 0; Index < Request->NrSegments; ++Index) {
+                Segments[Index].gref        = Request->Indirect->Segments[Index].GrantRef;
+                Segments[Index].first_sect  = Request->Indirect->Segments[Index].FirstSector;
+                Segments[Index].last_sect   = Request->Indirect->Segments[Index].LastSector;
+            }
+
+            Indirect->operation         = BLKIF_OP_INDIRECT;
+            Indirect->indirect_op       = Request->Operation;
+            Indirect->nr_segments       = Request->NrSegments;
+            Indirect->id                = (ULONG64)Request;
+            Indirect->sector_number     = Request->FirstSector;
+            Indirect->handle            = (USHORT)Frontend->DeviceId;
+            for (Index = 0; Index < BLKIF_MAX_INDIRECT_PAGES_PER_REQUEST; ++Index)
+                Indirect->indirect_grefs[Index] = 0;
+            Indirect->indirect_grefs[0] = Request->Indirect->GrantRef;
+            break;
+        }
         RingReq->operation          = Request->Operation;
-        RingReq->nr_segments        = Request->NrSegments;
+        RingReq->nr_segments        = (UCHAR)Request->NrSegments;
         RingReq->handle             = (USHORT)Frontend->DeviceId;
         RingReq->id                 = (ULONG64)Request;
         RingReq->sector_number      = Request->FirstSector;
@@ -486,8 +508,18 @@ __ReadFeatures(
         Frontend->FeatureDiscard = FALSE;
     }
 
-    LogVerbose("Features: DomId=%d, RingOrder=0, %s %s %s\n", 
+    Status = StoreRead(NULL, Frontend->BackendPath,
+                        "max-ring-page-order", &Buffer);
+    if (NT_SUCCESS(Status)) {
+        Frontend->RingOrder = __Min(strtoul(Buffer, NULL, 10), XENVBD_MAX_RING_PAGE_ORDER);
+        AustereFree(Buffer);
+    } else {
+        Frontend->RingOrder = 0;
+    }
+
+    LogVerbose("Features: DomId=%d, RingOrder=%d, %s %s %s\n", 
                 Frontend->BackendId,
+                Frontend->RingOrder,
                 Frontend->Removable ? "REMOVABLE" : "NOT_REMOVABLE",
                 Frontend->FeatureBarrier ? "BARRIER" : "NOT_BARRIER",
                 Frontend->FeatureDiscard ? "DISCARD" : "NOT_DISCARD");
@@ -544,6 +576,21 @@ __ReadDiskInfo(
         LogWarning("DiskInfo contains VDISK_CDROM flag!\n");
     }
 }
+static FORCEINLINE VOID
+__RevokeRing(
+    IN  PXENVBD_FRONTEND        Frontend
+    )
+{
+    ULONG       Index;
+
+    for (Index = 0; Index < XENVBD_MAX_RING_PAGES; ++Index) {
+        if (Frontend->RingGrantRefs[Index] == 0)
+            continue;
+        GnttabRevokeForeignAccess(Frontend->RingGrantRefs[Index]);
+        GnttabPut(Frontend->RingGrantRefs[Index]);
+        Frontend->RingGrantRefs[Index] = 0;
+    }
+}
 static FORCEINLINE NTSTATUS
 __AllocRing(
     IN  PXENVBD_FRONTEND        Frontend
@@ -552,10 +599,12 @@ __AllocRing(
     NTSTATUS    Status;
     ULONG       RingRef;
     PFN_NUMBER  Pfn;
+    ULONG       Index;
+    const ULONG RingPages = 1 << Frontend->RingOrder;
 
-    // SharedRing
+    // SharedRing (contiguous in the austere heap, but each page is granted by its own Pfn)
     ASSERT3P(Frontend->SharedRing, ==, NULL);
-    Frontend->SharedRing = __FrontendAlloc(PAGE_SIZE);
+    Frontend->SharedRing = __FrontendAlloc(RingPages * PAGE_SIZE);
     Status = STATUS_INSUFFICIENT_RESOURCES;
     if (!Frontend->SharedRing)
         goto fail1;
@@ -563,19 +612,21 @@ __AllocRing(
 #pragma warning(push)
 #pragma warning(disable: 4305)
     SHARED_RING_INIT(Frontend->SharedRing);
-    FRONT_RING_INIT(&Frontend->FrontRing, Frontend->SharedRing, PAGE_SIZE);
+    FRONT_RING_INIT(&Frontend->FrontRing, Frontend->SharedRing, RingPages * PAGE_SIZE);
 #pragma warning (pop)
 
     // GNTTAB
-    Pfn = __VirtToPfn(Frontend->SharedRing);
+    for (Index = 0; Index < RingPages; ++Index) {
+        Pfn = __VirtToPfn((PUCHAR)Frontend->SharedRing + (Index * PAGE_SIZE));
 
-    Status = GnttabGet(&RingRef);
-    if (!NT_SUCCESS(Status))
-        goto fail2;
+        Status = GnttabGet(&RingRef);
+        if (!NT_SUCCESS(Status))
+            goto fail2;
 
-    GnttabPermitForeignAccess(RingRef, Frontend->BackendId, Pfn, FALSE);
+        GnttabPermitForeignAccess(RingRef, Frontend->BackendId, Pfn, FALSE);
 
-    Frontend->RingGrantRef = RingRef;
+        Frontend->RingGrantRefs[Index] = RingRef;
+    }
 
     // EVTCHN
     Status = EventChannelAllocate(Frontend->BackendId, &Frontend->EvtchnPort);
@@ -586,14 +637,10 @@ __AllocRing(
 
 fail3:
     LogError("Fail3\n");
-    if (Frontend->RingGrantRef != 0) {
-        GnttabRevokeForeignAccess(Frontend->RingGrantRef);
-        GnttabPut(Frontend->RingGrantRef);
-        Frontend->RingGrantRef = 0;
-    }
 
 fail2:
     LogError("Fail2\n");
+    __RevokeRing(Frontend);
     RtlZeroMemory(&Frontend->FrontRing, sizeof(Frontend->FrontRing));
     __FrontendFree(Frontend->SharedRing);
     Frontend->SharedRing = NULL;
@@ -614,11 +661,7 @@ __FreeRing(
     }
 
     // GNTTAB
-    if (Frontend->RingGrantRef != 0) {
-        GnttabRevokeForeignAccess(Frontend->RingGrantRef);
-        GnttabPut(Frontend->RingGrantRef);
-        Frontend->RingGrantRef = 0;
-    }
+    __RevokeRing(Frontend);
 
     // SharedRing
     RtlZeroMemory(&Frontend->FrontRing, sizeof(Frontend->FrontRing));
@@ -627,6 +670,94 @@ __FreeRing(
         Frontend->SharedRing = NULL;
     }
 }
+static FORCEINLINE VOID
+__ReadIndirect(
+    IN  PXENVBD_FRONTEND        Frontend
+    )
+{
+    NTSTATUS    Status;
+    PCHAR       Buffer;
+
+    // written by the backend when it connects, so only valid once CONNECTED
+    Status = StoreRead(NULL, Frontend->BackendPath,
+                        "feature-max-indirect-segments", &Buffer);
+    if (NT_SUCCESS(Status)) {
+        Frontend->MaxIndirectSegments = __Min(strtoul(Buffer, NULL, 10), XENVBD_MAX_INDIRECT_SEGMENTS);
+        AustereFree(Buffer);
+    } else {
+        Frontend->MaxIndirectSegments = 0;
+    }
+
+    // not worth an extra page if it cannot beat 2 direct requests
+    if (Frontend->MaxIndirectSegments <= XENVBD_MAX_SEGMENTS_PER_SRB)
+        Frontend->MaxIndirectSegments = 0;
+
+    LogVerbose("Indirect: %d segments\n", Frontend->MaxIndirectSegments);
+}
+static FORCEINLINE NTSTATUS
+__AllocIndirect(
+    IN  PXENVBD_FRONTEND        Frontend
+    )
+{
+    NTSTATUS            Status;
+    PXENVBD_INDIRECT    Indirect;
+    ULONG               GrantRef;
+
+    C_ASSERT(XENVBD_MAX_INDIRECT_SEGMENTS <= PAGE_SIZE / sizeof(struct blkif_request_segment));
+
+    ASSERT3P(Frontend->Indirect, ==, NULL);
+    if (Frontend->MaxIndirectSegments == 0)
+        return STATUS_SUCCESS;
+
+    Status = STATUS_INSUFFICIENT_RESOURCES;
+    Indirect = __FrontendAlloc(sizeof(XENVBD_INDIRECT));
+    if (!Indirect)
+        goto fail1;
+
+    Indirect->Page = __FrontendAlloc(PAGE_SIZE);
+    if (!Indirect->Page)
+        goto fail2;
+
+    Status = GnttabGet(&GrantRef);
+    if (!NT_SUCCESS(Status))
+        goto fail3;
+
+    // backend only reads the segment list
+    GnttabPermitForeignAccess(GrantRef, Frontend->BackendId, 
+                                __VirtToPfn(Indirect->Page), TRUE);
+
+    Indirect->GrantRef = GrantRef;
+    Indirect->MaxSegments = Frontend->MaxIndirectSegments;
+    Frontend->Indirect = Indirect;
+    return STATUS_SUCCESS;
+
+fail3:
+    LogError("Fail3\n");
+    __FrontendFree(Indirect->Page);
+fail2:
+    LogError("Fail2\n");
+    __FrontendFree(Indirect);
+fail1:
+    LogError("Fail1 (%08x)\n", Status);
+    return Status;
+}
+static FORCEINLINE VOID
+__FreeIndirect(
+    IN  PXENVBD_FRONTEND        Frontend
+    )
+{
+    PXENVBD_INDIRECT    Indirect = Frontend->Indirect;
+
+    if (Indirect == NULL)
+        return;
+    Frontend->Indirect = NULL;
+
+    ASSERT(!Indirect->InUse);
+    GnttabRevokeForeignAccess(Indirect->GrantRef);
+    GnttabPut(Indirect->GrantRef);
+    __FrontendFree(Indirect->Page);
+    __FrontendFree(Indirect);
+}
 static NTSTATUS
 __WriteRing(
     IN  PXENVBD_FRONTEND        Frontend
@@ -646,10 +777,32 @@ __WriteRing(
         if (!NT_SUCCESS(Status))
             goto abort;
 
-        Status = StorePrintf(Transaction, Frontend->FrontendPath,
-                        "ring-ref", "%u", Frontend->RingGrantRef);
-        if (!NT_SUCCESS(Status))
-            goto abort;
+        if (Frontend->RingOrder == 0) {
+            Status = StorePrintf(Transaction, Frontend->FrontendPath,
+                            "ring-ref", "%u", Frontend->RingGrantRefs[0]);
+            if (!NT_SUCCESS(Status))
+                goto abort;
+        } else {
+            ULONG   Index;
+
+            Status = StorePrintf(Transaction, Frontend->FrontendPath,
+                            "ring-page-order", "%u", Frontend->RingOrder);
+            if (!NT_SUCCESS(Status))
+                goto abort;
+
+            for (Index = 0; Index < (1ul << Frontend->RingOrder); ++Index) {
+                CHAR    Name[sizeof("ring-refXX")];
+
+                Status = RtlStringCbPrintfA(Name, sizeof(Name), "ring-ref%u", Index);
+                if (!NT_SUCCESS(Status))
+                    goto abort;
+
+                Status = StorePrintf(Transaction, Frontend->FrontendPath,
+                                Name, "%u", Frontend->RingGrantRefs[Index]);
+                if (!NT_SUCCESS(Status))
+                    goto abort;
+            }
+        }
 
         Status = StoreWrite(Transaction, Frontend->FrontendPath,
                         "protocol", "x86_64-abi");
@@ -843,6 +996,14 @@ FrontendConnect(
 
     // read disk info
     __ReadDiskInfo(Frontend);
+
+    // indirect is optional, fall back to direct requests if it cannot be set up
+    __ReadIndirect(Frontend);
+    Status = __AllocIndirect(Frontend);
+    if (!NT_SUCCESS(Status)) {
+        LogWarning("Indirect disabled (%08x)\n", Status);
+        Frontend->MaxIndirectSegments = 0;
+    }
     
     return STATUS_SUCCESS;
 
@@ -867,6 +1028,7 @@ FrontendDisconnect(
     )
 {
     // Free Ring, Close Evtchn, Gnttab unmap
+    __FreeIndirect(Frontend);
     __FreeRing(Frontend);
 }
 static FORCEINLINE VOID
@@ -931,7 +1093,8 @@ FrontendDestroy(
 
     LogTrace("Target[%d] @ (%d) =====>\n", TargetId, KeGetCurrentIrql());
 
-    ASSERT3U(Frontend->RingGrantRef, ==, 0);
+    ASSERT3U(Frontend->RingGrantRefs[0], ==, 0);
+    ASSERT3P(Frontend->Indirect, ==, NULL);
     ASSERT3P(Frontend->EvtchnPort, ==, 0);
 
     // free memory
@@ -77,10 +77,15 @@ typedef struct _XENVBD_FRONTEND {
     PVOID                       Inquiry;
 
     // Ring
+    ULONG                       RingOrder;
+    ULONG                       MaxIndirectSegments;
     blkif_sring_t*              SharedRing;
     blkif_front_ring_t          FrontRing;
-    ULONG                       RingGrantRef;
+    ULONG                       RingGrantRefs[XENVBD_MAX_RING_PAGES];
     ULONG                       EvtchnPort;
+
+    // Indirect (NULL if the backend cannot take BLKIF_OP_INDIRECT)
+    PXENVBD_INDIRECT            Indirect;
 } XENVBD_FRONTEND, *PXENVBD_FRONTEND;
 
 // Init/Term
@@ -117,6 +117,7 @@ struct _XENVBD_PDO {
     ULONG                       Reads;
     ULONG                       Writes;
     ULONG                       Others;
+    ULONG                       Indirects;
 };
 
 //
@@ -293,6 +294,16 @@ PdoSectorSize(
     return Pdo->Frontend.SectorSize;
 }
 
+ULONG
+PdoMaxSegments(
+    IN  PXENVBD_PDO             Pdo
+    )
+{
+    if (Pdo->Frontend.Indirect)
+        return Pdo->Frontend.Indirect->MaxSegments;
+    return XENVBD_MAX_SEGMENTS_PER_SRB;
+}
+
 //=============================================================================
 // REQUEST related
 static VOID
@@ -304,24 +315,31 @@ __CleanupRequest(
     ULONG               Index;
 
     for (Index = 0; Index < Request->NrSegments; ++Index) {
+        PXENVBD_SEGMENT Segment = RequestSegment(Request, Index);
+
         // ungrant request
-        if (Request->Segments[Index].GrantRef) {
-            GnttabRevokeForeignAccess(Request->Segments[Index].GrantRef);
-            GnttabPut(Request->Segments[Index].GrantRef);
-            Request->Segments[Index].GrantRef = 0;
+        if (Segment->GrantRef) {
+            GnttabRevokeForeignAccess(Segment->GrantRef);
+            GnttabPut(Segment->GrantRef);
+            Segment->GrantRef = 0;
         }
 
         // free bounce buffer
-        if (Request->Segments[Index].BufferId) {
+        if (Segment->BufferId) {
             if (Request->Operation == BLKIF_OP_READ && CopyOut) {
-                BufferCopyOut(Request->Segments[Index].BufferId, (PUCHAR)Request->Segments[Index].Buffer, Request->Segments[Index].Length);
+                BufferCopyOut(Segment->BufferId, (PUCHAR)Segment->Buffer, Segment->Length);
             } 
-            BufferPut(Request->Segments[Index].BufferId);
-            Request->Segments[Index].BufferId = 0;
-            MmUnmapLockedPages(Request->Segments[Index].Buffer, &Request->Segments[Index].Mdl);
+            BufferPut(Segment->BufferId);
+            Segment->BufferId = 0;
+            MmUnmapLockedPages(Segment->Buffer, &Segment->Mdl);
         }
     }
 
+    // release the indirect page for the next request
+    if (Request->Indirect) {
+        Request->Indirect->InUse = FALSE;
+        Request->Indirect = NULL;
+    }
 }
 static VOID
 __CleanupSrb(
@@ -466,6 +484,121 @@ __Pfn(
     return (PFN_NUMBER)(PhysAddr.QuadPart >> PAGE_SHIFT);
 }
 static NTSTATUS
+__PrepareSegment(
+    IN  PXENVBD_PDO                 Pdo,
+    IN  PXENVBD_SEGMENT             Segment,
+    IN  PSTOR_SCATTER_GATHER_LIST   SGList,
+    IN OUT PXENVBD_SG_INDEX         SGIndex,
+    IN  UCHAR                       Operation,
+    IN  BOOLEAN                     ReadOnly,
+    IN  ULONG                       SectorsLeft,
+    OUT PULONG                      SectorsNow
+    )
+{
+    NTSTATUS                Status;
+    STOR_PHYSICAL_ADDRESS   PhysAddr;
+    ULONG                   PhysLen;
+    PFN_NUMBER              Pfn;
+    ULONG                   GrantRef, FirstSector, LastSector;
+
+    const ULONG     SectorSize      = __SectorSize(Pdo);
+    const ULONG     SectorsPerPage  = __SectorsPerPage(SectorSize);
+
+    SGIndex->LastLength = 0;
+    __GetPhysAddr(SGList, SGIndex, &PhysAddr, &PhysLen);
+    if (__PhysAddrIsAligned(PhysAddr, PhysLen, SectorSize - 1)) {
+        // get first sector, last sector and count
+        FirstSector = (__Offset(PhysAddr) + SectorSize - 1) / SectorSize;
+        *SectorsNow = __Min(SectorsLeft, SectorsPerPage - FirstSector);
+        LastSector  = FirstSector + *SectorsNow - 1;
+
+        ASSERT3U((PhysLen / SectorSize), ==, *SectorsNow);
+        ASSERT3U((PhysLen & (SectorSize - 1)), ==, 0);
+       
+        // simples - grab Pfn of PhysAddr
+        Pfn         = __Pfn(PhysAddr);
+    } else {
+        PMDL        Mdl;
+        ULONG       BufferId;
+        PVOID       Buffer;
+        ULONG       Length;
+
+        // get first sector, last sector and count
+        FirstSector = 0;
+        *SectorsNow = __Min(SectorsLeft, SectorsPerPage);
+        LastSector  = *SectorsNow - 1;
+
+        // map PhysAddr to 1 or 2 pages and lock for VirtAddr
+#pragma warning(push)
+#pragma warning(disable:28145)
+        Mdl = &Segment->Mdl;
+        Mdl->Next           = NULL;
+        Mdl->Size           = (SHORT)(sizeof(MDL) + sizeof(PFN_NUMBER));
+        Mdl->MdlFlags       = MDL_PAGES_LOCKED;
+        Mdl->Process        = NULL;
+        Mdl->MappedSystemVa = NULL;
+        Mdl->StartVa        = NULL;
+        Mdl->ByteCount      = PhysLen;
+        Mdl->ByteOffset     = __Offset(PhysAddr);
+        Segment->Pfn[0]     = __Pfn(PhysAddr);
+#pragma warning(pop)
+
+        if (PhysLen < *SectorsNow * SectorSize) {
+            __GetPhysAddr(SGList, SGIndex, &PhysAddr, &PhysLen);
+            Mdl->Size       += sizeof(PFN_NUMBER);
+            Mdl->ByteCount  = Mdl->ByteCount + PhysLen;
+            Segment->Pfn[1] = __Pfn(PhysAddr);
+        }
+
+        ASSERT((Mdl->ByteCount & (SectorSize - 1)) == 0);
+        ASSERT3U(Mdl->ByteCount, <=, PAGE_SIZE);
+        ASSERT3U(*SectorsNow, ==, (Mdl->ByteCount / SectorSize));
+        
+        Length = __Min(Mdl->ByteCount, PAGE_SIZE);
+        Buffer = MmMapLockedPagesSpecifyCache(Mdl, KernelMode, 
+                                MmCached, NULL, FALSE, HighPagePriority);
+        if (!Buffer)
+            return STATUS_INSUFFICIENT_RESOURCES;
+
+        // get and fill a buffer
+        if (!BufferGet(&BufferId, &Pfn))
+            return STATUS_INSUFFICIENT_RESOURCES;
+        if (Operation == BLKIF_OP_WRITE) {
+            BufferCopyIn(BufferId, Buffer, Length);
+        }
+        Segment->BufferId       = BufferId;
+        Segment->Buffer         = Buffer;
+        Segment->Length         = Length;
+    }
+
+    // Grant and Fill in last details
+    Status = GnttabGet(&GrantRef);
+    if (!NT_SUCCESS(Status))
+        return Status;
+    GnttabPermitForeignAccess(GrantRef, Pdo->Frontend.BackendId, 
+                                Pfn, ReadOnly);
+    
+    Segment->GrantRef       = GrantRef;
+    Segment->FirstSector    = (UCHAR)FirstSector;
+    Segment->LastSector     = (UCHAR)LastSector;
+    return STATUS_SUCCESS;
+}
+static FORCEINLINE PXENVBD_INDIRECT
+__UseIndirect(
+    IN  PXENVBD_PDO             Pdo,
+    IN  ULONG                   Length
+    )
+{
+    PXENVBD_INDIRECT    Indirect = Pdo->Frontend.Indirect;
+
+    // a single direct request is cheaper than mapping an indirect page
+    if (Length <= BLKIF_MAX_SEGMENTS_PER_REQUEST * PAGE_SIZE)
+        return NULL;
+    if (Indirect == NULL || Indirect->InUse)
+        return NULL;
+    return Indirect;
+}
+static NTSTATUS
 PrepareReadWrite(
     IN  PXENVBD_PDO             Pdo,
     IN  PSCSI_REQUEST_BLOCK     Srb
@@ -477,6 +610,8 @@ PrepareReadWrite(
     BOOLEAN         ReadOnly;
     ULONG           Index1, Index2;
     ULONG           SectorsNow;
+    ULONG           NumRequests, MaxSegments;
+    PXENVBD_INDIRECT    Indirect;
 
     PSTOR_SCATTER_GATHER_LIST   SGList;
     XENVBD_SG_INDEX             SGIndex;
@@ -486,9 +621,22 @@ PrepareReadWrite(
     const ULONG64   StartSector     = Cdb_LogicalBlock(Srb);
     const ULONG     NumSectors      = Cdb_TransferBlock(Srb);
     const ULONG     SectorSize      = __SectorSize(Pdo);
-    const ULONG     SectorsPerPage  = __SectorsPerPage(SectorSize);
     __Operation(Cdb_OperationEx(Srb), &Operation, &ReadOnly);
 
+    Indirect = __UseIndirect(Pdo, NumSectors * SectorSize);
+    if (Indirect) {
+        Indirect->InUse = TRUE;
+        NumRequests = 1;
+        MaxSegments = Indirect->MaxSegments;
+    } else if (NumSectors * SectorSize > XENVBD_MAX_TRANSFER_LENGTH) {
+        // too big for direct requests, wait for the indirect page
+        Pdo->NeedsWake = TRUE;
+        return STATUS_DEVICE_BUSY;
+    } else {
+        NumRequests = XENVBD_MAX_REQUESTS_PER_SRB;
+        MaxSegments = BLKIF_MAX_SEGMENTS_PER_REQUEST;
+    }
+
     SGList = StorPortGetScatterGatherList(Pdo->Fdo, Srb);
     RtlZeroMemory(&SGIndex, sizeof(SGIndex));
 
@@ -500,7 +648,7 @@ PrepareReadWrite(
 
     SectorsDone = 0;
     SrbExt->NumRequests = 0;
-    for (Index1 = 0; Index1 < 2; ++Index1) {
+    for (Index1 = 0; Index1 < NumRequests; ++Index1) {
         PXENVBD_REQUEST Request = &SrbExt->Requests[Index1];
         ++SrbExt->NumRequests;
 
@@ -509,101 +657,19 @@ PrepareReadWrite(
         Request->NrSegments = 0;
         Request->FirstSector = StartSector + SectorsDone;
         Request->NrSectors  = 0; // not used for Read/Write
+        Request->Indirect   = Indirect;
 
-        for (Index2 = 0; Index2 < BLKIF_MAX_SEGMENTS_PER_REQUEST; ++Index2) {
-            STOR_PHYSICAL_ADDRESS   PhysAddr;
-            ULONG                   PhysLen;
-            PFN_NUMBER              Pfn;
-            ULONG                   GrantRef, FirstSector, LastSector;
-
+        for (Index2 = 0; Index2 < MaxSegments; ++Index2) {
             Request->NrSegments++;
 
-            SGIndex.LastLength = 0;
-            __GetPhysAddr(SGList, &SGIndex, &PhysAddr, &PhysLen);
-            if (__PhysAddrIsAligned(PhysAddr, PhysLen, SectorSize - 1)) {
-                // get first sector, last sector and count
-                FirstSector = (__Offset(PhysAddr) + SectorSize - 1) / SectorSize;
-                SectorsNow  = __Min(NumSectors - SectorsDone, SectorsPerPage - FirstSector);
-                LastSector  = FirstSector + SectorsNow - 1;
-
-                ASSERT3U((PhysLen / SectorSize), ==, SectorsNow);
-                ASSERT3U((PhysLen & (SectorSize - 1)), ==, 0);
-               
-                // simples - grab Pfn of PhysAddr
-                Pfn         = __Pfn(PhysAddr);
-            } else {
-                PMDL        Mdl;
-                ULONG       BufferId;
-                PVOID       Buffer;
-                ULONG       Length;
-
-                // get first sector, last sector and count
-                FirstSector = 0;
-                SectorsNow  = __Min(NumSectors - SectorsDone, SectorsPerPage);
-                LastSector  = SectorsNow - 1;
-
-                // map PhysAddr to 1 or 2 pages and lock for VirtAddr
-#pragma warning(push)
-#pragma warning(disable:28145)
-                Mdl = &Request->Segments[Index2].Mdl;
-                Mdl->Next           = NULL;
-                Mdl->Size           = (SHORT)(sizeof(MDL) + sizeof(PFN_NUMBER));
-                Mdl->MdlFlags       = MDL_PAGES_LOCKED;
-                Mdl->Process        = NULL;
-                Mdl->MappedSystemVa = NULL;
-                Mdl->StartVa        = NULL;
-                Mdl->ByteCount      = PhysLen;
-                Mdl->ByteOffset     = __Offset(PhysAddr);
-                Request->Segments[Index2].Pfn[0] = __Pfn(PhysAddr);
-#pragma warning(pop)
-
-                if (PhysLen < SectorsNow * SectorSize) {
-                    __GetPhysAddr(SGList, &SGIndex, &PhysAddr, &PhysLen);
-                    Mdl->Size       += sizeof(PFN_NUMBER);
-                    Mdl->ByteCount  = Mdl->ByteCount + PhysLen;
-                    Request->Segments[Index2].Pfn[1] = __Pfn(PhysAddr);
-                }
-
-                ASSERT((Mdl->ByteCount & (SectorSize - 1)) == 0);
-                ASSERT3U(Mdl->ByteCount, <=, PAGE_SIZE);
-                ASSERT3U(SectorsNow, ==, (Mdl->ByteCount / SectorSize));
-                
-                Length = __Min(Mdl->ByteCount, PAGE_SIZE);
-                Buffer = MmMapLockedPagesSpecifyCache(Mdl, KernelMode, 
-                                        MmCached, NULL, FALSE, HighPagePriority);
-                if (!Buffer) {
-                    Pdo->NeedsWake = TRUE;
-                    __CleanupSrb(Srb);
-                    return STATUS_INSUFFICIENT_RESOURCES;
-                }
-
-                // get and fill a buffer
-                if (!BufferGet(&BufferId, &Pfn)) {
-                    Pdo->NeedsWake = TRUE;
-                    __CleanupSrb(Srb);
-                    return STATUS_INSUFFICIENT_RESOURCES;
-                }
-                if (Operation == BLKIF_OP_WRITE) {
-                    BufferCopyIn(BufferId, Buffer, Length);
-                }
-                Request->Segments[Index2].BufferId       = BufferId;
-                Request->Segments[Index2].Buffer         = Buffer;
-                Request->Segments[Index2].Length         = Length;
-            }
-
-            // Grant and Fill in last details
-            Status = GnttabGet(&GrantRef);
+            Status = __PrepareSegment(Pdo, RequestSegment(Request, Index2),
+                                        SGList, &SGIndex, Operation, ReadOnly,
+                                        NumSectors - SectorsDone, &SectorsNow);
             if (!NT_SUCCESS(Status)) {
                 Pdo->NeedsWake = TRUE;
                 __CleanupSrb(Srb);
                 return Status;
             }
-            GnttabPermitForeignAccess(GrantRef, Pdo->Frontend.BackendId, 
-                                        Pfn, ReadOnly);
-            
-            Request->Segments[Index2].GrantRef       = GrantRef;
-            Request->Segments[Index2].FirstSector    = (UCHAR)FirstSector;
-            Request->Segments[Index2].LastSector     = (UCHAR)LastSector;
 
             SectorsDone += SectorsNow;
             if (SectorsDone >= NumSectors) {
@@ -612,7 +678,7 @@ PrepareReadWrite(
             }
         }
         ASSERT3U(Request->NrSegments, >, 0);
-        ASSERT3U(Request->NrSegments, <=, BLKIF_MAX_SEGMENTS_PER_REQUEST);
+        ASSERT3U(Request->NrSegments, <=, MaxSegments);
         if (SectorsDone >= NumSectors) {
             ASSERT3U(SectorsDone, ==, NumSectors);
             goto done;
@@ -621,6 +687,8 @@ PrepareReadWrite(
 
 done:
     __UpdateStats(Pdo, Operation);
+    if (Indirect)
+        Pdo->Indirects++;
     QueueInsertTail(&Pdo->PreparedSrbs, Srb);
     return STATUS_SUCCESS;
 }
@@ -639,6 +707,7 @@ PrepareSyncCache(
 
     Request->Operation      = BLKIF_OP_WRITE_BARRIER;
     Request->NrSegments     = 0;
+    Request->Indirect       = NULL;
     Request->FirstSector    = Cdb_LogicalBlock(Srb);
     Request->NrSectors      = 0;
 
@@ -663,7 +732,11 @@ PdoPrepareFresh(
         switch (Operation) {
         case SCSIOP_READ:
         case SCSIOP_WRITE:
-            PrepareReadWrite(Pdo, Srb);
+            // out of resources (buffers, grants or the indirect page), retry on the next completion
+            if (!NT_SUCCESS(PrepareReadWrite(Pdo, Srb))) {
+                QueueInsertHead(&Pdo->FreshSrbs, Srb);
+                return;
+            }
             break;
         case SCSIOP_SYNCHRONIZE_CACHE:
             PrepareSyncCache(Pdo, Srb);
@@ -817,6 +890,12 @@ PdoReadWrite(
         Srb->ScsiStatus = 0x40; // SCSI_ABORT
         return TRUE; // Complete now
     }
+    // backend may have reconnected without indirect support
+    if (Cdb_TransferBlock(Srb) * __SectorSize(Pdo) > PdoMaxSegments(Pdo) * PAGE_SIZE) {
+        LogError("Target[%d] : Transfer too large (%d sectors)\n", Pdo->Frontend.TargetId, Cdb_TransferBlock(Srb));
+        Srb->ScsiStatus = 0x40; // SCSI_ABORT
+        return TRUE; // Complete now
+    }
 
     Status = PrepareReadWrite(Pdo, Srb);
     if (NT_SUCCESS(Status)) {
@@ -1059,10 +1138,10 @@ __DisplayStats(
     IN  PXENVBD_PDO             Pdo
     )
 {
-    LogVerbose("Target[%d] : BLKIF_OP_'s Reads %d / Writes %d / Others %d\n",
+    LogVerbose("Target[%d] : BLKIF_OP_'s Reads %d / Writes %d / Others %d (Indirect %d)\n",
                 Pdo->Frontend.TargetId,
-                Pdo->Reads, Pdo->Writes, Pdo->Others);
-    Pdo->Reads = Pdo->Writes = Pdo->Others = 0;
+                Pdo->Reads, Pdo->Writes, Pdo->Others, Pdo->Indirects);
+    Pdo->Reads = Pdo->Writes = Pdo->Others = Pdo->Indirects = 0;
 }
 static VOID
 __AbortSrbQueue(
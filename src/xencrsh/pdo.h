@@ -82,6 +82,11 @@ PdoSectorSize(
     IN  PXENVBD_PDO             Pdo
     );
 
+extern ULONG
+PdoMaxSegments(
+    IN  PXENVBD_PDO             Pdo
+    );
+
 // Queue-Related
 extern VOID
 PdoPrepareFresh(
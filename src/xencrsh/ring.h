@@ -34,6 +34,9 @@
 
 #include <xen.h>
 
+// Indirect - a single BLKIF_OP_INDIRECT request, described by one indirect page
+#define XENVBD_MAX_INDIRECT_SEGMENTS    (128)
+
 typedef struct _XENVBD_SEGMENT {
     ULONG               GrantRef;
     UCHAR               FirstSector;
@@ -46,15 +49,37 @@ typedef struct _XENVBD_SEGMENT {
     PFN_NUMBER          Pfn[2];
 } XENVBD_SEGMENT, *PXENVBD_SEGMENT;
 
+// Only one indirect request can be outstanding, dump/hiber IO is serialized anyway
+typedef struct _XENVBD_INDIRECT {
+    BOOLEAN             InUse;
+    ULONG               MaxSegments;
+
+    PVOID               Page;       // blkif_request_segment[], read by the backend
+    ULONG               GrantRef;
+    XENVBD_SEGMENT      Segments[XENVBD_MAX_INDIRECT_SEGMENTS];
+} XENVBD_INDIRECT, *PXENVBD_INDIRECT;
+
 typedef struct _XENVBD_REQUEST {
     PSCSI_REQUEST_BLOCK Srb;  // Parent SRB of this Request
     ULONG               Index;// Index in parent SRB's array
 
     UCHAR               Operation;
-    UCHAR               NrSegments;
+    USHORT              NrSegments;
     ULONG64             FirstSector;
     ULONG64             NrSectors;
+    PXENVBD_INDIRECT    Indirect;   // non-NULL: segments live in Indirect->Segments
     XENVBD_SEGMENT      Segments[BLKIF_MAX_SEGMENTS_PER_REQUEST];
 } XENVBD_REQUEST, *PXENVBD_REQUEST;
 
+FORCEINLINE PXENVBD_SEGMENT
+RequestSegment(
+    IN  PXENVBD_REQUEST     Request,
+    IN  ULONG               Index
+    )
+{
+    if (Request->Indirect)
+        return &Request->Indirect->Segments[Index];
+    return &Request->Segments[Index];
+}
+
 #endif // _XENVBD_RING_H
@@ -43,6 +43,10 @@
 #define MAX_OUTSTANDING_REQUESTS    256
 #define TAG_HEADER                  'gaTX'
 
+// busy-poll budget limits, in microseconds
+#define POLL_MAX_BUDGET             1000
+#define POLL_MIN_BUDGET             2
+
 struct _XENVBD_BLOCKRING {
     PXENVBD_FRONTEND                Frontend;
     BOOLEAN                         Connected;
@@ -50,17 +54,38 @@ struct _XENVBD_BLOCKRING {
 
     PXENBUS_STORE_INTERFACE         StoreInterface;
 
-    KSPIN_LOCK                      Lock;
     PMDL                            Mdl;
     blkif_sring_t*                  SharedRing;
-    blkif_front_ring_t              FrontRing;
     ULONG                           DeviceId;
     ULONG                           Order;
     PVOID                           Grants[XENVBD_MAX_RING_PAGES];
-    ULONG                           Outstanding;
+
+    // Busy-poll, opt-in via "poll-max-us" in the target path
+    ULONG                           PollMax;
+    LONG                            Spinning;       // one poller per ring, see BlockRingSpin
+    LONG                            PollBudget;
+    LONG                            Spins;
+    LONG                            SpinHits;
+    LONGLONG                        SpinTicks;
+
+    // Ring - submitters and the poller take Lock, which protects everything up to Outstanding
+    DECLSPEC_CACHEALIGN
+    KSPIN_LOCK                      Lock;
+    blkif_front_ring_t              FrontRing;
     ULONG                           Submitted;
     ULONG                           Recieved;
     PXENVBD_REQUEST                 Tags[MAX_OUTSTANDING_REQUESTS];
+
+    // Stats - Poll
+    ULONG                           Polls;
+    ULONG                           Harvested;
+    ULONG                           MaxBatch;
+    LONGLONG                        LockTicks;
+    LONGLONG                        MaxLockTicks;
+
+    // Outstanding - interlocked, completions drop it after releasing Lock
+    DECLSPEC_CACHEALIGN
+    LONG                            Outstanding;
 };
 
 #define MAX_NAME_LEN                64
@@ -224,6 +249,8 @@ __BlockRingInsert(
         req_indirect->sector_number     = Request->u.Indirect.FirstSector;
         req_indirect->handle            = (USHORT)BlockRing->DeviceId;
         for (Index = 0; Index < BLKIF_MAX_INDIRECT_PAGES_PER_REQUEST; ++Index) {
+            if (Request->u.Indirect.Grants[Index] == NULL)
+                break;
             req_indirect->indirect_grefs[Index] = GranterReference(Granter, Request->u.Indirect.Grants[Index]);
         }
         break;
@@ -233,7 +260,7 @@ __BlockRingInsert(
         break;
     }
     ++BlockRing->Submitted;
-    ++BlockRing->Outstanding;
+    InterlockedIncrement(&BlockRing->Outstanding);
 }
 
 NTSTATUS
@@ -265,6 +292,13 @@ BlockRingDestroy(
     BlockRing->Frontend = NULL;
     BlockRing->DeviceId = 0;
     BlockRing->Order = 0;
+    BlockRing->Submitted = BlockRing->Recieved = 0;
+    BlockRing->Polls = BlockRing->Harvested = BlockRing->MaxBatch = 0;
+    BlockRing->LockTicks = BlockRing->MaxLockTicks = 0;
+    BlockRing->PollMax = 0;
+    BlockRing->PollBudget = 0;
+    BlockRing->Spins = BlockRing->SpinHits = 0;
+    BlockRing->SpinTicks = 0;
     RtlZeroMemory(&BlockRing->Lock, sizeof(KSPIN_LOCK));
     
     ASSERT(IsZeroMemory(BlockRing, sizeof(XENVBD_BLOCKRING)));
@@ -295,6 +329,15 @@ BlockRingConnect(
         BlockRing->Order = 0;
     }
 
+    status = FrontendStoreReadTarget(BlockRing->Frontend, "poll-max-us", &Value);
+    if (NT_SUCCESS(status)) {
+        BlockRing->PollMax = __min(strtoul(Value, NULL, 10), POLL_MAX_BUDGET);
+        FrontendStoreFree(BlockRing->Frontend, Value);
+    } else {
+        BlockRing->PollMax = 0;
+    }
+    BlockRing->PollBudget = (LONG)BlockRing->PollMax;
+
     status = STATUS_NO_MEMORY;
     BlockRing->SharedRing = __AllocPages((SIZE_T)PAGE_SIZE << BlockRing->Order, &BlockRing->Mdl);
     if (BlockRing->SharedRing == NULL)
@@ -451,7 +494,8 @@ BlockRingDebugCallback(
     IN  PXENBUS_DEBUG_CALLBACK      Callback
     )
 {
-    ULONG   Index;
+    ULONG           Index;
+    LARGE_INTEGER   Frequency;
 
     DEBUG(Printf, Debug, Callback,
             "BLOCKRING: Requests : %d / %d / %d\n", 
@@ -487,7 +531,40 @@ BlockRingDebugCallback(
                 Index, BlockRing->Grants[Index]);
     }
 
+    Frequency.QuadPart = 0;
+    (VOID) KeQueryPerformanceCounter(&Frequency);
+    DEBUG(Printf, Debug, Callback,
+            "BLOCKRING: Polls : %u (%u responses, max batch %u)\n",
+            BlockRing->Polls,
+            BlockRing->Harvested,
+            BlockRing->MaxBatch);
+    if (Frequency.QuadPart && BlockRing->Polls) {
+        DEBUG(Printf, Debug, Callback,
+                "BLOCKRING: Lock Held : %llu us avg / %llu us max\n",
+                ((ULONG64)BlockRing->LockTicks * 1000000ull) / (Frequency.QuadPart * BlockRing->Polls),
+                ((ULONG64)BlockRing->MaxLockTicks * 1000000ull) / Frequency.QuadPart);
+    }
+
     BlockRing->Submitted = BlockRing->Recieved = 0;
+    if (BlockRing->PollMax) {
+        DEBUG(Printf, Debug, Callback,
+                "BLOCKRING: Busy-Poll : %d us budget (max %u us), %d / %d hits\n",
+                BlockRing->PollBudget,
+                BlockRing->PollMax,
+                BlockRing->SpinHits,
+                BlockRing->Spins);
+        if (Frequency.QuadPart) {
+            DEBUG(Printf, Debug, Callback,
+                    "BLOCKRING: Busy-Poll : %llu us spent spinning\n",
+                    ((ULONG64)BlockRing->SpinTicks * 1000000ull) / Frequency.QuadPart);
+        }
+    }
+
+    BlockRing->Polls = BlockRing->Harvested = BlockRing->MaxBatch = 0;
+    BlockRing->LockTicks = BlockRing->MaxLockTicks = 0;
+    (VOID) InterlockedExchange(&BlockRing->Spins, 0);
+    (VOID) InterlockedExchange(&BlockRing->SpinHits, 0);
+    (VOID) InterlockedExchange64(&BlockRing->SpinTicks, 0);
 }
 
 VOID
@@ -495,10 +572,17 @@ BlockRingPoll(
     IN  PXENVBD_BLOCKRING           BlockRing
     )
 {
-    PXENVBD_PDO Pdo = FrontendGetPdo(BlockRing->Frontend);
+    PXENVBD_PDO     Pdo = FrontendGetPdo(BlockRing->Frontend);
+    LIST_ENTRY      List;
+    ULONG           Count = 0;
+    LARGE_INTEGER   Start;
+    LARGE_INTEGER   End;
+
+    InitializeListHead(&List);
 
     ASSERT3U(KeGetCurrentIrql(), ==, DISPATCH_LEVEL);
     KeAcquireSpinLockAtDpcLevel(&BlockRing->Lock);
+    Start = KeQueryPerformanceCounter(NULL);
 
     // Guard against this locked region being called after the 
     // lock on FrontendSetState
@@ -526,11 +610,13 @@ BlockRingPoll(
             Response = RING_GET_RESPONSE(&BlockRing->FrontRing, rsp_cons);
             ++rsp_cons;
 
+            // only harvest here, cleanup and completion happen without the lock
             Request = __BlockRingPutTag(BlockRing, Response->id);
             if (Request) {
                 ++BlockRing->Recieved;
-                --BlockRing->Outstanding;
-                PdoCompleteSubmitted(Pdo, Request, Response->status);
+                ++Count;
+                Request->Status = Response->status;
+                InsertTailList(&List, &Request->Entry);
             }
 
             RtlZeroMemory(Response, sizeof(union blkif_sring_entry));
@@ -543,7 +629,25 @@ BlockRingPoll(
     }
 
 done:
+    End = KeQueryPerformanceCounter(NULL);
+    ++BlockRing->Polls;
+    BlockRing->Harvested += Count;
+    if (Count > BlockRing->MaxBatch)
+        BlockRing->MaxBatch = Count;
+    BlockRing->LockTicks += End.QuadPart - Start.QuadPart;
+    if (End.QuadPart - Start.QuadPart > BlockRing->MaxLockTicks)
+        BlockRing->MaxLockTicks = End.QuadPart - Start.QuadPart;
     KeReleaseSpinLockFromDpcLevel(&BlockRing->Lock);
+
+    // Outstanding still counts harvested requests until they are completed,
+    // so anyone waiting for the ring to drain waits for this loop too
+    while (!IsListEmpty(&List)) {
+        PLIST_ENTRY     Entry = RemoveHeadList(&List);
+        PXENVBD_REQUEST Request = CONTAINING_RECORD(Entry, XENVBD_REQUEST, Entry);
+
+        PdoCompleteSubmitted(Pdo, Request, Request->Status);
+        InterlockedDecrement(&BlockRing->Outstanding);
+    }
 }
 
 BOOLEAN
@@ -556,7 +660,8 @@ BlockRingSubmit(
     blkif_request_t*    req;
 
     KeAcquireSpinLock(&BlockRing->Lock, &Irql);
-    if (RING_FULL(&BlockRing->FrontRing)) {
+    if (RING_FULL(&BlockRing->FrontRing) ||
+        BlockRing->Outstanding >= MAX_OUTSTANDING_REQUESTS) {
         KeReleaseSpinLock(&BlockRing->Lock, Irql);
         return FALSE;
     }
@@ -570,6 +675,51 @@ BlockRingSubmit(
     return TRUE;
 }
 
+PXENVBD_REQUEST
+BlockRingAbort(
+    IN  PXENVBD_BLOCKRING           BlockRing
+    )
+{
+    KIRQL               Irql;
+    ULONG               Index;
+    PXENVBD_REQUEST     Request = NULL;
+
+    KeAcquireSpinLock(&BlockRing->Lock, &Irql);
+    for (Index = 0; Index < MAX_OUTSTANDING_REQUESTS; ++Index) {
+        if (BlockRing->Tags[Index] == NULL)
+            continue;
+
+        // tag is dropped, any late response will fail __BlockRingPutTag
+        Request = BlockRing->Tags[Index];
+        BlockRing->Tags[Index] = NULL;
+        InterlockedDecrement(&BlockRing->Outstanding);
+        break;
+    }
+    KeReleaseSpinLock(&BlockRing->Lock, Irql);
+
+    return Request;
+}
+
+ULONG
+BlockRingSize(
+    IN  PXENVBD_BLOCKRING           BlockRing
+    )
+{
+    if (!BlockRing->Connected)
+        return 0;
+
+    // the tag table bounds the number of in-flight requests
+    return __min(RING_SIZE(&BlockRing->FrontRing), MAX_OUTSTANDING_REQUESTS);
+}
+
+ULONG
+BlockRingOutstanding(
+    IN  PXENVBD_BLOCKRING           BlockRing
+    )
+{
+    return (ULONG)BlockRing->Outstanding;
+}
+
 BOOLEAN
 BlockRingPush(
     IN  PXENVBD_BLOCKRING           BlockRing
@@ -582,3 +732,93 @@ BlockRingPush(
     return Notify;
 }
 
+static FORCEINLINE BOOLEAN
+__BlockRingHasResponses(
+    IN  PXENVBD_BLOCKRING           BlockRing
+    )
+{
+    KeMemoryBarrier();
+    return *(volatile RING_IDX*)&BlockRing->SharedRing->rsp_prod != BlockRing->FrontRing.rsp_cons;
+}
+
+static FORCEINLINE VOID
+__BlockRingSetResponseEvent(
+    IN  PXENVBD_BLOCKRING           BlockRing,
+    IN  BOOLEAN                     Suppress
+    )
+{
+    KIRQL   Irql;
+
+    KeAcquireSpinLock(&BlockRing->Lock, &Irql);
+    if (BlockRing->Enabled) {
+        // at most RING_SIZE responses can be produced past rsp_cons, so an
+        // event beyond that is never crossed and the backend does not notify
+        BlockRing->SharedRing->rsp_event = BlockRing->FrontRing.rsp_cons +
+                        (Suppress ? RING_SIZE(&BlockRing->FrontRing) + 1 : 1);
+        xen_mb();
+    }
+    KeReleaseSpinLock(&BlockRing->Lock, Irql);
+}
+
+BOOLEAN
+BlockRingSpin(
+    IN  PXENVBD_BLOCKRING           BlockRing
+    )
+{
+    LARGE_INTEGER   Frequency;
+    LARGE_INTEGER   Start;
+    LARGE_INTEGER   Now;
+    LONGLONG        Limit;
+    LONG            Budget;
+    BOOLEAN         Hit = FALSE;
+
+    if (BlockRing->PollMax == 0 ||
+        !BlockRing->Enabled ||
+        BlockRing->Outstanding == 0)
+        return FALSE;
+
+    // another submitter is already spinning, leave the responses to it or the event channel
+    if (InterlockedCompareExchange(&BlockRing->Spinning, 1, 0) != 0)
+        return FALSE;
+
+    Start = KeQueryPerformanceCounter(&Frequency);
+    Limit = (Frequency.QuadPart * BlockRing->PollBudget) / 1000000;
+
+    __BlockRingSetResponseEvent(BlockRing, TRUE);
+    for (;;) {
+        if (__BlockRingHasResponses(BlockRing)) {
+            Hit = TRUE;
+            break;
+        }
+
+        Now = KeQueryPerformanceCounter(NULL);
+        if (Now.QuadPart - Start.QuadPart >= Limit)
+            break;
+
+        YieldProcessor();
+    }
+    __BlockRingSetResponseEvent(BlockRing, FALSE);
+
+    // a response that landed while the event was suppressed raised no interrupt
+    if (!Hit)
+        Hit = __BlockRingHasResponses(BlockRing);
+
+    Now = KeQueryPerformanceCounter(NULL);
+    InterlockedIncrement(&BlockRing->Spins);
+    (VOID) InterlockedExchangeAdd64(&BlockRing->SpinTicks, Now.QuadPart - Start.QuadPart);
+
+    // grow the budget while spinning pays off, back off when it does not
+    Budget = BlockRing->PollBudget;
+    if (Hit) {
+        InterlockedIncrement(&BlockRing->SpinHits);
+        Budget = __min(Budget * 2, (LONG)BlockRing->PollMax);
+    } else {
+        Budget = Budget / 2;
+        if (Budget < POLL_MIN_BUDGET)
+            Budget = __min(POLL_MIN_BUDGET, (LONG)BlockRing->PollMax);
+    }
+    (VOID) InterlockedExchange(&BlockRing->PollBudget, Budget);
+
+    InterlockedExchange(&BlockRing->Spinning, 0);
+    return Hit;
+}
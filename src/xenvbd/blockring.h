@@ -95,9 +95,29 @@ BlockRingSubmit(
     IN  PXENVBD_REQUEST             Request
     );
 
+extern PXENVBD_REQUEST
+BlockRingAbort(
+    IN  PXENVBD_BLOCKRING           BlockRing
+    );
+
+extern ULONG
+BlockRingSize(
+    IN  PXENVBD_BLOCKRING           BlockRing
+    );
+
+extern ULONG
+BlockRingOutstanding(
+    IN  PXENVBD_BLOCKRING           BlockRing
+    );
+
 extern BOOLEAN
 BlockRingPush(
     IN  PXENVBD_BLOCKRING           BlockRing
     );
 
+extern BOOLEAN
+BlockRingSpin(
+    IN  PXENVBD_BLOCKRING           BlockRing
+    );
+
 #endif // _XENVBD_BLOCKRING_H
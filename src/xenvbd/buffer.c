@@ -34,11 +34,23 @@
 #include "debug.h"
 #include "assert.h"
 #include "util.h"
+#include "driver.h"
+
+#include <intrin.h>
+#if defined(_M_AMD64)
+#include <emmintrin.h>
+#endif
+#if defined(_M_AMD64) || defined(_M_IX86)
+#include <nmmintrin.h>
+#endif
 
 #define BUFFER_POOL_TAG 'fuBX'
 
 #define BUFFER_MIN_COUNT         32
 
+#define CRC32C_POLY             0x82F63B78  // Castagnoli, reflected
+#define CRC32C_CALIBRATE_PAGES  256         // 1MiB
+
 extern PHYSICAL_ADDRESS MmGetPhysicalAddress(PVOID BaseAddress);
 
 typedef struct _XENVBD_BUFFER {
@@ -49,9 +61,16 @@ typedef struct _XENVBD_BUFFER {
     PVOID               Context;
 } XENVBD_BUFFER, *PXENVBD_BUFFER;
 
+typedef VOID (*PXENVBD_BUFFER_COPY)(PVOID, const VOID*, ULONG);
+typedef ULONG (*PXENVBD_BUFFER_CRC)(ULONG, const VOID*, ULONG);
+
 typedef struct _XENVBD_BOUNCE_BUFFER {
     LIST_ENTRY          FreeList;
     LIST_ENTRY          UsedList;
+    LIST_ENTRY          ReserveList;
+    ULONG               ReserveSize;
+    ULONG               ReserveTarget;
+    ULONG               ReserveUsed;
     ULONG               FreeSize;
     ULONG               UsedSize;
     ULONG               FreeMaxSize;
@@ -62,15 +81,188 @@ typedef struct _XENVBD_BOUNCE_BUFFER {
     ULONG               Reaped;
     ULONG               Allocated;
     ULONG               Freed;
+    // Copy kernels - selected in BufferInitialize
+    const CHAR*         CopyInName;
+    PXENVBD_BUFFER_COPY CopyIn;
+    const CHAR*         CrcName;
+    PXENVBD_BUFFER_CRC  Crc;
+    ULONG64             CrcCost;    // us per GiB, measured in BufferInitialize
 } XENVBD_BOUNCE_BUFFER, *PXENVBD_BOUNCE_BUFFER;
 
 static XENVBD_BOUNCE_BUFFER __Buffer;
+static ULONG                __Crc32cTable[256];
 
 #define TIME_US(_us)        ((_us) * 10)
 #define TIME_MS(_ms)        (TIME_US((_ms) * 1000))
 #define TIME_S(_s)          (TIME_MS((_s) * 1000))
 #define TIME_RELATIVE(_t)   (-(_t))
 
+static VOID
+__BufferCopyCached(
+    IN  PVOID                   Destination,
+    IN  const VOID*             Source,
+    IN  ULONG                   Length
+    )
+{
+    RtlCopyMemory(Destination, Source, Length);
+}
+
+#if defined(_M_AMD64)
+// a bounced write payload is only read again by the backend, non-temporal stores keep it
+// out of the cache instead of evicting the guest's working set. The destination is a
+// bounce page, so always 16 byte aligned, the source is wherever the SG element starts
+static VOID
+__BufferCopyStream(
+    IN  PVOID                   Destination,
+    IN  const VOID*             Source,
+    IN  ULONG                   Length
+    )
+{
+    __m128i*        Dst = (__m128i*)Destination;
+    const __m128i*  Src = (const __m128i*)Source;
+
+    ASSERT3U(((ULONG_PTR)Destination & 15), ==, 0);
+
+    while (Length >= 64) {
+        __m128i A = _mm_loadu_si128(Src + 0);
+        __m128i B = _mm_loadu_si128(Src + 1);
+        __m128i C = _mm_loadu_si128(Src + 2);
+        __m128i D = _mm_loadu_si128(Src + 3);
+
+        _mm_stream_si128(Dst + 0, A);
+        _mm_stream_si128(Dst + 1, B);
+        _mm_stream_si128(Dst + 2, C);
+        _mm_stream_si128(Dst + 3, D);
+
+        Src    += 4;
+        Dst    += 4;
+        Length -= 64;
+    }
+    if (Length)
+        RtlCopyMemory(Dst, Src, Length);
+
+    // order the write-combined stores before the grant is pushed to the ring
+    _mm_sfence();
+}
+#endif
+
+static VOID
+__BufferSelectCopy(
+    )
+{
+    __Buffer.CopyInName = "CACHED";
+    __Buffer.CopyIn     = __BufferCopyCached;
+
+#if defined(_M_AMD64)
+    if (DriverParameters.StreamingCopy &&
+        ExIsProcessorFeaturePresent(PF_XMMI64_INSTRUCTIONS_AVAILABLE)) {
+        __Buffer.CopyInName = "SSE2-STREAM";
+        __Buffer.CopyIn     = __BufferCopyStream;
+    }
+#endif
+
+    Verbose("Copy In %s, Copy Out CACHED\n", __Buffer.CopyInName);
+}
+
+static ULONG
+__BufferCrcTable(
+    IN  ULONG                   Crc,
+    IN  const VOID*             Buffer,
+    IN  ULONG                   Length
+    )
+{
+    const UCHAR*    Byte = (const UCHAR*)Buffer;
+
+    while (Length--)
+        Crc = __Crc32cTable[(Crc ^ *Byte++) & 0xFF] ^ (Crc >> 8);
+    return Crc;
+}
+
+#if defined(_M_AMD64) || defined(_M_IX86)
+// the SSE4.2 crc32 instruction works on general purpose registers, so needs no saved state
+static ULONG
+__BufferCrcSse42(
+    IN  ULONG                   Crc,
+    IN  const VOID*             Buffer,
+    IN  ULONG                   Length
+    )
+{
+    const UCHAR*    Byte = (const UCHAR*)Buffer;
+
+#if defined(_M_AMD64)
+    ULONG64         Crc64 = Crc;
+
+    for (; Length >= 8; Length -= 8, Byte += 8)
+        Crc64 = _mm_crc32_u64(Crc64, *(const ULONG64 UNALIGNED*)Byte);
+    Crc = (ULONG)Crc64;
+#endif
+    for (; Length >= 4; Length -= 4, Byte += 4)
+        Crc = _mm_crc32_u32(Crc, *(const ULONG UNALIGNED*)Byte);
+    for (; Length != 0; --Length)
+        Crc = _mm_crc32_u8(Crc, *Byte++);
+    return Crc;
+}
+#endif
+
+static VOID
+__BufferSelectCrc(
+    )
+{
+    ULONG   Index;
+
+    for (Index = 0; Index < ARRAYSIZE(__Crc32cTable); ++Index) {
+        ULONG   Crc = Index;
+        ULONG   Bit;
+
+        for (Bit = 0; Bit < 8; ++Bit)
+            Crc = (Crc & 1) ? (Crc >> 1) ^ CRC32C_POLY : (Crc >> 1);
+        __Crc32cTable[Index] = Crc;
+    }
+
+    __Buffer.CrcName = "TABLE";
+    __Buffer.Crc     = __BufferCrcTable;
+
+#if defined(_M_AMD64) || defined(_M_IX86)
+    {
+        int     Info[4];
+
+        __cpuid(Info, 1);
+        if (Info[2] & (1 << 20)) { // CPUID.01H:ECX.SSE4_2
+            __Buffer.CrcName = "SSE4.2";
+            __Buffer.Crc     = __BufferCrcSse42;
+        }
+    }
+#endif
+}
+
+// times the CRC32C kernel over a bounce page, so the cost of the integrity mode is known
+// before a target turns it on, see PdoSetIntegrity
+static VOID
+__BufferCalibrateCrc(
+    )
+{
+    PXENVBD_BUFFER  BufferId;
+    LARGE_INTEGER   Frequency;
+    LARGE_INTEGER   Start;
+    LONGLONG        Ticks;
+    ULONG           Crc = 0;
+    ULONG           Index;
+
+    if (IsListEmpty(&__Buffer.FreeList))
+        return;
+    BufferId = CONTAINING_RECORD(__Buffer.FreeList.Flink, XENVBD_BUFFER, Entry);
+
+    Start = KeQueryPerformanceCounter(&Frequency);
+    for (Index = 0; Index < CRC32C_CALIBRATE_PAGES; ++Index)
+        Crc = __Buffer.Crc(Crc, BufferId->VAddr, PAGE_SIZE);
+    Ticks = KeQueryPerformanceCounter(NULL).QuadPart - Start.QuadPart;
+
+    __Buffer.CrcCost = ((ULONG64)Ticks * 1000000ull * ((1ull << 30) / (CRC32C_CALIBRATE_PAGES * PAGE_SIZE))) /
+                        Frequency.QuadPart;
+
+    Verbose("CRC32C %s %llu us/GiB (%08x)\n", __Buffer.CrcName, __Buffer.CrcCost, Crc);
+}
+
 static DECLSPEC_NOINLINE PXENVBD_BUFFER
 __BufferAlloc()
 {
@@ -205,6 +397,57 @@ __BufferRemoveUsedList(
     BufferId->Entry.Blink = NULL;
     --__Buffer.UsedSize;
 }
+static DECLSPEC_NOINLINE VOID
+__BufferPushReserveList(
+    IN PXENVBD_BUFFER           BufferId
+    )
+{
+    ASSERT3P(BufferId->Entry.Flink, ==, NULL);
+    ASSERT3P(BufferId->Entry.Blink, ==, NULL);
+
+    InsertHeadList(&__Buffer.ReserveList, &BufferId->Entry);
+    ++__Buffer.ReserveSize;
+}
+static DECLSPEC_NOINLINE PXENVBD_BUFFER
+__BufferPopReserveList(
+)
+{
+    PLIST_ENTRY     Entry;
+
+    Entry = RemoveHeadList(&__Buffer.ReserveList);
+    if (Entry && Entry != &__Buffer.ReserveList) {
+        PXENVBD_BUFFER BufferId = CONTAINING_RECORD(Entry, XENVBD_BUFFER, Entry);
+        BufferId->Entry.Flink = NULL;
+        BufferId->Entry.Blink = NULL;
+        --__Buffer.ReserveSize;
+        return BufferId;
+    }
+
+    return NULL;
+}
+static DECLSPEC_NOINLINE VOID
+__BufferFillReserve(
+    )
+{
+    PXENVBD_BUFFER  BufferId;
+
+    // prefer free buffers, then allocate
+    while (__Buffer.ReserveSize < __Buffer.ReserveTarget) {
+        BufferId = __BufferPopFreeList();
+        if (BufferId == NULL)
+            BufferId = __BufferAlloc();
+        if (BufferId == NULL)
+            break;
+        __BufferPushReserveList(BufferId);
+    }
+    // return any excess to the free list
+    while (__Buffer.ReserveSize > __Buffer.ReserveTarget) {
+        BufferId = __BufferPopReserveList();
+        if (BufferId == NULL)
+            break;
+        __BufferPushFreeList(BufferId);
+    }
+}
 static DECLSPEC_NOINLINE NTSTATUS
 __BufferReaperThread(
     IN PXENVBD_THREAD           Thread,
@@ -238,6 +481,8 @@ __BufferReaperThread(
                 __BufferFree(BufferId);
             }
         }
+        // top up the reserve if an earlier allocation failed
+        __BufferFillReserve();
         KeReleaseSpinLock(&__Buffer.Lock, Irql);
     }
 
@@ -255,6 +500,9 @@ BufferInitialize(
     KeInitializeSpinLock(&__Buffer.Lock);
     InitializeListHead(&__Buffer.FreeList);
     InitializeListHead(&__Buffer.UsedList);
+    InitializeListHead(&__Buffer.ReserveList);
+    __BufferSelectCopy();
+    __BufferSelectCrc();
 
     for (i = 0; i < BUFFER_MIN_COUNT; ++i) {
         BufferId = __BufferAlloc();
@@ -262,6 +510,7 @@ BufferInitialize(
             __BufferPushFreeList(BufferId);
         }
     }
+    __BufferCalibrateCrc();
 
     if (__Buffer.Thread == NULL) {
         (VOID) ThreadCreate(__BufferReaperThread, NULL, &__Buffer.Thread);
@@ -284,6 +533,9 @@ BufferTerminate(
         Warning("Potentially leaking buffer @ 0x%p\n", BufferId->VAddr);
         __BufferPushFreeList(BufferId);
     }
+    while ((BufferId = __BufferPopReserveList()) != NULL) {
+        __BufferPushFreeList(BufferId);
+    }
     while ((BufferId = __BufferPopFreeList()) != NULL) {
         __BufferFree(BufferId);
     }
@@ -322,6 +574,37 @@ BufferGet(
     return Result;
 }
 
+__checkReturn
+BOOLEAN
+BufferGetReserved(
+    __in  PVOID             _Context,
+    __out PVOID*            _BufferId,
+    __out PFN_NUMBER*       Pfn
+    )
+{
+    PXENVBD_BUFFER  BufferId;
+    KIRQL           Irql;
+    BOOLEAN         Result = FALSE;
+
+    *_BufferId = NULL;
+    *Pfn = 0;
+
+    KeAcquireSpinLock(&__Buffer.Lock, &Irql);
+    BufferId = __BufferPopReserveList();
+    if (BufferId) {
+        ++__Buffer.ReserveUsed;
+        __BufferPushUsedList(BufferId);
+
+        BufferId->Context = _Context;
+        *_BufferId = BufferId;
+        *Pfn = BufferId->Pfn;
+        Result = TRUE;
+    }
+    KeReleaseSpinLock(&__Buffer.Lock, Irql);
+
+    return Result;
+}
+
 VOID
 BufferPut(
     __in PVOID              _BufferId
@@ -333,7 +616,38 @@ BufferPut(
     KeAcquireSpinLock(&__Buffer.Lock, &Irql);
     __BufferRemoveUsedList(BufferId);
     BufferId->Context = NULL;
-    __BufferPushFreeList(BufferId);
+    // replenish the reserve first
+    if (__Buffer.ReserveSize < __Buffer.ReserveTarget)
+        __BufferPushReserveList(BufferId);
+    else
+        __BufferPushFreeList(BufferId);
+    KeReleaseSpinLock(&__Buffer.Lock, Irql);
+}
+
+VOID
+BufferReserve(
+    __in ULONG              Count
+    )
+{
+    KIRQL           Irql;
+
+    KeAcquireSpinLock(&__Buffer.Lock, &Irql);
+    __Buffer.ReserveTarget += Count;
+    __BufferFillReserve();
+    KeReleaseSpinLock(&__Buffer.Lock, Irql);
+}
+
+VOID
+BufferUnreserve(
+    __in ULONG              Count
+    )
+{
+    KIRQL           Irql;
+
+    KeAcquireSpinLock(&__Buffer.Lock, &Irql);
+    ASSERT3U(__Buffer.ReserveTarget, >=, Count);
+    __Buffer.ReserveTarget -= Count;
+    __BufferFillReserve();
     KeReleaseSpinLock(&__Buffer.Lock, Irql);
 }
 
@@ -352,7 +666,7 @@ BufferCopyIn(
 
     ASSERT3P(BufferId->VAddr, !=, NULL);
     ASSERT(IsOnList(&__Buffer.UsedList, &BufferId->Entry));
-    RtlCopyMemory(BufferId->VAddr, Input, Length);
+    __Buffer.CopyIn(BufferId->VAddr, Input, Length);
 }
 
 VOID
@@ -370,9 +684,65 @@ BufferCopyOut(
 
     ASSERT3P(BufferId->VAddr, !=, NULL);
     ASSERT(IsOnList(&__Buffer.UsedList, &BufferId->Entry));
+    // read data is consumed by the guest next, so a cached copy
     RtlCopyMemory(Output, BufferId->VAddr, Length);
 }
 
+// SSE2 is architectural on x64 and the XMM registers are volatile, so no state is saved.
+// x86 would need KeSaveExtendedProcessorState, it scans a machine word at a time instead
+BOOLEAN
+BufferIsZero(
+    __in PVOID              Buffer,
+    __in ULONG              Length
+    )
+{
+    const UCHAR*    Byte = (const UCHAR*)Buffer;
+
+    ASSERT3P(Buffer, !=, NULL);
+
+#if defined(_M_AMD64)
+    // 64 bytes per iteration, stopping at the first line with a set bit
+    while (Length >= 64) {
+        __m128i Lines;
+
+        Lines = _mm_or_si128(
+                    _mm_or_si128(_mm_loadu_si128((const __m128i*)(Byte + 0)),
+                                 _mm_loadu_si128((const __m128i*)(Byte + 16))),
+                    _mm_or_si128(_mm_loadu_si128((const __m128i*)(Byte + 32)),
+                                 _mm_loadu_si128((const __m128i*)(Byte + 48))));
+        if (_mm_movemask_epi8(_mm_cmpeq_epi8(Lines, _mm_setzero_si128())) != 0xFFFF)
+            return FALSE;
+
+        Byte   += 64;
+        Length -= 64;
+    }
+#endif
+
+    while (Length >= sizeof(ULONG_PTR)) {
+        if (*(const ULONG_PTR UNALIGNED*)Byte != 0)
+            return FALSE;
+        Byte   += sizeof(ULONG_PTR);
+        Length -= sizeof(ULONG_PTR);
+    }
+    while (Length != 0) {
+        if (*Byte != 0)
+            return FALSE;
+        ++Byte;
+        --Length;
+    }
+    return TRUE;
+}
+
+ULONG
+BufferCrc32c(
+    __in PVOID              Buffer,
+    __in ULONG              Length
+    )
+{
+    ASSERT3P(Buffer, !=, NULL);
+    return ~__Buffer.Crc(~0ul, Buffer, Length);
+}
+
 VOID 
 BufferDebugCallback(
     __in PXENBUS_DEBUG_INTERFACE DebugInterface,
@@ -390,6 +760,15 @@ BufferDebugCallback(
     DEBUG(Printf, DebugInterface, DebugCallback,
             "BUFFER: Used (Cur/Max)  : %d / %d\n",
             __Buffer.UsedSize, __Buffer.UsedMaxSize);
+    DEBUG(Printf, DebugInterface, DebugCallback,
+            "BUFFER: Reserve (Cur/Tgt): %d / %d (%d used)\n",
+            __Buffer.ReserveSize, __Buffer.ReserveTarget, __Buffer.ReserveUsed);
+    DEBUG(Printf, DebugInterface, DebugCallback,
+            "BUFFER: Copy In/Out      : %s / CACHED\n",
+            __Buffer.CopyInName);
+    DEBUG(Printf, DebugInterface, DebugCallback,
+            "BUFFER: CRC32C           : %s (%llu us/GiB)\n",
+            __Buffer.CrcName, __Buffer.CrcCost);
 
     for (Entry = __Buffer.UsedList.Flink; Entry != &__Buffer.UsedList; Entry = Entry->Flink) {
         PXENVBD_BUFFER BufferId = CONTAINING_RECORD(Entry, XENVBD_BUFFER, Entry);
@@ -52,11 +52,29 @@ BufferGet(
     __out PFN_NUMBER*       Pfn
     );
 
+__checkReturn
+extern BOOLEAN
+BufferGetReserved(
+    __in  PVOID             Context,
+    __out PVOID*            BufferId,
+    __out PFN_NUMBER*       Pfn
+    );
+
 extern VOID
 BufferPut(
     __in  PVOID             BufferId
     );
 
+extern VOID
+BufferReserve(
+    __in  ULONG             Count
+    );
+
+extern VOID
+BufferUnreserve(
+    __in  ULONG             Count
+    );
+
 extern VOID
 BufferCopyIn(
     __in  PVOID             BufferId,
@@ -71,6 +89,19 @@ BufferCopyOut(
     __in  ULONG             Length
     );
 
+__checkReturn
+extern BOOLEAN
+BufferIsZero(
+    __in  PVOID             Buffer,
+    __in  ULONG             Length
+    );
+
+extern ULONG
+BufferCrc32c(
+    __in  PVOID             Buffer,
+    __in  ULONG             Length
+    );
+
 extern VOID 
 BufferDebugCallback(
     __in PXENBUS_DEBUG_INTERFACE DebugInterface,
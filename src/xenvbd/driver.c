@@ -170,6 +170,8 @@ __DriverParseParameterKey(
     // Set default parameters
     DriverParameters.SynthesizeInquiry = FALSE;
     DriverParameters.PVCDRom           = FALSE;
+    DriverParameters.LocalCompletion   = TRUE;
+    DriverParameters.StreamingCopy     = TRUE;
 
     // attempt to read registry for system start parameters
     Status = __DriverGetSystemStartParams(&Options);
@@ -197,12 +199,34 @@ __DriverParseParameterKey(
             }
         }
 
+        if (__DriverGetOption(Options, L"XENVBD:LOCAL_COMPLETION=", &Value)) {
+            // Value may be NULL (it shouldnt be though!)
+            if (Value) {
+                if (wcscmp(Value, L"OFF") == 0) {
+                    DriverParameters.LocalCompletion = FALSE;
+                }
+                __FreePoolWithTag(Value, XENVBD_POOL_TAG);
+            }
+        }
+
+        if (__DriverGetOption(Options, L"XENVBD:STREAMING_COPY=", &Value)) {
+            // Value may be NULL (it shouldnt be though!)
+            if (Value) {
+                if (wcscmp(Value, L"OFF") == 0) {
+                    DriverParameters.StreamingCopy = FALSE;
+                }
+                __FreePoolWithTag(Value, XENVBD_POOL_TAG);
+            }
+        }
+
         __FreePoolWithTag(Options, XENVBD_POOL_TAG);
     }
 
-    Verbose("DriverParameters: %s%s\n", 
+    Verbose("DriverParameters: %s%s%s%s\n", 
             DriverParameters.SynthesizeInquiry ? "SYNTH_INQ " : "",
-            DriverParameters.PVCDRom ? "PV_CDROM " : "");
+            DriverParameters.PVCDRom ? "PV_CDROM " : "",
+            DriverParameters.LocalCompletion ? "LOCAL_COMPLETION " : "",
+            DriverParameters.StreamingCopy ? "STREAMING_COPY " : "");
 }
 
 //=============================================================================
@@ -646,8 +670,8 @@ DriverEntry(
 
     KeInitializeSpinLock(&__XenvbdLock);
     __XenvbdFdo = NULL;
-    BufferInitialize();
     __DriverParseParameterKey();
+    BufferInitialize();
 
     RtlZeroMemory(&InitData, sizeof(InitData));
 
@@ -49,9 +49,20 @@
 
 #define XENVBD_MIN_GRANT_REFS           (XENVBD_MAX_SEGMENTS_PER_SRB)
 
+// Reserve held by Paging/Hibernation/DumpFile targets, enough for 1 maximal SRB
+#define XENVBD_RESERVE_REQUESTS         (XENVBD_MAX_REQUESTS_PER_SRB)
+#define XENVBD_RESERVE_SEGMENTS         (XENVBD_MAX_SEGMENTS_PER_SRB)
+#define XENVBD_RESERVE_INDIRECT_PAGES   (BLKIF_MAX_INDIRECT_PAGES_PER_REQUEST)
+#define XENVBD_RESERVE_GRANT_REFS       (XENVBD_RESERVE_SEGMENTS + XENVBD_RESERVE_INDIRECT_PAGES)
+
+// Largest qos/bytes-per-sec honoured (1TB/s), keeps the QoS credit arithmetic within 64 bits
+#define XENVBD_QOS_MAX_BYTES_PER_SEC    (1ull << 40)
+
 typedef struct _XENVBD_PARAMETERS {
     BOOLEAN     SynthesizeInquiry;
     BOOLEAN     PVCDRom;
+    BOOLEAN     LocalCompletion;    // complete SRBs on the submitting processor
+    BOOLEAN     StreamingCopy;      // bounce write payloads with non-temporal stores
 } XENVBD_PARAMETERS;
 
 extern XENVBD_PARAMETERS    DriverParameters;
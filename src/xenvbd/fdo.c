@@ -54,6 +54,43 @@
 
 #define FDO_SIGNATURE   'odfX'
 
+// per-processor completion, SRBs are completed on the processor that submitted them
+typedef struct _XENVBD_COMPLETION {
+    KDPC                        Dpc;
+    KSPIN_LOCK                  Lock;
+    LIST_ENTRY                  List;
+    PXENVBD_FDO                 Fdo;
+} XENVBD_COMPLETION, *PXENVBD_COMPLETION;
+
+#define FDO_CONNECT_WORKERS     8
+
+// target bring-up, each target's xenstore handshake is independent so a bounded
+// pool of workers connects them concurrently
+typedef struct _XENVBD_CONNECT_ITEM {
+    PXENVBD_PDO                 Pdo;        // power up an existing target, or NULL to create one
+    PCHAR                       Device;
+    ULONG                       TargetId;
+    BOOLEAN                     EmulatedUnplugged;
+    XENVBD_DEVICE_TYPE          DeviceType;
+    NTSTATUS                    Status;
+} XENVBD_CONNECT_ITEM, *PXENVBD_CONNECT_ITEM;
+
+// last device/vbd listing, sorted by DeviceId, so a rescan only looks at what changed
+typedef struct _XENVBD_DEVICE {
+    ULONG                       DeviceId;
+    ULONG                       TargetId;
+    BOOLEAN                     Hidden;     // not a valid vbd, never probed
+    BOOLEAN                     Pending;    // not created yet (ejected, not a disk, ...), retried on each scan
+    PCHAR                       Device;     // only valid during a scan
+} XENVBD_DEVICE, *PXENVBD_DEVICE;
+
+typedef struct _XENVBD_CONNECT {
+    PXENVBD_FDO                 Fdo;
+    PXENVBD_CONNECT_ITEM        Items;
+    LONG                        Count;
+    LONG                        Next;
+} XENVBD_CONNECT, *PXENVBD_CONNECT;
+
 struct _XENVBD_FDO {
     ULONG                       Signature;
     KEVENT                      RemoveEvent;
@@ -64,6 +101,7 @@ struct _XENVBD_FDO {
     KSPIN_LOCK                  Lock;
     DEVICE_POWER_STATE          DevicePower;
     ANSI_STRING                 Enumerator;
+    KMUTEX                      Mutex;      // serializes enumeration with power transitions, held at PASSIVE_LEVEL
 
     // Power
     PXENVBD_THREAD              DevicePowerThread;
@@ -88,12 +126,27 @@ struct _XENVBD_FDO {
     // Target Enumeration
     PXENVBD_THREAD              RescanThread;
     PXENBUS_STORE_WATCH         RescanWatch;
-    PXENVBD_THREAD              FrontendThread;
+    PXENVBD_DEVICE              Devices;
+    ULONG                       DeviceCount;
+
+    // Completion
+    PXENVBD_COMPLETION          Completions;
+    ULONG                       NrCompletions;
 
     // Statistics
     LONG                        CurrentSrbs;
     LONG                        MaximumSrbs;
     LONG                        TotalSrbs;
+    LONG                        LocalCompletes;
+    LONG                        RemoteCompletes;
+    LONG                        Redirected;
+    LONGLONG                    BringUpTicks;
+    ULONG                       BringUpTargets;
+    ULONG                       BringUpWorkers;
+    ULONG                       Scans;
+    ULONG                       ScanAdded;
+    ULONG                       ScanRemoved;
+    ULONG                       ScanProbed;
 };
 
 extern PDRIVER_DISPATCH StorPortDispatchPower;
@@ -121,6 +174,46 @@ __FdoSetDevicePowerState(
     return Changed;
 }
 
+__drv_maxIRQL(PASSIVE_LEVEL)
+static FORCEINLINE VOID
+__FdoLockMutex(
+    __in PXENVBD_FDO                 Fdo
+    )
+{
+    (VOID) KeWaitForSingleObject(&Fdo->Mutex, Executive, KernelMode, FALSE, NULL);
+}
+
+static FORCEINLINE VOID
+__FdoUnlockMutex(
+    __in PXENVBD_FDO                 Fdo
+    )
+{
+    (VOID) KeReleaseMutex(&Fdo->Mutex, FALSE);
+}
+
+// acquires the mutex if the FDO is in D0, so enumeration cannot overlap a power transition
+__checkReturn
+__drv_maxIRQL(PASSIVE_LEVEL)
+static FORCEINLINE BOOLEAN
+__FdoLockD0(
+    __in PXENVBD_FDO                 Fdo
+    )
+{
+    KIRQL       Irql;
+    BOOLEAN     Powered;
+
+    __FdoLockMutex(Fdo);
+
+    KeAcquireSpinLock(&Fdo->Lock, &Irql);
+    Powered = (Fdo->DevicePower == PowerDeviceD0) ? TRUE : FALSE;
+    KeReleaseSpinLock(&Fdo->Lock, Irql);
+
+    if (!Powered)
+        __FdoUnlockMutex(Fdo);
+
+    return Powered;
+}
+
 __checkReturn
 static FORCEINLINE PXENVBD_PDO
 __FdoGetPdoAlways(
@@ -168,6 +261,57 @@ ___FdoGetPdo(
 }
 #define __FdoGetPdo(f, t) ___FdoGetPdo(f, t, __FUNCTION__)
 
+// StartIo runs at DISPATCH_LEVEL and reads the target without the lock or a reference,
+// FdoUnlinkPdo waits for every processor to drop below DISPATCH_LEVEL before the PDO can go
+static FORCEINLINE PXENVBD_PDO
+__FdoPeekPdo(
+    __in PXENVBD_FDO                 Fdo,
+    __in ULONG                       TargetId
+    )
+{
+    ASSERT3U(KeGetCurrentIrql(), >=, DISPATCH_LEVEL);
+
+    if (TargetId >= XENVBD_MAX_TARGETS)
+        return NULL;
+
+    return *(PXENVBD_PDO volatile *)&Fdo->Targets[TargetId];
+}
+
+__drv_maxIRQL(PASSIVE_LEVEL)
+static VOID
+__FdoQuiesce(
+    __in PXENVBD_FDO                 Fdo
+    )
+{
+    GROUP_AFFINITY  Previous;
+    BOOLEAN         Moved = FALSE;
+    ULONG           Count;
+    ULONG           Index;
+
+    UNREFERENCED_PARAMETER(Fdo);
+    ASSERT3U(KeGetCurrentIrql(), ==, PASSIVE_LEVEL);
+
+    // running on a processor means it has left any DISPATCH_LEVEL reader it was in
+    Count = KeQueryActiveProcessorCountEx(ALL_PROCESSOR_GROUPS);
+    for (Index = 0; Index < Count; ++Index) {
+        PROCESSOR_NUMBER    Number;
+        GROUP_AFFINITY      Affinity;
+
+        if (!NT_SUCCESS(KeGetProcessorNumberFromIndex(Index, &Number)))
+            continue;
+
+        RtlZeroMemory(&Affinity, sizeof(Affinity));
+        Affinity.Group = Number.Group;
+        Affinity.Mask = (KAFFINITY)1 << Number.Number;
+
+        KeSetSystemGroupAffinityThread(&Affinity, Moved ? NULL : &Previous);
+        Moved = TRUE;
+    }
+
+    if (Moved)
+        KeRevertToUserGroupAffinityThread(&Previous);
+}
+
 // Reference Counting
 LONG
 __FdoReference(
@@ -222,7 +366,8 @@ FdoLinkPdo(
     KeAcquireSpinLock(&Fdo->TargetLock, &Irql);
     Current = Fdo->Targets[TargetId];
     if (Fdo->Targets[TargetId] == NULL) {
-        Fdo->Targets[TargetId] = Pdo;
+        // publish after the PDO is initialized, StartIo reads it without the lock
+        (VOID) InterlockedExchangePointer((PVOID*)&Fdo->Targets[TargetId], Pdo);
         Result = TRUE;
     }
     KeReleaseSpinLock(&Fdo->TargetLock, Irql);
@@ -246,13 +391,16 @@ FdoUnlinkPdo(
     KeAcquireSpinLock(&Fdo->TargetLock, &Irql);
     Current = Fdo->Targets[TargetId];
     if (Fdo->Targets[TargetId] == Pdo) {
-        Fdo->Targets[TargetId] = NULL;
+        (VOID) InterlockedExchangePointer((PVOID*)&Fdo->Targets[TargetId], NULL);
         Result = TRUE;
     }
     KeReleaseSpinLock(&Fdo->TargetLock, Irql);
 
     if (!Result) {
         Warning("Target[%d] : Current 0x%p, Expected 0x%p\n", TargetId, Current, Pdo);
+    } else {
+        // wait out any StartIo still using the PDO, see __FdoPeekPdo
+        __FdoQuiesce(Fdo);
     }
     return Result;
 }
@@ -377,6 +525,25 @@ FdoDebugCallback(
     DEBUG(Printf, Fdo->Debug, Fdo->DebugCallback,
           "FDO: Srbs            : %d / %d (%d Total)\n",
           Fdo->CurrentSrbs, Fdo->MaximumSrbs, Fdo->TotalSrbs);
+    DEBUG(Printf, Fdo->Debug, Fdo->DebugCallback,
+          "FDO: Completions     : %d Local / %d Remote / %d Redirected (%s, %u CPUs)\n",
+          Fdo->LocalCompletes, Fdo->RemoteCompletes, Fdo->Redirected,
+          Fdo->Completions ? "LOCAL" : "ANY",
+          Fdo->NrCompletions);
+    {
+        LARGE_INTEGER   Frequency;
+
+        (VOID) KeQueryPerformanceCounter(&Frequency);
+        DEBUG(Printf, Fdo->Debug, Fdo->DebugCallback,
+              "FDO: BringUp         : %u Targets in %llu us (%u Workers)\n",
+              Fdo->BringUpTargets,
+              Frequency.QuadPart ? ((ULONG64)Fdo->BringUpTicks * 1000000ull) / Frequency.QuadPart : 0ull,
+              Fdo->BringUpWorkers);
+    }
+    DEBUG(Printf, Fdo->Debug, Fdo->DebugCallback,
+          "FDO: Scans           : %u (%u Devices, %u Added / %u Removed / %u Probed)\n",
+          Fdo->Scans, Fdo->DeviceCount,
+          Fdo->ScanAdded, Fdo->ScanRemoved, Fdo->ScanProbed);
 
     BufferDebugCallback(Fdo->Debug, Fdo->DebugCallback);
     
@@ -400,6 +567,7 @@ FdoDebugCallback(
 
     Fdo->MaximumSrbs = Fdo->CurrentSrbs;
     Fdo->TotalSrbs = 0;
+    Fdo->LocalCompletes = Fdo->RemoteCompletes = Fdo->Redirected = 0;
 }
 
 //=============================================================================
@@ -594,10 +762,100 @@ fail2:
 fail1:
     Error("fail1 (%08x)\n", status);
 }
+static VOID
+__FdoConnectItems(
+    __in    PXENVBD_CONNECT     Connect
+    )
+{
+    PXENVBD_FDO     Fdo = Connect->Fdo;
+
+    for (;;) {
+        PXENVBD_CONNECT_ITEM    Item;
+        LONG                    Index;
+
+        Index = InterlockedIncrement(&Connect->Next) - 1;
+        if (Index >= Connect->Count)
+            break;
+
+        Item = &Connect->Items[Index];
+        if (Item->Pdo != NULL) {
+            Item->Status = PdoD3ToD0(Item->Pdo);
+        } else {
+            Item->Status = PdoCreate(Fdo,
+                                     Item->Device,
+                                     Item->TargetId,
+                                     Item->EmulatedUnplugged,
+                                     Item->DeviceType);
+        }
+    }
+}
+
+__checkReturn
+static DECLSPEC_NOINLINE NTSTATUS
+FdoConnectWorker(
+    __in PXENVBD_THREAD              Thread,
+    __in PVOID                       Context
+    )
+{
+    UNREFERENCED_PARAMETER(Thread);
+
+    __FdoConnectItems(Context);
+    return STATUS_SUCCESS;
+}
+
+__drv_maxIRQL(PASSIVE_LEVEL)
+static VOID
+__FdoConnect(
+    __in    PXENVBD_FDO             Fdo,
+    __in    PXENVBD_CONNECT_ITEM    Items,
+    __in    ULONG                   Count
+    )
+{
+    XENVBD_CONNECT  Connect;
+    PXENVBD_THREAD  Threads[FDO_CONNECT_WORKERS - 1];
+    ULONG           Workers;
+    ULONG           Index;
+    LARGE_INTEGER   Start;
+    LARGE_INTEGER   End;
+
+    if (Count == 0)
+        return;
+
+    Start = KeQueryPerformanceCounter(NULL);
+
+    Connect.Fdo = Fdo;
+    Connect.Items = Items;
+    Connect.Count = (LONG)Count;
+    Connect.Next = 0;
+
+    // workers block while waiting for their backends, the calling thread is one of them
+    Workers = __min(Count, FDO_CONNECT_WORKERS);
+
+    for (Index = 0; Index < Workers - 1; ++Index) {
+        // if a worker cannot be started, the others pick up its share
+        if (!NT_SUCCESS(ThreadCreate(FdoConnectWorker, &Connect, &Threads[Index])))
+            Threads[Index] = NULL;
+    }
+
+    __FdoConnectItems(&Connect);
+
+    for (Index = 0; Index < Workers - 1; ++Index) {
+        if (Threads[Index] != NULL)
+            ThreadJoin(Threads[Index]);
+    }
+
+    End = KeQueryPerformanceCounter(NULL);
+
+    Fdo->BringUpTicks = End.QuadPart - Start.QuadPart;
+    Fdo->BringUpTargets = Count;
+    Fdo->BringUpWorkers = Workers;
+}
+
+__drv_maxIRQL(PASSIVE_LEVEL)
 static FORCEINLINE VOID
 __FdoEnumerate(
     __in    PXENVBD_FDO Fdo,
-    __in    PCHAR       Devices,
+    __in    PCHAR       Buffer,
     __out   PBOOLEAN    NeedInvalidate,
     __out   PBOOLEAN    NeedReboot
     )
@@ -605,32 +863,98 @@ __FdoEnumerate(
     ULONG               TargetId;
     PCHAR               Device;
     PXENVBD_PDO         Pdo;
-    NTSTATUS            Status;
+    PXENVBD_DEVICE      Devices;
+    PXENVBD_DEVICE      Old = Fdo->Devices;
+    ULONG               DeviceCount;
+    ULONG               OldCount = Fdo->DeviceCount;
+    BOOLEAN             Listed[XENVBD_MAX_TARGETS];
+    PXENVBD_CONNECT_ITEM Items;
+    ULONG               Count;
+    ULONG               Index;
+    ULONG               Index2;
 
     *NeedInvalidate = FALSE;
     *NeedReboot = FALSE;
 
+    DeviceCount = 0;
+    for (Device = Buffer; *Device; Device = __NextSz(Device))
+        ++DeviceCount;
+
+    Devices = NULL;
+    if (DeviceCount != 0) {
+        Devices = __AllocateNonPagedPoolWithTag(__FUNCTION__,
+                                                __LINE__,
+                                                sizeof(XENVBD_DEVICE) * DeviceCount,
+                                                FDO_SIGNATURE);
+        if (Devices == NULL) {
+            Error("Failed to allocate device map, targets updated on next scan\n");
+            return;
+        }
+    }
+
+    Items = __AllocateNonPagedPoolWithTag(__FUNCTION__,
+                                          __LINE__,
+                                          sizeof(XENVBD_CONNECT_ITEM) * XENVBD_MAX_TARGETS,
+                                          FDO_SIGNATURE);
+    if (Items == NULL) {
+        Error("Failed to allocate connect list, targets added on next scan\n");
+        if (Devices != NULL)
+            __FreePoolWithTag(Devices, FDO_SIGNATURE);
+        return;
+    }
+
+    // parse the listing once, sorted by DeviceId
+    RtlZeroMemory(Listed, sizeof(Listed));
+    Index = 0;
+    for (Device = Buffer; *Device; Device = __NextSz(Device)) {
+        XENVBD_DEVICE   Entry;
+
+        Entry.DeviceId = strtoul(Device, NULL, 10);
+        Entry.TargetId = __ParseVbd(Device);
+        Entry.Hidden = (Entry.TargetId >= XENVBD_MAX_TARGETS) ? TRUE : FALSE;
+        Entry.Pending = !Entry.Hidden;
+        Entry.Device = Device;
+
+        if (!Entry.Hidden)
+            Listed[Entry.TargetId] = TRUE;
+
+        for (Index2 = Index; Index2 > 0 && Devices[Index2 - 1].DeviceId > Entry.DeviceId; --Index2)
+            Devices[Index2] = Devices[Index2 - 1];
+        Devices[Index2] = Entry;
+        ++Index;
+    }
+
+    // diff against the last listing, unchanged devices keep what was found out about them
+    Index = Index2 = 0;
+    while (Index < OldCount || Index2 < DeviceCount) {
+        if (Index2 == DeviceCount ||
+            (Index < OldCount && Old[Index].DeviceId < Devices[Index2].DeviceId)) {
+            ++Fdo->ScanRemoved;
+            ++Index;
+        } else if (Index == OldCount ||
+                   Old[Index].DeviceId > Devices[Index2].DeviceId) {
+            ++Fdo->ScanAdded;
+            ++Index2;
+        } else {
+            Devices[Index2].Hidden = Old[Index].Hidden;
+            Devices[Index2].Pending = Old[Index].Pending;
+            ++Index;
+            ++Index2;
+        }
+    }
+
+    // remove targets no device names any more, destroy those whose removal has completed
     for (TargetId = 0; TargetId < XENVBD_MAX_TARGETS; ++TargetId) {
         Pdo = __FdoGetPdo(Fdo, TargetId);
         if (Pdo == NULL)
             continue;
 
-        if (!PdoIsMissing(Pdo)) {
-            BOOLEAN Missing = TRUE;
-            for (Device = Devices; *Device; Device = __NextSz(Device)) {
-                ULONG DeviceTargetId = __ParseVbd(Device);
-                if (TargetId == DeviceTargetId) {
-                    Missing = FALSE;
-                    break;
-                }
-            }
-            if (Missing) {
-                PdoSetMissing(Pdo, "Device Dissappeared");
-                if (PdoGetDevicePnpState(Pdo) == Present)
-                    PdoSetDevicePnpState(Pdo, Deleted);
-                else
-                    *NeedInvalidate = TRUE;
-            }
+        if (!PdoIsMissing(Pdo) && !Listed[TargetId]) {
+            PdoSetMissing(Pdo, "Device Dissappeared");
+            if (PdoGetDevicePnpState(Pdo) == Present)
+                PdoSetDevicePnpState(Pdo, Deleted);
+            else
+                *NeedInvalidate = TRUE;
         }
         
         if (PdoIsMissing(Pdo) && 
@@ -638,30 +962,43 @@ __FdoEnumerate(
             // drop reference count before destroying
             PdoDereference(Pdo);
             PdoDestroy(Pdo);
+
+            // devices still naming the target are looked at again
+            for (Index = 0; Index < DeviceCount; ++Index) {
+                if (Devices[Index].TargetId == TargetId)
+                    Devices[Index].Pending = TRUE;
+            }
         } else {
             PdoDereference(Pdo);
         }
     }
 
-    // add new targets
-    for (Device = Devices; *Device; Device = __NextSz(Device)) {
-        BOOLEAN     EmulatedUnplugged;
+    // add new targets, only devices not seen (or not created) before touch xenstore
+    Count = 0;
+    for (Index2 = 0; Index2 < DeviceCount; ++Index2) {
+        PXENVBD_DEVICE      Entry = &Devices[Index2];
+        BOOLEAN             EmulatedUnplugged;
         XENVBD_DEVICE_TYPE  DeviceType;
 
-        TargetId = __ParseVbd(Device);
-        if (TargetId == 0xFFFFFFFF) {
+        if (Entry->Hidden || !Entry->Pending)
             continue;
-        }
+
+        ++Fdo->ScanProbed;
+        Device = Entry->Device;
+        TargetId = Entry->TargetId;
 
         Pdo = __FdoGetPdo(Fdo, TargetId);
         if (Pdo) {
+            // another device already created this target
             PdoDereference(Pdo);
+            Entry->Pending = FALSE;
             continue;
         }
 
-        if (__FdoHiddenTarget(Fdo, Device, &DeviceType)) {
+        // ejected, not a disk yet or a transient failure, stays pending and
+        // is probed again on the next scan
+        if (__FdoHiddenTarget(Fdo, Device, &DeviceType))
             continue;
-        }
 
         EmulatedUnplugged = __FdoIsPdoUnplugged(Fdo,
                                                 FdoEnum(Fdo),
@@ -669,15 +1006,49 @@ __FdoEnumerate(
                                                 TargetId);
         *NeedReboot |= !EmulatedUnplugged;
 
-        Status = PdoCreate(Fdo,
-                           Device,
-                           TargetId,
-                           EmulatedUnplugged,
-                           ThreadGetEvent(Fdo->FrontendThread), DeviceType);
-        *NeedInvalidate |= (NT_SUCCESS(Status)) ? TRUE : FALSE;
+        // first device wins, as if the targets were created one at a time
+        for (Index = 0; Index < Count; ++Index) {
+            if (Items[Index].TargetId == TargetId)
+                break;
+        }
+        if (Index < Count || Count == XENVBD_MAX_TARGETS)
+            continue;
+
+        Items[Count].Pdo = NULL;
+        Items[Count].Device = Device;
+        Items[Count].TargetId = TargetId;
+        Items[Count].EmulatedUnplugged = EmulatedUnplugged;
+        Items[Count].DeviceType = DeviceType;
+        Items[Count].Status = STATUS_UNSUCCESSFUL;
+        ++Count;
+    }
+
+    __FdoConnect(Fdo, Items, Count);
+
+    for (Index = 0; Index < Count; ++Index)
+        *NeedInvalidate |= (NT_SUCCESS(Items[Index].Status)) ? TRUE : FALSE;
+
+    __FreePoolWithTag(Items, FDO_SIGNATURE);
+
+    // devices whose target now exists are settled, the rest are retried next scan
+    for (Index = 0; Index < DeviceCount; ++Index) {
+        if (!Devices[Index].Hidden && Devices[Index].Pending) {
+            Pdo = __FdoGetPdo(Fdo, Devices[Index].TargetId);
+            if (Pdo) {
+                PdoDereference(Pdo);
+                Devices[Index].Pending = FALSE;
+            }
+        }
+        Devices[Index].Device = NULL;
     }
+
+    Fdo->Devices = Devices;
+    Fdo->DeviceCount = DeviceCount;
+    if (Old != NULL)
+        __FreePoolWithTag(Old, FDO_SIGNATURE);
+    ++Fdo->Scans;
 }
-__drv_requiresIRQL(DISPATCH_LEVEL)
+__drv_maxIRQL(PASSIVE_LEVEL)
 static DECLSPEC_NOINLINE VOID
 FdoScanTargets(
     __in    PXENVBD_FDO Fdo,
@@ -729,22 +1100,18 @@ FdoScan(
     PXENVBD_FDO     Fdo = Context;
 
     for (;;) {
-        KIRQL   Irql;
         BOOLEAN NeedInvalidate;
         BOOLEAN NeedReboot;
         
         if (!ThreadWait(Thread))
             break;
         
-        KeAcquireSpinLock(&Fdo->Lock, &Irql);
-        if (Fdo->DevicePower != PowerDeviceD0) {
-            KeReleaseSpinLock(&Fdo->Lock, Irql);
+        if (!__FdoLockD0(Fdo))
             continue;
-        }
         
         FdoScanTargets(Fdo, &NeedInvalidate, &NeedReboot);
 
-        KeReleaseSpinLock(&Fdo->Lock, Irql);
+        __FdoUnlockMutex(Fdo);
 
         if (NeedInvalidate) {
             FdoLogTargets("ScanThread", Fdo);
@@ -758,43 +1125,6 @@ FdoScan(
     return STATUS_SUCCESS;
 }
 
-__checkReturn
-static DECLSPEC_NOINLINE NTSTATUS
-FdoFrontend(
-    __in PXENVBD_THREAD              Thread,
-    __in PVOID                       Context
-    )
-{
-    PXENVBD_FDO     Fdo = Context;
-
-    for (;;) {
-        ULONG       TargetId;
-        KIRQL       Irql;
-        
-        if (!ThreadWait(Thread))
-            break;
-
-        KeAcquireSpinLock(&Fdo->Lock, &Irql);
-
-        if (Fdo->DevicePower != PowerDeviceD0) {
-            KeReleaseSpinLock(&Fdo->Lock, Irql);
-            continue;
-        }
-
-        for (TargetId = 0; TargetId < XENVBD_MAX_TARGETS; ++TargetId) {
-            PXENVBD_PDO Pdo = __FdoGetPdo(Fdo, TargetId);
-            if (Pdo) {
-                PdoBackendPathChanged(Pdo);
-                PdoDereference(Pdo);
-            }
-        }
-
-        KeReleaseSpinLock(&Fdo->Lock, Irql);
-    }
-
-    return STATUS_SUCCESS;
-}
-
 //=============================================================================
 // Initialize, Start, Stop
 __drv_requiresIRQL(DISPATCH_LEVEL)
@@ -946,9 +1276,16 @@ __FdoD3ToD0(
 {
     NTSTATUS    Status;
     ULONG       TargetId;
+    PXENVBD_CONNECT_ITEM Items;
+    ULONG       Count;
+    ULONG       Index;
+
+    __FdoLockMutex(Fdo);
 
-    if (!__FdoSetDevicePowerState(Fdo, PowerDeviceD0))
+    if (!__FdoSetDevicePowerState(Fdo, PowerDeviceD0)) {
+        __FdoUnlockMutex(Fdo);
         return STATUS_SUCCESS;
+    }
 
     Trace("=====> (%d)\n", KeGetCurrentIrql());
     Verbose("D3->D0\n");
@@ -967,18 +1304,39 @@ __FdoD3ToD0(
     if (!NT_SUCCESS(Status))
         goto fail1;
 
+    Items = __AllocateNonPagedPoolWithTag(__FUNCTION__,
+                                          __LINE__,
+                                          sizeof(XENVBD_CONNECT_ITEM) * XENVBD_MAX_TARGETS,
+                                          FDO_SIGNATURE);
+    Status = STATUS_NO_MEMORY;
+    if (Items == NULL)
+        goto fail2;
+
     // Power UP any PDOs
+    Count = 0;
     for (TargetId = 0; TargetId < XENVBD_MAX_TARGETS; ++TargetId) {
         PXENVBD_PDO Pdo = __FdoGetPdo(Fdo, TargetId);
         if (Pdo) {
-            Status = PdoD3ToD0(Pdo);
-            PdoDereference(Pdo);
-
-            if (!NT_SUCCESS(Status))
-                goto fail2;
+            Items[Count].Pdo = Pdo;
+            Items[Count].Status = STATUS_UNSUCCESSFUL;
+            ++Count;
         }
     }
 
+    __FdoConnect(Fdo, Items, Count);
+
+    Status = STATUS_SUCCESS;
+    for (Index = 0; Index < Count; ++Index) {
+        if (NT_SUCCESS(Status))
+            Status = Items[Index].Status;
+        PdoDereference(Items[Index].Pdo);
+    }
+
+    __FreePoolWithTag(Items, FDO_SIGNATURE);
+
+    if (!NT_SUCCESS(Status))
+        goto fail2;
+
     // register suspend callback to re-register the watch
     ASSERT3P(Fdo->SuspendCallback, ==, NULL);
     Status = SUSPEND(Register, Fdo->Suspend, SUSPEND_CALLBACK_LATE,
@@ -993,6 +1351,8 @@ __FdoD3ToD0(
     if (!NT_SUCCESS(Status))
         goto fail3;
 
+    __FdoUnlockMutex(Fdo);
+
     Trace("<===== (%d)\n", KeGetCurrentIrql());
     return STATUS_SUCCESS;
 
@@ -1022,6 +1382,7 @@ fail1:
     Error("Fail1 (%08x)\n", Status);
     __FdoRelease(Fdo);
     __FdoSetDevicePowerState(Fdo, PowerDeviceD3);
+    __FdoUnlockMutex(Fdo);
     return Status;
 }
 static VOID
@@ -1031,8 +1392,12 @@ __FdoD0ToD3(
 {
     ULONG       TargetId;
 
-    if (!__FdoSetDevicePowerState(Fdo, PowerDeviceD3))
+    __FdoLockMutex(Fdo);
+
+    if (!__FdoSetDevicePowerState(Fdo, PowerDeviceD3)) {
+        __FdoUnlockMutex(Fdo);
         return;
+    }
 
     Trace("=====> (%d)\n", KeGetCurrentIrql());
     Verbose("D0->D3\n");
@@ -1067,6 +1432,8 @@ __FdoD0ToD3(
     // Release Interfaces
     __FdoRelease(Fdo);
 
+    __FdoUnlockMutex(Fdo);
+
     Trace("<===== (%d)\n", KeGetCurrentIrql());
 }
 
@@ -1130,6 +1497,109 @@ FdoDevicePower(
     return STATUS_SUCCESS;
 }
 
+//=============================================================================
+// Completion
+KDEFERRED_ROUTINE FdoCompletionDpc;
+
+VOID
+FdoCompletionDpc(
+    __in  PKDPC                     Dpc,
+    __in_opt PVOID                  Context,
+    __in_opt PVOID                  Arg1,
+    __in_opt PVOID                  Arg2
+    )
+{
+    PXENVBD_COMPLETION  Completion = Context;
+    LIST_ENTRY          List;
+
+    UNREFERENCED_PARAMETER(Dpc);
+    UNREFERENCED_PARAMETER(Arg1);
+    UNREFERENCED_PARAMETER(Arg2);
+
+    ASSERT(Completion);
+
+    // take the whole list, so the lock is not held across StorPortNotification
+    InitializeListHead(&List);
+    KeAcquireSpinLockAtDpcLevel(&Completion->Lock);
+    if (!IsListEmpty(&Completion->List)) {
+        List.Flink = Completion->List.Flink;
+        List.Blink = Completion->List.Blink;
+        List.Flink->Blink = &List;
+        List.Blink->Flink = &List;
+        InitializeListHead(&Completion->List);
+    }
+    KeReleaseSpinLockFromDpcLevel(&Completion->Lock);
+
+    while (!IsListEmpty(&List)) {
+        PLIST_ENTRY     Entry = RemoveHeadList(&List);
+        PXENVBD_SRBEXT  SrbExt = CONTAINING_RECORD(Entry, XENVBD_SRBEXT, Entry);
+
+        StorPortNotification(RequestComplete, Completion->Fdo, SrbExt->Srb);
+    }
+}
+
+__drv_maxIRQL(DISPATCH_LEVEL)
+static VOID
+__FdoCompletionInitialize(
+    __in PXENVBD_FDO             Fdo
+    )
+{
+    ULONG       Count;
+    ULONG       Index;
+
+    if (!DriverParameters.LocalCompletion)
+        return;
+
+    Count = KeQueryMaximumProcessorCountEx(ALL_PROCESSOR_GROUPS);
+    if (Count <= 1)
+        return;
+
+    Fdo->Completions = __AllocateNonPagedPoolWithTag(__FUNCTION__,
+                                                    __LINE__,
+                                                    sizeof(XENVBD_COMPLETION) * Count,
+                                                    FDO_SIGNATURE);
+    if (Fdo->Completions == NULL) {
+        // not fatal, complete on whichever processor polled the ring
+        Warning("No memory for %u completion DPCs\n", Count);
+        return;
+    }
+
+    for (Index = 0; Index < Count; ++Index) {
+        PXENVBD_COMPLETION  Completion = &Fdo->Completions[Index];
+        PROCESSOR_NUMBER    Number;
+
+        Completion->Fdo = Fdo;
+        KeInitializeSpinLock(&Completion->Lock);
+        InitializeListHead(&Completion->List);
+        KeInitializeDpc(&Completion->Dpc, FdoCompletionDpc, Completion);
+        KeSetImportanceDpc(&Completion->Dpc, MediumHighImportance);
+        if (NT_SUCCESS(KeGetProcessorNumberFromIndex(Index, &Number)))
+            (VOID) KeSetTargetProcessorDpcEx(&Completion->Dpc, &Number);
+    }
+    Fdo->NrCompletions = Count;
+}
+
+__drv_maxIRQL(PASSIVE_LEVEL)
+static VOID
+__FdoCompletionTerminate(
+    __in PXENVBD_FDO             Fdo
+    )
+{
+    ULONG       Index;
+
+    if (Fdo->Completions == NULL)
+        return;
+
+    KeFlushQueuedDpcs();
+
+    for (Index = 0; Index < Fdo->NrCompletions; ++Index)
+        ASSERT(IsListEmpty(&Fdo->Completions[Index].List));
+
+    __FreePoolWithTag(Fdo->Completions, FDO_SIGNATURE);
+    Fdo->Completions = NULL;
+    Fdo->NrCompletions = 0;
+}
+
 __checkReturn
 __drv_maxIRQL(DISPATCH_LEVEL)
 static NTSTATUS
@@ -1147,6 +1617,7 @@ __FdoInitialize(
     Fdo->DevicePower = PowerDeviceD3;
     KeInitializeSpinLock(&Fdo->TargetLock);
     KeInitializeSpinLock(&Fdo->Lock);
+    KeInitializeMutex(&Fdo->Mutex, 0);
     KeInitializeEvent(&Fdo->RemoveEvent, SynchronizationEvent, FALSE);
 
     Fdo->ReferenceCount = 1;
@@ -1172,29 +1643,22 @@ __FdoInitialize(
     if (!NT_SUCCESS(Status))
         goto fail3;
 
-    Status = ThreadCreate(FdoFrontend, Fdo, &Fdo->FrontendThread);
-    if (!NT_SUCCESS(Status))
-        goto fail4;
-
     Status = ThreadCreate(FdoDevicePower, Fdo, &Fdo->DevicePowerThread);
     if (!NT_SUCCESS(Status))
-        goto fail5;
+        goto fail4;
 
     // query enumerator
     // fix this up to query from device location(?)
     //RtlInitAnsiString(&Fdo->Enumerator, "vbd");
 
+    __FdoCompletionInitialize(Fdo);
+
     // link fdo
     DriverLinkFdo(Fdo);
 
     Trace("<===== (%d)\n", KeGetCurrentIrql());
     return STATUS_SUCCESS;
 
-fail5:
-    Error("fail5\n");
-    ThreadAlert(Fdo->FrontendThread);
-    ThreadJoin(Fdo->FrontendThread);
-    Fdo->FrontendThread = NULL;
 fail4:
     Error("fail4\n");
     ThreadAlert(Fdo->RescanThread);
@@ -1237,16 +1701,18 @@ __FdoTerminate(
     ThreadJoin(Fdo->DevicePowerThread);
     Fdo->DevicePowerThread = NULL;
 
-    // stop frontend thread
-    ThreadAlert(Fdo->FrontendThread);
-    ThreadJoin(Fdo->FrontendThread);
-    Fdo->FrontendThread = NULL;
-
     // stop enum thread
     ThreadAlert(Fdo->RescanThread);
     ThreadJoin(Fdo->RescanThread);
     Fdo->RescanThread = NULL;
 
+    if (Fdo->Devices != NULL)
+        __FreePoolWithTag(Fdo->Devices, FDO_SIGNATURE);
+    Fdo->Devices = NULL;
+    Fdo->DeviceCount = 0;
+
+    __FdoCompletionTerminate(Fdo);
+
     // clear device objects
     Fdo->DeviceObject = NULL;
     Fdo->PhysicalDeviceObject = NULL;
@@ -1275,9 +1741,14 @@ __FdoTerminate(
     Fdo->Signature = 0;
     Fdo->DevicePower = 0;
     Fdo->CurrentSrbs = Fdo->MaximumSrbs = Fdo->TotalSrbs = 0;
+    Fdo->LocalCompletes = Fdo->RemoteCompletes = Fdo->Redirected = 0;
+    Fdo->BringUpTicks = 0;
+    Fdo->BringUpTargets = Fdo->BringUpWorkers = 0;
+    Fdo->Scans = Fdo->ScanAdded = Fdo->ScanRemoved = Fdo->ScanProbed = 0;
     RtlZeroMemory(&Fdo->Enumerator, sizeof(ANSI_STRING));
     RtlZeroMemory(&Fdo->TargetLock, sizeof(KSPIN_LOCK));
     RtlZeroMemory(&Fdo->Lock, sizeof(KSPIN_LOCK));
+    RtlZeroMemory(&Fdo->Mutex, sizeof(KMUTEX));
     RtlZeroMemory(&Fdo->RemoveEvent, sizeof(KEVENT));
     __FdoZeroInterfaces(Fdo);
 
@@ -1339,10 +1810,36 @@ FdoCompleteSrb(
     __in PSCSI_REQUEST_BLOCK         Srb
     )
 {
+    PXENVBD_SRBEXT      SrbExt = GetSrbExt(Srb);
+
     ASSERT3U(Srb->SrbStatus, !=, SRB_STATUS_PENDING);
 
     InterlockedDecrement(&Fdo->CurrentSrbs);
 
+    if (SrbExt == NULL || SrbExt->Processor == KeGetCurrentProcessorNumberEx(NULL)) {
+        InterlockedIncrement(&Fdo->LocalCompletes);
+        goto complete;
+    }
+
+    // hand the SRB back to the processor that submitted it, whose caches
+    // still hold the SRB, its extension and the data buffer
+    if (Fdo->Completions &&
+        SrbExt->Processor < Fdo->NrCompletions &&
+        KeGetCurrentIrql() == DISPATCH_LEVEL) {
+        PXENVBD_COMPLETION  Completion = &Fdo->Completions[SrbExt->Processor];
+
+        KeAcquireSpinLockAtDpcLevel(&Completion->Lock);
+        InsertTailList(&Completion->List, &SrbExt->Entry);
+        KeReleaseSpinLockFromDpcLevel(&Completion->Lock);
+
+        InterlockedIncrement(&Fdo->Redirected);
+        KeInsertQueueDpc(&Completion->Dpc, NULL, NULL);
+        return;
+    }
+
+    InterlockedIncrement(&Fdo->RemoteCompletes);
+
+complete:
     StorPortNotification(RequestComplete, Fdo, Srb);
 }
 
@@ -1511,10 +2008,10 @@ FdoStartIo(
     PXENVBD_PDO Pdo;
     BOOLEAN     CompleteSrb = TRUE;
 
-    Pdo = __FdoGetPdo(Fdo, Srb->TargetId);
+    // no lock or reference per SRB, a linked PDO stays valid until StartIo returns
+    Pdo = __FdoPeekPdo(Fdo, Srb->TargetId);
     if (Pdo) {
         CompleteSrb = PdoStartIo(Pdo, Srb);
-        PdoDereference(Pdo);
     }
 
     if (CompleteSrb) {
@@ -1550,20 +2047,16 @@ FdoDispatchPnp(
 
     case IRP_MN_QUERY_DEVICE_RELATIONS:
         if (Stack->Parameters.QueryDeviceRelations.Type == BusRelations) {
-            KIRQL   Irql;
             BOOLEAN NeedInvalidate;
             BOOLEAN NeedReboot;
 
-            KeAcquireSpinLock(&Fdo->Lock, &Irql);
-            
-            if (Fdo->DevicePower == PowerDeviceD0) {
+            if (__FdoLockD0(Fdo)) {
                 FdoScanTargets(Fdo, &NeedInvalidate, &NeedReboot);
+                __FdoUnlockMutex(Fdo);
             } else {
                 NeedInvalidate = FALSE;
                 NeedReboot = FALSE;
             }
-            
-            KeReleaseSpinLock(&Fdo->Lock, Irql);
 
             if (NeedInvalidate)
                 FdoLogTargets("QUERY_RELATIONS", Fdo);
@@ -67,6 +67,7 @@ FdoLinkPdo(
     __in PXENVBD_PDO                 Pdo
     );
 
+__drv_maxIRQL(PASSIVE_LEVEL)
 extern BOOLEAN
 FdoUnlinkPdo(
     __in PXENVBD_FDO                 Fdo,
@@ -41,11 +41,16 @@
 #include "notifier.h"
 #include "blockring.h"
 #include "granter.h"
+#include "thread.h"
 #include <store_interface.h>
 #include <suspend_interface.h>
 
 #include <stdlib.h>
 
+#define FRONTEND_BACKEND_STATES     (XenbusStateReconfigured + 1)
+#define FRONTEND_STATE_TIMEOUT_S    60  // per backend transition
+#define FRONTEND_STATE_WARN_S       5
+
 struct _XENVBD_FRONTEND {
     // Frontend
     PXENVBD_PDO                 Pdo;
@@ -56,7 +61,7 @@ struct _XENVBD_FRONTEND {
     PCHAR                       TargetPath;
     USHORT                      BackendId;
     XENVBD_STATE                State;
-    KSPIN_LOCK                  StateLock;
+    KMUTEX                      StateMutex;     // held at PASSIVE_LEVEL across transitions
 
     XENVBD_CAPS                 Caps;
     XENVBD_FEATURES             Features;
@@ -69,22 +74,69 @@ struct _XENVBD_FRONTEND {
 
     PXENBUS_SUSPEND_CALLBACK    SuspendLateCallback;
 
+    // Backend thread - watch events for this target, and the reconnect on resume
+    PXENVBD_THREAD              BackendThread;
+    LONG                        Resuming;
+
     // Ring
     PXENVBD_NOTIFIER            Notifier;
     PXENVBD_BLOCKRING           BlockRing;
     PXENVBD_GRANTER             Granter;
 
-    // Backend State Watch
+    // Backend Watch - the backend directory and the qos limits, last values seen
     BOOLEAN                     Active;
-    PKEVENT                     BackendEvent;
-    PXENBUS_STORE_WATCH         BackendStateWatch;
-    PXENBUS_STORE_WATCH         BackendInfoWatch;
-    PXENBUS_STORE_WATCH         BackendSectorSizeWatch;
-    PXENBUS_STORE_WATCH         BackendSectorCountWatch;
+    PXENBUS_STORE_WATCH         BackendWatch;
+    PXENBUS_STORE_WATCH         TargetQosWatch;
+    XenbusState                 BackendState;
+    ULONG64                     QosIops;
+    ULONG64                     QosBytes;
+
+    // Stats - time waiting for the backend, by the state it moved to
+    ULONG                       StateWaits[FRONTEND_BACKEND_STATES];
+    LONGLONG                    StateWaitTicks[FRONTEND_BACKEND_STATES];
+    LONGLONG                    StateMaxTicks[FRONTEND_BACKEND_STATES];
+    ULONG                       StateTimeouts;
+
+    // Backend keys present at the last listing, see __ListBackend
+    LONG                        BackendKeys;
+    BOOLEAN                     BackendChanged;
+
+    // Stats - backend reads, and time to prepare/connect
+    ULONG                       StoreReads;
+    ULONG                       StoreReadsSkipped;
+    ULONG                       InquiryCached;
+    LONGLONG                    PrepareTicks;
+    LONGLONG                    ConnectTicks;
+
+    // Stats - watch wakeups, and those that changed nothing
+    ULONG                       BackendWakeups;
+    ULONG                       BackendSpurious;
 };
 
 #define DOMID_INVALID (0x7FF4U)
 
+// backend keys read while connecting, reads of keys missing from the listing are skipped
+static const PCHAR  __BackendKeyNames[] = {
+    "removable",
+    "feature-max-indirect-segments",
+    "feature-persistent",
+    "info",
+    "sector-size",
+    "physical-sector-size",
+    "sectors",
+    "feature-barrier",
+    "feature-flush-cache",
+    "feature-discard",
+    "discard-secure",
+    "discard-alignment",
+    "discard-granularity",
+    "max-ring-page-order",
+    "sm-data",
+};
+
+#define BACKEND_KEYS_LISTED     0x80000000
+C_ASSERT(ARRAYSIZE(__BackendKeyNames) < 31);
+
 static const PCHAR
 __XenvbdStateName(
     IN  XENVBD_STATE                        State
@@ -147,6 +199,7 @@ FrontendRemoveFeature(
         break;
     case BLKIF_OP_INDIRECT:
         Frontend->Features.Indirect = 0;
+        PdoSelectPrepare(Frontend->Pdo);
         break;
     default:
         break;
@@ -216,6 +269,78 @@ FrontendGetGranter(
     return Frontend->Granter;
 }
 
+static BOOLEAN
+__BackendReadNeeded(
+    __in  PXENVBD_FRONTEND      Frontend,
+    __in  PCHAR                 Name
+    )
+{
+    const LONG  Keys = Frontend->BackendKeys;
+    PCHAR       Separator;
+    size_t      Length;
+    ULONG       Index;
+
+    // keys are listed from the backend directory, compare the first path component
+    Separator = strchr(Name, '/');
+    Length = (Separator != NULL) ? (size_t)(Separator - Name) : strlen(Name);
+
+    for (Index = 0; Index < ARRAYSIZE(__BackendKeyNames); ++Index) {
+        if (strlen(__BackendKeyNames[Index]) == Length &&
+            strncmp(__BackendKeyNames[Index], Name, Length) == 0)
+            break;
+    }
+    if (Index == ARRAYSIZE(__BackendKeyNames) ||
+        (Keys & BACKEND_KEYS_LISTED) == 0) {
+        ++Frontend->StoreReads;
+        return TRUE;
+    }
+
+    if (Keys & (1 << Index)) {
+        ++Frontend->StoreReads;
+        return TRUE;
+    }
+
+    ++Frontend->StoreReadsSkipped;
+    return FALSE;
+}
+
+__drv_maxIRQL(DISPATCH_LEVEL)
+static VOID
+__ListBackend(
+    __in  PXENVBD_FRONTEND      Frontend
+    )
+{
+    NTSTATUS    Status;
+    PCHAR       Buffer;
+    PCHAR       Key;
+    LONG        Keys;
+
+    // one round trip for the directory saves reading keys the backend never wrote
+    ++Frontend->StoreReads;
+    Status = STORE(Directory, Frontend->Store, NULL, NULL, Frontend->BackendPath, &Buffer);
+    if (!NT_SUCCESS(Status)) {
+        Warning("Target[%d] : Unable to list %s (%08x)\n",
+                    Frontend->TargetId, Frontend->BackendPath, Status);
+        Frontend->BackendKeys = 0;
+        return;
+    }
+
+    Keys = BACKEND_KEYS_LISTED;
+    for (Key = Buffer; *Key != '\0'; Key += strlen(Key) + 1) {
+        ULONG   Index;
+
+        for (Index = 0; Index < ARRAYSIZE(__BackendKeyNames); ++Index) {
+            if (strcmp(__BackendKeyNames[Index], Key) == 0) {
+                Keys |= (1 << Index);
+                break;
+            }
+        }
+    }
+    STORE(Free, Frontend->Store, Buffer);
+
+    Frontend->BackendKeys = Keys;
+}
+
 NTSTATUS
 FrontendStoreWriteFrontend(
     __in  PXENVBD_FRONTEND      Frontend,
@@ -241,6 +366,10 @@ FrontendStoreReadBackend(
     if (Frontend->BackendPath == NULL)
         goto fail2;
 
+    Status = STATUS_OBJECT_NAME_NOT_FOUND;
+    if (!__BackendReadNeeded(Frontend, Name))
+        goto fail3;
+
     Status = STORE(Read, Frontend->Store, NULL, Frontend->BackendPath, Name, Value);
     if (!NT_SUCCESS(Status))
         goto fail3;
@@ -252,6 +381,18 @@ fail2:
 fail1:
     return Status;
 }
+NTSTATUS
+FrontendStoreReadTarget(
+    __in  PXENVBD_FRONTEND      Frontend,
+    __in  PCHAR                 Name,
+    __out PCHAR*                Value
+    )
+{
+    if (Frontend->Store == NULL)
+        return STATUS_INVALID_PARAMETER;
+
+    return STORE(Read, Frontend->Store, NULL, Frontend->TargetPath, Name, Value);
+}
 VOID
 FrontendStoreFree(
     __in  PXENVBD_FRONTEND      Frontend,
@@ -306,7 +447,7 @@ FrontendNotifyResponses(
 }
 
 //=============================================================================
-__drv_requiresIRQL(DISPATCH_LEVEL)
+__drv_maxIRQL(DISPATCH_LEVEL)
 static NTSTATUS
 __UpdateBackendPath(
     __in  PXENVBD_FRONTEND        Frontend
@@ -328,6 +469,10 @@ __UpdateBackendPath(
     Status = STORE(Read, Frontend->Store, NULL, Frontend->FrontendPath,
                     "backend", &Value);
     if (NT_SUCCESS(Status)) {
+        if (Frontend->BackendPath == NULL ||
+            strcmp(Frontend->BackendPath, Value) != 0)
+            Frontend->BackendChanged = TRUE;
+
         if (Frontend->BackendPath) {
             Trace("<< %s\n", Frontend->BackendPath);
             __FrontendFree(Frontend->BackendPath);
@@ -375,7 +520,26 @@ fail:
     *State = XenbusStateUnknown;
     return Status;
 }
-__drv_requiresIRQL(DISPATCH_LEVEL)
+static FORCEINLINE VOID
+__WaitStateStats(
+    __in  PXENVBD_FRONTEND        Frontend,
+    __in  XenbusState             State,
+    __in  LONGLONG                Ticks
+    )
+{
+    if ((ULONG)State >= FRONTEND_BACKEND_STATES)
+        return;
+
+    ++Frontend->StateWaits[State];
+    Frontend->StateWaitTicks[State] += Ticks;
+    if (Ticks > Frontend->StateMaxTicks[State])
+        Frontend->StateMaxTicks[State] = Ticks;
+}
+
+// Waits for the backend state to move away from *State. The watch event drives the
+// wait, the state node is only read when the watch fires. Blocks at PASSIVE_LEVEL;
+// at DISPATCH_LEVEL (resume) it can only poll the store for the watch.
+__drv_maxIRQL(DISPATCH_LEVEL)
 static NTSTATUS
 __WaitState(
     __in  PXENVBD_FRONTEND        Frontend,
@@ -386,14 +550,14 @@ __WaitState(
     XenbusState     OldState = *State;
     PXENBUS_STORE_WATCH Watch;
     KEVENT          Event;
-    LARGE_INTEGER   Timeout;
-
-    LARGE_INTEGER   StartTime;
-    LARGE_INTEGER   CurrentTime;
-    ULONG           Count = 0;
+    LARGE_INTEGER   Frequency;
+    LARGE_INTEGER   Start;
+    LARGE_INTEGER   Now;
+    LONGLONG        Deadline;
+    LONGLONG        Warn;
+    const BOOLEAN   CanBlock = (KeGetCurrentIrql() < DISPATCH_LEVEL) ? TRUE : FALSE;
 
     KeInitializeEvent(&Event, NotificationEvent, FALSE);
-    Timeout.QuadPart = 0;
 
     ASSERT3P(Frontend->BackendPath, !=, NULL);
     Status = STORE(Watch, Frontend->Store, Frontend->BackendPath, "state", 
@@ -401,35 +565,64 @@ __WaitState(
     if (!NT_SUCCESS(Status))
         goto fail1;
 
-    KeQuerySystemTime(&StartTime);
+    Start = KeQueryPerformanceCounter(&Frequency);
+    Deadline = Start.QuadPart + (Frequency.QuadPart * FRONTEND_STATE_TIMEOUT_S);
+    Warn = Start.QuadPart + (Frequency.QuadPart * FRONTEND_STATE_WARN_S);
+    Now = Start;
 
     while (OldState == *State) {
-        // check event and spin or read
+        NTSTATUS        WaitStatus;
+        LARGE_INTEGER   Timeout;
+
+        if (CanBlock) {
+            // relative, wake up to warn and to honour the deadline
+            Timeout.QuadPart = -10000000ll * FRONTEND_STATE_WARN_S;
+            WaitStatus = KeWaitForSingleObject(&Event, Executive, KernelMode,
+                                                FALSE, &Timeout);
+        } else {
+            Timeout.QuadPart = 0;
 #pragma prefast(suppress:28121)
-        if (KeWaitForSingleObject(&Event, Executive, KernelMode, 
-                                    FALSE, &Timeout) == STATUS_TIMEOUT) {
-            STORE(Poll, Frontend->Store);
-
-            KeQuerySystemTime(&CurrentTime);
-            if ((CurrentTime.QuadPart - StartTime.QuadPart) > 10000) {
-                Warning("Target[%d] : %d Waited for %d ms\n", Frontend->TargetId, 
-                            Count, (ULONG)((CurrentTime.QuadPart - StartTime.QuadPart) / 10));
-                StartTime.QuadPart = CurrentTime.QuadPart;
-                ++Count;
-            }
+            WaitStatus = KeWaitForSingleObject(&Event, Executive, KernelMode,
+                                                FALSE, &Timeout);
+            if (WaitStatus == STATUS_TIMEOUT)
+                STORE(Poll, Frontend->Store);
+        }
+
+        Now = KeQueryPerformanceCounter(NULL);
 
+        if (WaitStatus == STATUS_TIMEOUT) {
+            if (Now.QuadPart >= Deadline) {
+                Error("Target[%d] : Backend did not leave %s within %us\n",
+                            Frontend->TargetId, XenbusStateName(OldState), FRONTEND_STATE_TIMEOUT_S);
+                ++Frontend->StateTimeouts;
+                Status = STATUS_IO_TIMEOUT;
+                goto fail2;
+            }
+            if (Now.QuadPart >= Warn) {
+                Warning("Target[%d] : Waited %llu ms for backend to leave %s\n",
+                            Frontend->TargetId,
+                            ((ULONG64)(Now.QuadPart - Start.QuadPart) * 1000ull) / Frequency.QuadPart,
+                            XenbusStateName(OldState));
+                Warn = Now.QuadPart + (Frequency.QuadPart * FRONTEND_STATE_WARN_S);
+            }
             continue;
         }
 
+        // re-arm before reading, so a change after the read is not missed
+        KeClearEvent(&Event);
+
         Status = __ReadState(Frontend, NULL, Frontend->BackendPath, State);
         if (!NT_SUCCESS(Status))
-            goto fail2;
+            goto fail3;
     }
 
     STORE(Unwatch, Frontend->Store, Watch);
+    __WaitStateStats(Frontend, *State, Now.QuadPart - Start.QuadPart);
     Trace("Target[%d] : BACKEND_STATE  -> %s\n", Frontend->TargetId, XenbusStateName(*State));
     return STATUS_SUCCESS;
 
+fail3:
+    Error("Fail3\n");
 fail2:
     Error("Fail2\n");
     STORE(Unwatch, Frontend->Store, Watch);
@@ -437,7 +630,7 @@ fail1:
     Error("Fail1 (%08x)\n", Status);
     return Status;
 }
-__drv_requiresIRQL(DISPATCH_LEVEL)
+__drv_maxIRQL(DISPATCH_LEVEL)
 static NTSTATUS
 ___SetState(
     __in  PXENVBD_FRONTEND        Frontend,
@@ -456,7 +649,7 @@ ___SetState(
 
     return Status;
 }
-__drv_requiresIRQL(DISPATCH_LEVEL)
+__drv_maxIRQL(DISPATCH_LEVEL)
 static FORCEINLINE VOID
 __CheckBackendForEject(
     __in  PXENVBD_FRONTEND        Frontend
@@ -538,6 +731,9 @@ __ReadValue32(
     PCHAR           Buffer;
     ULONG           Value = Default;
 
+    if (!__BackendReadNeeded(Frontend, Name))
+        return Value;
+
     status = STORE(Read, 
                     Frontend->Store, 
                     NULL, 
@@ -566,6 +762,9 @@ __ReadValue64(
     PCHAR           Buffer;
     ULONG64         Value = Default;
 
+    if (!__BackendReadNeeded(Frontend, Name))
+        return Value;
+
     status = STORE(Read, 
                     Frontend->Store, 
                     NULL, 
@@ -582,6 +781,55 @@ __ReadValue64(
 
     return Value;
 }
+static FORCEINLINE ULONG64
+__ReadQosValue(
+    __in  PXENVBD_FRONTEND          Frontend,
+    __in  PCHAR                     Name
+    )
+{
+    NTSTATUS        status;
+    PCHAR           Buffer;
+    ULONG64         Value = 0;
+
+    status = STORE(Read, 
+                    Frontend->Store, 
+                    NULL, 
+                    Frontend->TargetPath,
+                    Name,
+                    &Buffer);
+    if (NT_SUCCESS(status)) {
+        Value = _strtoui64(Buffer, NULL, 10);
+        STORE(Free, Frontend->Store, Buffer);
+    }
+
+    return Value;
+}
+__drv_maxIRQL(DISPATCH_LEVEL)
+static BOOLEAN
+__ReadQos(
+    __in  PXENVBD_FRONTEND          Frontend,
+    __in  BOOLEAN                   Force
+    )
+{
+    ULONG64     Iops;
+    ULONG64     Bytes;
+
+    // optional limits, written next to the usage keys, 0 or missing = unlimited
+    Iops  = __ReadQosValue(Frontend, "qos/iops");
+    Bytes = __ReadQosValue(Frontend, "qos/bytes-per-sec");
+    if (Iops > MAXULONG)
+        Iops = MAXULONG;
+    if (Bytes > XENVBD_QOS_MAX_BYTES_PER_SEC)
+        Bytes = XENVBD_QOS_MAX_BYTES_PER_SEC;
+
+    if (!Force && Iops == Frontend->QosIops && Bytes == Frontend->QosBytes)
+        return FALSE;
+
+    Frontend->QosIops = Iops;
+    Frontend->QosBytes = Bytes;
+    PdoSetQos(Frontend->Pdo, (ULONG)Iops, Bytes);
+    return TRUE;
+}
 static FORCEINLINE ULONG
 __Size(
     __in  PXENVBD_DISKINFO          Info
@@ -602,8 +850,8 @@ __Units(
         return "MB";
     return "GB";
 }
-__drv_requiresIRQL(DISPATCH_LEVEL)
-static VOID
+__drv_maxIRQL(DISPATCH_LEVEL)
+static BOOLEAN
 __ReadDiskInfo(
     __in  PXENVBD_FRONTEND        Frontend
     )
@@ -646,10 +894,12 @@ __ReadDiskInfo(
                     Frontend->DiskInfo.DiskInfo, 
                     Frontend->Caps.SurpriseRemovable ? "SURPRISE_REMOVABLE" : "");
     }
+
+    return Updated;
 }
 
 //=============================================================================
-__drv_requiresIRQL(DISPATCH_LEVEL)
+__drv_maxIRQL(DISPATCH_LEVEL)
 static NTSTATUS
 FrontendClose(
     __in  PXENVBD_FRONTEND        Frontend
@@ -659,23 +909,17 @@ FrontendClose(
     XenbusState     BackendState;
 
     // unwatch backend (null check for initial close operation)
-    if (Frontend->BackendStateWatch)
-        STORE(Unwatch, Frontend->Store, Frontend->BackendStateWatch);
-    Frontend->BackendStateWatch = NULL;
-    
-    if (Frontend->BackendInfoWatch)
-        STORE(Unwatch, Frontend->Store, Frontend->BackendInfoWatch);
-    Frontend->BackendInfoWatch = NULL;
-    
-    if (Frontend->BackendSectorSizeWatch)
-        STORE(Unwatch, Frontend->Store, Frontend->BackendSectorSizeWatch);
-    Frontend->BackendSectorSizeWatch = NULL;
+    if (Frontend->BackendWatch)
+        STORE(Unwatch, Frontend->Store, Frontend->BackendWatch);
+    Frontend->BackendWatch = NULL;
     
-    if (Frontend->BackendSectorCountWatch)
-        STORE(Unwatch, Frontend->Store, Frontend->BackendSectorCountWatch);
-    Frontend->BackendSectorCountWatch = NULL;
+    if (Frontend->TargetQosWatch)
+        STORE(Unwatch, Frontend->Store, Frontend->TargetQosWatch);
+    Frontend->TargetQosWatch = NULL;
     
     Frontend->BackendId = DOMID_INVALID;
+    Frontend->BackendKeys = 0;
+    Frontend->BackendState = XenbusStateUnknown;
 
     // get/update backend path
     Status = __UpdateBackendPath(Frontend);
@@ -723,7 +967,7 @@ fail2:
 fail1:
     return Status;
 }
-__drv_requiresIRQL(DISPATCH_LEVEL)
+__drv_maxIRQL(DISPATCH_LEVEL)
 static NTSTATUS
 FrontendPrepare(
     __in  PXENVBD_FRONTEND        Frontend
@@ -731,69 +975,78 @@ FrontendPrepare(
 {
     NTSTATUS        Status;
     XenbusState     BackendState;
+    LARGE_INTEGER   Start;
+
+    Start = KeQueryPerformanceCounter(NULL);
 
     // get/update backend path
     Status = __UpdateBackendPath(Frontend);
     if (!NT_SUCCESS(Status))
         goto fail1;
 
-    // watch backend (4 paths needed)
-    Status = STORE(Watch, Frontend->Store, Frontend->BackendPath, "state",
-                    Frontend->BackendEvent, &Frontend->BackendStateWatch);
+    // watch backend, one watch covers state, info, sector-size and sectors
+    Status = STORE(Watch, Frontend->Store, NULL, Frontend->BackendPath,
+                    ThreadGetEvent(Frontend->BackendThread), &Frontend->BackendWatch);
     if (!NT_SUCCESS(Status))
         goto fail2;
 
-    Status = STORE(Watch, Frontend->Store, Frontend->BackendPath, "info",
-                    Frontend->BackendEvent, &Frontend->BackendInfoWatch);
-    if (!NT_SUCCESS(Status))
-        goto fail3;
-
-    Status = STORE(Watch, Frontend->Store, Frontend->BackendPath, "sector-size",
-                    Frontend->BackendEvent, &Frontend->BackendSectorSizeWatch);
-    if (!NT_SUCCESS(Status))
-        goto fail4;
-
-    Status = STORE(Watch, Frontend->Store, Frontend->BackendPath, "sectors",
-                    Frontend->BackendEvent, &Frontend->BackendSectorCountWatch);
-    if (!NT_SUCCESS(Status))
-        goto fail5;
+    // QoS limits are optional, without the watch they only apply on reconnect
+    Status = STORE(Watch, Frontend->Store, Frontend->TargetPath, "qos",
+                    ThreadGetEvent(Frontend->BackendThread), &Frontend->TargetQosWatch);
+    if (!NT_SUCCESS(Status)) {
+        Warning("Target[%d] : Unable to watch qos (%08x)\n", Frontend->TargetId, Status);
+        Frontend->TargetQosWatch = NULL;
+    }
 
     // write targetpath
     Status = FrontendWriteUsage(Frontend);
     if (!NT_SUCCESS(Status))
-        goto fail6;
+        goto fail3;
 
     Status = STORE(Printf, Frontend->Store, NULL, Frontend->TargetPath, 
                         "frontend", "%s", Frontend->FrontendPath);
     if (!NT_SUCCESS(Status))
-        goto fail7;
+        goto fail4;
 
     Status = STORE(Printf, Frontend->Store, NULL, Frontend->TargetPath, 
                         "device", "%u", Frontend->DeviceId);
     if (!NT_SUCCESS(Status))
-        goto fail8;
+        goto fail5;
 
     // Frontend: -> INITIALIZING
     Status = ___SetState(Frontend, XenbusStateInitialising);
     if (!NT_SUCCESS(Status))
-        goto fail9;
+        goto fail6;
 
     // Backend : -> INITWAIT
     BackendState = XenbusStateUnknown;
     do {
         Status = __WaitState(Frontend, &BackendState);
         if (!NT_SUCCESS(Status))
-            goto fail10;
+            goto fail7;
     } while (BackendState == XenbusStateClosed || 
              BackendState == XenbusStateInitialising);
     Status = STATUS_UNSUCCESSFUL;
     if (BackendState != XenbusStateInitWait)
-        goto fail11;
+        goto fail8;
 
-    // read inquiry data
-    if (Frontend->Inquiry == NULL)
+    // the backend has written its features by INITWAIT
+    __ListBackend(Frontend);
+
+    // read inquiry data, kept (e.g. across suspend/resume) while the backend is the same
+    if (Frontend->BackendChanged) {
+        PdoFreeInquiryData(Frontend->Inquiry);
+        Frontend->Inquiry = NULL;
+        // the CRCs describe the old backend's disk, FrontendConnect re-sizes an empty map
+        PdoSetIntegrity(Frontend->Pdo, 0);
+        Frontend->BackendChanged = FALSE;
+    }
+    if (Frontend->Inquiry == NULL) {
         PdoReadInquiryData(Frontend, &Frontend->Inquiry);
-    PdoUpdateInquiryData(Frontend, Frontend->Inquiry);
+        PdoUpdateInquiryData(Frontend, Frontend->Inquiry);
+    } else {
+        ++Frontend->InquiryCached;
+    }
 
     // read features and caps (removable, ring-order, ...)
     Frontend->Caps.Removable        = (__ReadValue32(Frontend, "removable", 0, NULL) == 1);
@@ -814,15 +1067,14 @@ FrontendPrepare(
                     Frontend->TargetId,
                     Frontend->Features.Indirect);
     }
-    
+
+    // the listing is only trusted during this state transition, later watch events
+    // and readers must see keys the backend writes from now on
+    Frontend->BackendKeys = 0;
+
+    Frontend->PrepareTicks = KeQueryPerformanceCounter(NULL).QuadPart - Start.QuadPart;
     return STATUS_SUCCESS;
 
-fail11:
-    Error("Fail11\n");
-fail10:
-    Error("Fail10\n");
-fail9:
-    Error("Fail9\n");
 fail8:
     Error("Fail8\n");
 fail7:
@@ -831,25 +1083,22 @@ fail6:
     Error("Fail6\n");
 fail5:
     Error("Fail5\n");
-    (VOID) STORE(Unwatch, Frontend->Store, Frontend->BackendSectorCountWatch);
-    Frontend->BackendSectorCountWatch = NULL;
 fail4:
     Error("Fail4\n");
-    (VOID) STORE(Unwatch, Frontend->Store, Frontend->BackendSectorSizeWatch);
-    Frontend->BackendSectorSizeWatch = NULL;
 fail3:
     Error("Fail3\n");
-    (VOID) STORE(Unwatch, Frontend->Store, Frontend->BackendInfoWatch);
-    Frontend->BackendInfoWatch = NULL;
+    if (Frontend->TargetQosWatch)
+        (VOID) STORE(Unwatch, Frontend->Store, Frontend->TargetQosWatch);
+    Frontend->TargetQosWatch = NULL;
 fail2:
     Error("Fail2\n");
-    (VOID) STORE(Unwatch, Frontend->Store, Frontend->BackendStateWatch);
-    Frontend->BackendStateWatch = NULL;
+    (VOID) STORE(Unwatch, Frontend->Store, Frontend->BackendWatch);
+    Frontend->BackendWatch = NULL;
 fail1:
     Error("Fail1 (%08x)\n", Status);
     return Status;
 }
-__drv_requiresIRQL(DISPATCH_LEVEL)
+__drv_maxIRQL(DISPATCH_LEVEL)
 static NTSTATUS
 FrontendConnect(
     __in  PXENVBD_FRONTEND        Frontend
@@ -857,6 +1106,10 @@ FrontendConnect(
 {
     NTSTATUS        Status;
     XenbusState     BackendState;
+    LARGE_INTEGER   Start;
+    PCHAR           Value;
+
+    Start = KeQueryPerformanceCounter(NULL);
 
     // Alloc Ring, Create Evtchn, Gnttab map
     Status = GranterConnect(Frontend->Granter, Frontend->BackendId);
@@ -942,8 +1195,11 @@ abort:
     if (!NT_SUCCESS(Status))
         goto fail8;
 
+    // the backend has written the disk info and its features by CONNECTED
+    __ListBackend(Frontend);
+
     // read disk info
-    __ReadDiskInfo(Frontend);
+    (VOID) __ReadDiskInfo(Frontend);
 
     Frontend->DiskInfo.Barrier      = (__ReadValue32(Frontend, "feature-barrier", 0, NULL) == 1);
     Frontend->DiskInfo.FlushCache   = (__ReadValue32(Frontend, "feature-flush-cache", 0, NULL) == 1);
@@ -952,19 +1208,45 @@ abort:
     Frontend->DiskInfo.DiscardAlignment = __ReadValue32(Frontend, "discard-alignment", 0, NULL);
     Frontend->DiskInfo.DiscardGranularity = __ReadValue32(Frontend, "discard-granularity", 0, NULL);
 
+    // opt-in, the toolstack writes "discard-zeroes" to the target path when the backend
+    // reads discarded blocks back as zeroes, so all-zero writes may be sent as discards
+    Frontend->DiskInfo.DiscardZeroes = FALSE;
+    if (Frontend->DiskInfo.Discard &&
+        NT_SUCCESS(FrontendStoreReadTarget(Frontend, "discard-zeroes", &Value))) {
+        Frontend->DiskInfo.DiscardZeroes = (strtoul(Value, NULL, 10) == 1);
+        FrontendStoreFree(Frontend, Value);
+    }
+
     Verbose("Target[%d] : VBDFeatures %s%s%s\n",
                 Frontend->TargetId,
                 Frontend->DiskInfo.Barrier ? "BARRIER " : "",
                 Frontend->DiskInfo.FlushCache ?  "FLUSH " : "",
                 Frontend->DiskInfo.Discard ? "DISCARD " : "");
     if (Frontend->DiskInfo.Discard) {
-        Verbose("Target[%d] : DISCARD %s%x/%x\n",
+        Verbose("Target[%d] : DISCARD %s%s%x/%x\n",
                     Frontend->TargetId,
                     Frontend->DiskInfo.DiscardSecure ? "SECURE " : "",
+                    Frontend->DiskInfo.DiscardZeroes ? "ZEROES " : "",
                     Frontend->DiskInfo.DiscardAlignment,
                     Frontend->DiskInfo.DiscardGranularity);
     }
 
+    // specialize the data path for this backend
+    PdoSelectPrepare(Frontend->Pdo);
+    (VOID) __ReadQos(Frontend, TRUE);
+
+    // opt-in, "crc-map-entries" in the target path sizes the integrity map, see PdoSetIntegrity
+    if (NT_SUCCESS(FrontendStoreReadTarget(Frontend, "crc-map-entries", &Value))) {
+        PdoSetIntegrity(Frontend->Pdo, strtoul(Value, NULL, 10));
+        FrontendStoreFree(Frontend, Value);
+    } else {
+        PdoSetIntegrity(Frontend->Pdo, 0);
+    }
+
+    // as in FrontendPrepare, the listing is stale once CONNECTED has been handled
+    Frontend->BackendKeys = 0;
+
+    Frontend->ConnectTicks = KeQueryPerformanceCounter(NULL).QuadPart - Start.QuadPart;
     return STATUS_SUCCESS;
 
 fail8:
@@ -988,7 +1270,7 @@ fail1:
     Error("Fail1 (%08x)\n", Status);
     return Status;
 }
-__drv_requiresIRQL(DISPATCH_LEVEL)
+__drv_maxIRQL(DISPATCH_LEVEL)
 static FORCEINLINE VOID
 FrontendDisconnect(
     __in  PXENVBD_FRONTEND        Frontend
@@ -998,7 +1280,7 @@ FrontendDisconnect(
     BlockRingDisconnect(Frontend->BlockRing);
     GranterDisconnect(Frontend->Granter);
 }
-__drv_requiresIRQL(DISPATCH_LEVEL)
+__drv_maxIRQL(DISPATCH_LEVEL)
 static FORCEINLINE VOID
 FrontendEnable(
     __in  PXENVBD_FRONTEND        Frontend
@@ -1011,7 +1293,7 @@ FrontendEnable(
     BlockRingEnable(Frontend->BlockRing);
     NotifierEnable(Frontend->Notifier);
 }
-__drv_requiresIRQL(DISPATCH_LEVEL)
+__drv_maxIRQL(DISPATCH_LEVEL)
 static FORCEINLINE VOID
 FrontendDisable(
     __in  PXENVBD_FRONTEND        Frontend
@@ -1041,7 +1323,7 @@ __FrontendSetState(
                 TargetId, 
                 __XenvbdStateName(Frontend->State), 
                 __XenvbdStateName(State));
-    ASSERT3U(KeGetCurrentIrql(), ==, DISPATCH_LEVEL);
+    ASSERT3U(KeGetCurrentIrql(), <=, DISPATCH_LEVEL);
     
     while (!Failed && Frontend->State != State) {
         switch (Frontend->State) {
@@ -1171,52 +1453,152 @@ __FrontendSetState(
     return Failed ? STATUS_UNSUCCESSFUL : STATUS_SUCCESS;
 }
 
+__drv_maxIRQL(PASSIVE_LEVEL)
+static FORCEINLINE VOID
+__FrontendLockState(
+    __in  PXENVBD_FRONTEND        Frontend
+    )
+{
+    (VOID) KeWaitForSingleObject(&Frontend->StateMutex, Executive, KernelMode, FALSE, NULL);
+}
+
+static FORCEINLINE VOID
+__FrontendUnlockState(
+    __in  PXENVBD_FRONTEND        Frontend
+    )
+{
+    (VOID) KeReleaseMutex(&Frontend->StateMutex, FALSE);
+}
+
 __drv_requiresIRQL(DISPATCH_LEVEL)
 static DECLSPEC_NOINLINE VOID
 FrontendSuspendLateCallback(
     __in  PVOID                   Argument
     )
 {
-    NTSTATUS            Status;
-    XENVBD_STATE        State;
     PXENVBD_FRONTEND    Frontend = (PXENVBD_FRONTEND)Argument;
 
     Verbose("Target[%d] : ===> from %s\n", Frontend->TargetId, __XenvbdStateName(Frontend->State));
+
+    // called at DISPATCH on 1 vCPU with interrupts enabled, keep outstanding requests
+    // and leave the reconnect to the backend thread so all targets reconnect together
+    if (InterlockedExchange(&Frontend->Resuming, 1) == 0)
+        PdoPreResume(Frontend->Pdo);
+    ThreadWake(Frontend->BackendThread);
+
+    Verbose("Target[%d] : <===\n", Frontend->TargetId);
+}
+
+__drv_maxIRQL(PASSIVE_LEVEL)
+static VOID
+__FrontendResume(
+    __in  PXENVBD_FRONTEND        Frontend
+    )
+{
+    NTSTATUS        Status;
+    XENVBD_STATE    State;
+
+    __FrontendLockState(Frontend);
     State = Frontend->State;
+    Verbose("Target[%d] : ===> from %s\n", Frontend->TargetId, __XenvbdStateName(State));
 
-    PdoPreResume(Frontend->Pdo);
+    // other vCPUs ran since the suspend-late callback, collect anything they put on the old ring
+    PdoResumeDrain(Frontend->Pdo);
 
-    // dont acquire state lock - called at DISPATCH on 1 vCPU with interrupts enabled
     Status = __FrontendSetState(Frontend, XENVBD_CLOSED);
-    if (!NT_SUCCESS(Status)) {
+    if (!NT_SUCCESS(Status))
         Error("Target[%d] : SetState CLOSED (%08x)\n", Frontend->TargetId, Status);
-        ASSERT(FALSE);
-    }
 
-    // dont acquire state lock - called at DISPATCH on 1 vCPU with interrupts enabled
-    Status = __FrontendSetState(Frontend, State);
-    if (!NT_SUCCESS(Status)) {
-        Error("Target[%d] : SetState %s (%08x)\n", Frontend->TargetId, __XenvbdStateName(State), Status);
-        ASSERT(FALSE);
+    if (NT_SUCCESS(Status)) {
+        Status = __FrontendSetState(Frontend, State);
+        if (!NT_SUCCESS(Status))
+            Error("Target[%d] : SetState %s (%08x)\n", Frontend->TargetId, __XenvbdStateName(State), Status);
     }
 
+    // replays kept requests, or requeues their SRBs if the backend cannot take them
     PdoPostResume(Frontend->Pdo);
+    __FrontendUnlockState(Frontend);
+
     NotifierTrigger(Frontend->Notifier);
 
     Verbose("Target[%d] : <=== restored %s\n", Frontend->TargetId, __XenvbdStateName(Frontend->State));
 }
 
+__drv_maxIRQL(PASSIVE_LEVEL)
+static VOID
+__FrontendBackendChanged(
+    __in  PXENVBD_FRONTEND        Frontend
+    )
+{
+    NTSTATUS        Status;
+    XenbusState     BackendState;
+    BOOLEAN         Changed = FALSE;
+
+    __FrontendLockState(Frontend);
+
+    // Only attempt this if Active, Active is set/cleared on D3->D0/D0->D3
+    if (!Frontend->Active)
+        goto done;
+
+    // the watch covers the whole backend directory, act on what changed
+    ++Frontend->BackendWakeups;
+
+    Status = __ReadState(Frontend, NULL, Frontend->BackendPath, &BackendState);
+    if (NT_SUCCESS(Status) &&
+        (BackendState != Frontend->BackendState ||
+         BackendState == XenbusStateClosing)) {
+        Frontend->BackendState = BackendState;
+        __CheckBackendForEject(Frontend);
+        Changed = TRUE;
+    }
+
+    if (__ReadDiskInfo(Frontend)) {
+        PdoSelectPrepare(Frontend->Pdo);
+        Changed = TRUE;
+    }
+
+    if (__ReadQos(Frontend, FALSE))
+        Changed = TRUE;
+
+    if (!Changed)
+        ++Frontend->BackendSpurious;
+
+done:
+    __FrontendUnlockState(Frontend);
+}
+
 __checkReturn
-__drv_maxIRQL(DISPATCH_LEVEL)
+static DECLSPEC_NOINLINE NTSTATUS
+FrontendBackend(
+    __in PXENVBD_THREAD           Thread,
+    __in PVOID                    Context
+    )
+{
+    PXENVBD_FRONTEND    Frontend = Context;
+
+    for (;;) {
+        if (!ThreadWait(Thread))
+            break;
+
+        if (InterlockedExchange(&Frontend->Resuming, 0) != 0)
+            __FrontendResume(Frontend);
+
+        __FrontendBackendChanged(Frontend);
+    }
+
+    return STATUS_SUCCESS;
+}
+
+__checkReturn
+__drv_maxIRQL(PASSIVE_LEVEL)
 NTSTATUS
 FrontendD3ToD0(
     __in  PXENVBD_FRONTEND        Frontend
     )
 {
     NTSTATUS    Status;
-    KIRQL       Irql;
 
-    KeAcquireSpinLock(&Frontend->StateLock, &Irql);
+    __FrontendLockState(Frontend);
 
     // acquire interfaces
     Frontend->Store   = FdoAcquireStore(PdoGetFdo(Frontend->Pdo));
@@ -1232,7 +1614,7 @@ FrontendD3ToD0(
     // update state
     Frontend->Active = TRUE;
 
-    KeReleaseSpinLock(&Frontend->StateLock, Irql);
+    __FrontendUnlockState(Frontend);
     return STATUS_SUCCESS;
 
 fail1:
@@ -1244,19 +1626,17 @@ fail1:
     STORE(Release, Frontend->Store);
     Frontend->Store = NULL;
 
-    KeReleaseSpinLock(&Frontend->StateLock, Irql);
+    __FrontendUnlockState(Frontend);
     return Status;
 }
 
-__drv_maxIRQL(DISPATCH_LEVEL)
+__drv_maxIRQL(PASSIVE_LEVEL)
 VOID
 FrontendD0ToD3(
     __in  PXENVBD_FRONTEND        Frontend
     )
 {
-    KIRQL       Irql;
-
-    KeAcquireSpinLock(&Frontend->StateLock, &Irql);
+    __FrontendLockState(Frontend);
 
     // update state
     Frontend->Active = FALSE;
@@ -1279,10 +1659,11 @@ FrontendD0ToD3(
     STORE(Release, Frontend->Store);
     Frontend->Store = NULL;
 
-    KeReleaseSpinLock(&Frontend->StateLock, Irql);
+    __FrontendUnlockState(Frontend);
 }
 
 __checkReturn
+__drv_maxIRQL(PASSIVE_LEVEL)
 NTSTATUS
 FrontendSetState(
     __in  PXENVBD_FRONTEND        Frontend,
@@ -1290,37 +1671,21 @@ FrontendSetState(
     )
 {
     NTSTATUS    Status;
-    KIRQL       Irql;
 
-    KeAcquireSpinLock(&Frontend->StateLock, &Irql);
+    __FrontendLockState(Frontend);
 
     Status = __FrontendSetState(Frontend, State);
 
-    KeReleaseSpinLock(&Frontend->StateLock, Irql);
+    __FrontendUnlockState(Frontend);
     return Status;
 }
 
-__drv_requiresIRQL(DISPATCH_LEVEL)
-VOID
-FrontendBackendPathChanged(
-    __in  PXENVBD_FRONTEND        Frontend
-    )
-{
-    // Only attempt this if Active, Active is set/cleared on D3->D0/D0->D3
-    if (Frontend->Active) {
-        // Note: Nothing may have changed with this target, this could be caused by another target changing
-        __ReadDiskInfo(Frontend);
-        __CheckBackendForEject(Frontend);
-    }
-}
-
 __checkReturn
 NTSTATUS
 FrontendCreate(
     __in  PXENVBD_PDO             Pdo,
     __in  PCHAR                   DeviceId, 
     __in  ULONG                   TargetId, 
-    __in  PKEVENT                 Event,
     __out PXENVBD_FRONTEND*       _Frontend
     )
 {
@@ -1342,7 +1707,7 @@ FrontendCreate(
     Frontend->State = XENVBD_INITIALIZED;
     Frontend->DiskInfo.SectorSize = 512; // default sector size
     Frontend->BackendId = DOMID_INVALID;
-    Frontend->BackendEvent = Event;
+    Frontend->BackendState = XenbusStateUnknown;
     
     Status = STATUS_INSUFFICIENT_RESOURCES;
     Frontend->FrontendPath = DriverFormat("device/%s/%s", FdoEnum(PdoGetFdo(Pdo)), DeviceId);
@@ -1366,12 +1731,20 @@ FrontendCreate(
         goto fail6;
 
     // kernel objects
-    KeInitializeSpinLock(&Frontend->StateLock);
+    KeInitializeMutex(&Frontend->StateMutex, 0);
+
+    Status = ThreadCreate(FrontendBackend, Frontend, &Frontend->BackendThread);
+    if (!NT_SUCCESS(Status))
+        goto fail7;
     
     Trace("Target[%d] @ (%d) <===== (STATUS_SUCCESS)\n", Frontend->TargetId, KeGetCurrentIrql());
     *_Frontend = Frontend;
     return STATUS_SUCCESS;
 
+fail7:
+    Error("fail7\n");
+    GranterDestroy(Frontend->Granter);
+    Frontend->Granter = NULL;
 fail6:
     Error("fail6\n");
     BlockRingDestroy(Frontend->BlockRing);
@@ -1406,6 +1779,10 @@ FrontendDestroy(
 
     Trace("Target[%d] @ (%d) =====>\n", TargetId, KeGetCurrentIrql());
 
+    ThreadAlert(Frontend->BackendThread);
+    ThreadJoin(Frontend->BackendThread);
+    Frontend->BackendThread = NULL;
+
     PdoFreeInquiryData(Frontend->Inquiry);
     Frontend->Inquiry = NULL;
 
@@ -1427,10 +1804,8 @@ FrontendDestroy(
     ASSERT3P(Frontend->BackendPath, ==, NULL);
     ASSERT3P(Frontend->Inquiry, ==, NULL);
     ASSERT3P(Frontend->SuspendLateCallback, ==, NULL);
-    ASSERT3P(Frontend->BackendStateWatch, ==, NULL);
-    ASSERT3P(Frontend->BackendInfoWatch, ==, NULL);
-    ASSERT3P(Frontend->BackendSectorSizeWatch, ==, NULL);
-    ASSERT3P(Frontend->BackendSectorCountWatch, ==, NULL);
+    ASSERT3P(Frontend->BackendWatch, ==, NULL);
+    ASSERT3P(Frontend->TargetQosWatch, ==, NULL);
 
     __FrontendFree(Frontend);
     Trace("Target[%d] @ (%d) <=====\n", TargetId, KeGetCurrentIrql());
@@ -1487,8 +1862,9 @@ FrontendDebugCallback(
     }
     if (Frontend->DiskInfo.Discard) {
         DEBUG(Printf, Debug, Callback,
-                "FRONTEND: DISCARD %s%x/%x\n",
+                "FRONTEND: DISCARD %s%s%x/%x\n",
                 Frontend->DiskInfo.DiscardSecure ? "SECURE " : "",
+                Frontend->DiskInfo.DiscardZeroes ? "ZEROES " : "",
                 Frontend->DiskInfo.DiscardAlignment,
                 Frontend->DiskInfo.DiscardGranularity);
     }
@@ -1500,6 +1876,42 @@ FrontendDebugCallback(
             Frontend->DiskInfo.PhysSectorSize,
             Frontend->DiskInfo.DiskInfo);
 
+    {
+        LARGE_INTEGER   Frequency;
+        ULONG           Index;
+
+        (VOID) KeQueryPerformanceCounter(&Frequency);
+        DEBUG(Printf, Debug, Callback,
+                "FRONTEND: Backend Reads=%u Skipped=%u InquiryCached=%u\n",
+                Frontend->StoreReads,
+                Frontend->StoreReadsSkipped,
+                Frontend->InquiryCached);
+        DEBUG(Printf, Debug, Callback,
+                "FRONTEND: Backend Wakeups=%u Spurious=%u\n",
+                Frontend->BackendWakeups,
+                Frontend->BackendSpurious);
+        if (Frequency.QuadPart != 0) {
+            DEBUG(Printf, Debug, Callback,
+                    "FRONTEND: Backend Prepare=%llu us Connect=%llu us (last)\n",
+                    ((ULONG64)Frontend->PrepareTicks * 1000000ull) / Frequency.QuadPart,
+                    ((ULONG64)Frontend->ConnectTicks * 1000000ull) / Frequency.QuadPart);
+        }
+        DEBUG(Printf, Debug, Callback,
+                "FRONTEND: Backend Timeouts=%u\n",
+                Frontend->StateTimeouts);
+        for (Index = 0; Index < FRONTEND_BACKEND_STATES; ++Index) {
+            if (Frontend->StateWaits[Index] == 0 || Frequency.QuadPart == 0)
+                continue;
+            DEBUG(Printf, Debug, Callback,
+                    "FRONTEND: Backend -> %-14s : %u waits, %llu us avg / %llu us max\n",
+                    XenbusStateName((XenbusState)Index),
+                    Frontend->StateWaits[Index],
+                    ((ULONG64)Frontend->StateWaitTicks[Index] * 1000000ull) /
+                            (Frequency.QuadPart * Frontend->StateWaits[Index]),
+                    ((ULONG64)Frontend->StateMaxTicks[Index] * 1000000ull) / Frequency.QuadPart);
+        }
+    }
+
     GranterDebugCallback(Frontend->Granter, Debug, Callback);
     BlockRingDebugCallback(Frontend->BlockRing, Debug, Callback);
     NotifierDebugCallback(Frontend->Notifier, Debug, Callback);
@@ -67,6 +67,7 @@ typedef struct _XENVBD_DISKINFO {
     BOOLEAN                     FlushCache;
     BOOLEAN                     Discard;
     BOOLEAN                     DiscardSecure;
+    BOOLEAN                     DiscardZeroes;  // target opt-in, discarded blocks read as zeroes
     ULONG                       DiscardAlignment;
     ULONG                       DiscardGranularity;
 } XENVBD_DISKINFO, *PXENVBD_DISKINFO;
@@ -131,6 +132,12 @@ FrontendStoreReadBackend(
     __in  PCHAR                 Name,
     __out PCHAR*                Value
     );
+extern NTSTATUS
+FrontendStoreReadTarget(
+    __in  PXENVBD_FRONTEND      Frontend,
+    __in  PCHAR                 Name,
+    __out PCHAR*                Value
+    );
 extern VOID
 FrontendStoreFree(
     __in  PXENVBD_FRONTEND      Frontend,
@@ -151,38 +158,32 @@ FrontendNotifyResponses(
 
 // Init/Term
 __checkReturn
-__drv_maxIRQL(DISPATCH_LEVEL)
+__drv_maxIRQL(PASSIVE_LEVEL)
 extern NTSTATUS
 FrontendD3ToD0(
     __in  PXENVBD_FRONTEND        Frontend
     );
 
-__drv_maxIRQL(DISPATCH_LEVEL)
+__drv_maxIRQL(PASSIVE_LEVEL)
 extern VOID
 FrontendD0ToD3(
     __in  PXENVBD_FRONTEND        Frontend
     );
 
 __checkReturn
+__drv_maxIRQL(PASSIVE_LEVEL)
 extern NTSTATUS
 FrontendSetState(
     __in  PXENVBD_FRONTEND        Frontend,
     __in  XENVBD_STATE            State
     );
 
-__drv_requiresIRQL(DISPATCH_LEVEL)
-extern VOID
-FrontendBackendPathChanged(
-    __in  PXENVBD_FRONTEND        Frontend
-    );
-
 __checkReturn
 extern NTSTATUS
 FrontendCreate(
     __in  PXENVBD_PDO             Pdo,
     __in  PCHAR                   DeviceId, 
     __in  ULONG                   TargetId, 
-    __in  PKEVENT                 Event,
     __out PXENVBD_FRONTEND*       _Frontend
     );
 
@@ -32,11 +32,21 @@
 #include "frontend.h"
 #include "pdo.h"
 #include "fdo.h"
+#include "driver.h"
 #include "util.h"
 #include "debug.h"
 #include "thread.h"
 #include <gnttab_interface.h>
 
+#define GRANTER_CACHE_SIZE          256
+#define GRANTER_CACHE_BUDGET        1024    // descriptors cached by all targets together
+
+// Shared by all targets, so idle caches cannot pin the grant table
+static struct {
+    LONG                            Cached;     // descriptors held in target caches
+    LONG                            Trim;       // bumped when XenBus runs out, caches drain on next use
+} __Granter;
+
 struct _XENVBD_GRANTER {
     PXENVBD_FRONTEND                Frontend;
     BOOLEAN                         Connected;
@@ -45,6 +55,29 @@ struct _XENVBD_GRANTER {
     PXENBUS_GNTTAB_INTERFACE        GnttabInterface;
 
     USHORT                          BackendDomain;
+
+    KSPIN_LOCK                      Lock;
+
+    // Cache - free descriptors, saves a Get/Put round trip through XenBus
+    PXENBUS_GNTTAB_DESCRIPTOR       Cache[GRANTER_CACHE_SIZE];
+    ULONG                           CacheCount;
+    LONG                            Trim;
+
+    // Reserve - descriptors kept aside for Paging/Hibernation/DumpFile targets
+    PXENBUS_GNTTAB_DESCRIPTOR       Reserve[XENVBD_RESERVE_GRANT_REFS];
+    ULONG                           ReserveCount;
+    ULONG                           ReserveTarget;
+    ULONG                           ReserveUsed;
+
+    // Stats
+    ULONG64                         Granted;
+    ULONG64                         Revoked;
+    ULONG64                         CacheHits;
+    ULONG                           Batches;
+    ULONG                           PutBatches;
+    ULONG                           Trims;
+    LONGLONG                        Ticks;
+    LARGE_INTEGER                   LastDebug;
 };
 #define GRANTER_POOL_TAG            'tnGX'
 
@@ -68,6 +101,92 @@ __GranterFree(
         __FreePoolWithTag(Buffer, GRANTER_POOL_TAG);
 }
 
+// Lock held. Hands every cached descriptor back to XenBus
+static VOID
+__GranterDrain(
+    IN  PXENVBD_GRANTER             Granter
+    )
+{
+    while (Granter->CacheCount != 0) {
+        GNTTAB(Put, Granter->GnttabInterface,
+               Granter->Cache[--Granter->CacheCount]);
+        Granter->Cache[Granter->CacheCount] = NULL;
+        InterlockedDecrement(&__Granter.Cached);
+    }
+}
+
+// Lock held. Drains the cache once after any target failed to get a descriptor
+static FORCEINLINE VOID
+__GranterTrim(
+    IN  PXENVBD_GRANTER             Granter
+    )
+{
+    LONG    Trim = __Granter.Trim;
+
+    if (Granter->Trim == Trim)
+        return;
+
+    Granter->Trim = Trim;
+    if (Granter->CacheCount != 0) {
+        __GranterDrain(Granter);
+        ++Granter->Trims;
+    }
+}
+
+// Lock held. Returns a revoked descriptor to the reserve, the cache or XenBus
+static FORCEINLINE VOID
+__GranterRecycle(
+    IN  PXENVBD_GRANTER             Granter,
+    IN  PXENBUS_GNTTAB_DESCRIPTOR   Descriptor
+    )
+{
+    if (Granter->ReserveCount < Granter->ReserveTarget) {
+        Granter->Reserve[Granter->ReserveCount++] = Descriptor;
+        return;
+    }
+
+    if (Granter->CacheCount < GRANTER_CACHE_SIZE) {
+        if (InterlockedIncrement(&__Granter.Cached) <= GRANTER_CACHE_BUDGET) {
+            Granter->Cache[Granter->CacheCount++] = Descriptor;
+            return;
+        }
+        InterlockedDecrement(&__Granter.Cached);
+    }
+
+    GNTTAB(Put, Granter->GnttabInterface, Descriptor);
+}
+
+// Lock held. Cache first, then XenBus, then the reserve
+static FORCEINLINE PXENBUS_GNTTAB_DESCRIPTOR
+__GranterGetDescriptor(
+    IN  PXENVBD_GRANTER             Granter
+    )
+{
+    PXENBUS_GNTTAB_DESCRIPTOR       Descriptor;
+
+    if (Granter->CacheCount != 0) {
+        Descriptor = Granter->Cache[--Granter->CacheCount];
+        Granter->Cache[Granter->CacheCount] = NULL;
+        InterlockedDecrement(&__Granter.Cached);
+        ++Granter->CacheHits;
+        return Descriptor;
+    }
+
+    Descriptor = GNTTAB(Get, Granter->GnttabInterface);
+    if (Descriptor != NULL)
+        return Descriptor;
+
+    // the grant table is exhausted, have every target give its cache back
+    InterlockedIncrement(&__Granter.Trim);
+
+    if (Granter->ReserveCount != 0) {
+        Descriptor = Granter->Reserve[--Granter->ReserveCount];
+        Granter->Reserve[Granter->ReserveCount] = NULL;
+        ++Granter->ReserveUsed;
+    }
+    return Descriptor;
+}
+
 NTSTATUS
 GranterCreate(
     IN  PXENVBD_FRONTEND            Frontend,
@@ -82,6 +201,7 @@ GranterCreate(
         goto fail1;
 
     (*Granter)->Frontend = Frontend;
+    KeInitializeSpinLock(&(*Granter)->Lock);
 
     return STATUS_SUCCESS;
 
@@ -95,6 +215,13 @@ GranterDestroy(
     )
 {
     Granter->Frontend = NULL;
+    Granter->ReserveUsed = 0;
+    Granter->Granted = Granter->Revoked = Granter->CacheHits = 0;
+    Granter->Batches = Granter->PutBatches = Granter->Trims = 0;
+    Granter->Trim = 0;
+    Granter->Ticks = 0;
+    Granter->LastDebug.QuadPart = 0;
+    RtlZeroMemory(&Granter->Lock, sizeof(KSPIN_LOCK));
 
     ASSERT(IsZeroMemory(Granter, sizeof(XENVBD_GRANTER)));
     
@@ -108,13 +235,18 @@ GranterConnect(
     )
 {
     PXENVBD_FDO Fdo = PdoGetFdo(FrontendGetPdo(Granter->Frontend));
+    KIRQL       Irql;
 
     ASSERT(Granter->Connected == FALSE);
 
     Granter->GnttabInterface = FdoAcquireGnttab(Fdo);
     Granter->BackendDomain = BackendDomain;
+    Granter->LastDebug = KeQueryPerformanceCounter(NULL);
 
+    KeAcquireSpinLock(&Granter->Lock, &Irql);
+    Granter->Trim = __Granter.Trim;
     Granter->Connected = TRUE;
+    KeReleaseSpinLock(&Granter->Lock, Irql);
     return STATUS_SUCCESS;
 }
 
@@ -157,14 +289,22 @@ GranterDisconnect(
     IN  PXENVBD_GRANTER             Granter
     )
 {
+    KIRQL       Irql;
+
     ASSERT(Granter->Connected == TRUE);
 
+    GranterReserve(Granter, 0);
+
+    // grants are revoked as they are put, hand the cache back to XenBus
+    KeAcquireSpinLock(&Granter->Lock, &Irql);
+    __GranterDrain(Granter);
+    Granter->Connected = FALSE;
+    KeReleaseSpinLock(&Granter->Lock, Irql);
+
     Granter->BackendDomain = 0;
 
     GNTTAB(Release, Granter->GnttabInterface);
     Granter->GnttabInterface = NULL;
-
-    Granter->Connected = FALSE;
 }
 
 VOID
@@ -174,61 +314,210 @@ GranterDebugCallback(
     IN  PXENBUS_DEBUG_CALLBACK      Callback
     )
 {
+    LARGE_INTEGER   Now, Frequency;
+    ULONG64         Elapsed;
+
+    Now = KeQueryPerformanceCounter(&Frequency);
+    Elapsed = (ULONG64)(Now.QuadPart - Granter->LastDebug.QuadPart);
+
     DEBUG(Printf, Debug, Callback,
         "GRANTER: %s %s\n", 
         Granter->Connected ? "CONNECTED" : "DISCONNECTED",
         Granter->Enabled ? "ENABLED" : "DISABLED");
+    DEBUG(Printf, Debug, Callback,
+        "GRANTER: Granted %llu (%llu/s) Revoked %llu\n",
+        Granter->Granted,
+        Elapsed ? (Granter->Granted * Frequency.QuadPart) / Elapsed : 0ull,
+        Granter->Revoked);
+    DEBUG(Printf, Debug, Callback,
+        "GRANTER: Cache %u (%llu hits, %u trims) Batches %u Put Batches %u\n",
+        Granter->CacheCount,
+        Granter->CacheHits,
+        Granter->Trims,
+        Granter->Batches,
+        Granter->PutBatches);
+    DEBUG(Printf, Debug, Callback,
+        "GRANTER: All Caches %d / %u\n",
+        __Granter.Cached,
+        GRANTER_CACHE_BUDGET);
+    DEBUG(Printf, Debug, Callback,
+        "GRANTER: %llu us in granter\n",
+        Frequency.QuadPart ? ((ULONG64)Granter->Ticks * 1000000ull) / Frequency.QuadPart : 0ull);
+    DEBUG(Printf, Debug, Callback,
+        "GRANTER: Reserve %u / %u (%u used)\n",
+        Granter->ReserveCount,
+        Granter->ReserveTarget,
+        Granter->ReserveUsed);
+
+    Granter->Granted = Granter->Revoked = Granter->CacheHits = 0;
+    Granter->Batches = Granter->PutBatches = Granter->Trims = 0;
+    Granter->Ticks = 0;
+    Granter->LastDebug = Now;
+}
+
+VOID
+GranterReserve(
+    IN  PXENVBD_GRANTER         Granter,
+    IN  ULONG                   Count
+    )
+{
+    KIRQL                       Irql;
+
+    ASSERT(Granter->Connected == TRUE);
+
+    KeAcquireSpinLock(&Granter->Lock, &Irql);
+    Granter->ReserveTarget = __min(Count, XENVBD_RESERVE_GRANT_REFS);
+
+    while (Granter->ReserveCount < Granter->ReserveTarget) {
+        PXENBUS_GNTTAB_DESCRIPTOR   Descriptor;
+
+        Descriptor = GNTTAB(Get, Granter->GnttabInterface);
+        if (Descriptor == NULL)
+            break; // topped up as descriptors are recycled
+        Granter->Reserve[Granter->ReserveCount++] = Descriptor;
+    }
+    while (Granter->ReserveCount > Granter->ReserveTarget) {
+        GNTTAB(Put, Granter->GnttabInterface,
+               Granter->Reserve[--Granter->ReserveCount]);
+        Granter->Reserve[Granter->ReserveCount] = NULL;
+    }
+    KeReleaseSpinLock(&Granter->Lock, Irql);
 }
 
 NTSTATUS
-GranterGet(
+GranterGetMany(
     IN  PXENVBD_GRANTER         Granter,
-    IN  PFN_NUMBER              Pfn,
+    IN  ULONG                   Count,
+    IN  PPFN_NUMBER             Pfn,
     IN  BOOLEAN                 ReadOnly,
     OUT PVOID                   *Handle
     )
 {
     PXENBUS_GNTTAB_DESCRIPTOR   Descriptor;
+    LARGE_INTEGER               Start, End;
+    KIRQL                       Irql;
+    ULONG                       Index;
     NTSTATUS                    status;
 
-    Descriptor = GNTTAB(Get, 
-                        Granter->GnttabInterface);
+    Start = KeQueryPerformanceCounter(NULL);
+    KeAcquireSpinLock(&Granter->Lock, &Irql);
+    __GranterTrim(Granter);
 
-    status = STATUS_INSUFFICIENT_RESOURCES;
-    if (Descriptor == NULL)
-        goto fail1;
+    for (Index = 0; Index < Count; ++Index) {
+        Descriptor = __GranterGetDescriptor(Granter);
+
+        status = STATUS_INSUFFICIENT_RESOURCES;
+        if (Descriptor == NULL)
+            goto fail1;
+
+        status = GNTTAB(PermitForeignAccess, 
+                        Granter->GnttabInterface, 
+                        Descriptor, 
+                        Granter->BackendDomain,
+                        GNTTAB_ENTRY_FULL_PAGE,
+                        Pfn[Index],
+                        ReadOnly);
+        ASSERT(NT_SUCCESS(status));
+
+        Handle[Index] = Descriptor;
+    }
+    Granter->Granted += Count;
+    ++Granter->Batches;
+
+    End = KeQueryPerformanceCounter(NULL);
+    Granter->Ticks += End.QuadPart - Start.QuadPart;
+    KeReleaseSpinLock(&Granter->Lock, Irql);
 
-    status = GNTTAB(PermitForeignAccess, 
-                    Granter->GnttabInterface, 
-                    Descriptor, 
-                    Granter->BackendDomain,
-                    GNTTAB_ENTRY_FULL_PAGE,
-                    Pfn,
-                    ReadOnly);
-    ASSERT(NT_SUCCESS(status));
-    
-    *Handle = Descriptor;
     return STATUS_SUCCESS;
 
 fail1:
+    // all or nothing, the backend never saw these
+    while (Index != 0) {
+        Descriptor = Handle[--Index];
+        Handle[Index] = NULL;
+
+        (VOID) GNTTAB(RevokeForeignAccess,
+                      Granter->GnttabInterface,
+                      Descriptor);
+        __GranterRecycle(Granter, Descriptor);
+    }
+
+    End = KeQueryPerformanceCounter(NULL);
+    Granter->Ticks += End.QuadPart - Start.QuadPart;
+    KeReleaseSpinLock(&Granter->Lock, Irql);
+
     return status;
 }
 
+NTSTATUS
+GranterGet(
+    IN  PXENVBD_GRANTER         Granter,
+    IN  PFN_NUMBER              Pfn,
+    IN  BOOLEAN                 ReadOnly,
+    OUT PVOID                   *Handle
+    )
+{
+    return GranterGetMany(Granter, 1, &Pfn, ReadOnly, Handle);
+}
+
 VOID
-GranterPut(
+GranterPutMany(
     IN  PXENVBD_GRANTER         Granter,
-    IN  PVOID                   Handle
+    IN  ULONG                   Count,
+    IN  PVOID                   *Handle
     )
 {
-    PXENBUS_GNTTAB_DESCRIPTOR   Descriptor = Handle;
+    LARGE_INTEGER               Start, End;
+    KIRQL                       Irql;
+    ULONG                       Index;
+    ULONG                       Revoked;
     NTSTATUS                    status;
 
-    status = GNTTAB(RevokeForeignAccess,
-                    Granter->GnttabInterface,
-                    Descriptor);
-    ASSERT(NT_SUCCESS(status));
+    Start = KeQueryPerformanceCounter(NULL);
+    KeAcquireSpinLock(&Granter->Lock, &Irql);
+
+    // the interface these were granted through has gone, never revoke through another
+    ASSERT(Granter->Connected);
+    if (!Granter->Connected) {
+        KeReleaseSpinLock(&Granter->Lock, Irql);
+        Error("Target[%d] : %u grants put after disconnect\n",
+                FrontendGetTargetId(Granter->Frontend), Count);
+        return;
+    }
+
+    __GranterTrim(Granter);
+
+    // revoke the whole batch before the caller releases the pages
+    Revoked = 0;
+    for (Index = 0; Index < Count; ++Index) {
+        PXENBUS_GNTTAB_DESCRIPTOR   Descriptor = Handle[Index];
+
+        if (Descriptor == NULL)
+            continue;
+
+        status = GNTTAB(RevokeForeignAccess,
+                        Granter->GnttabInterface,
+                        Descriptor);
+        ASSERT(NT_SUCCESS(status));
+
+        __GranterRecycle(Granter, Descriptor);
+        ++Revoked;
+    }
+    Granter->Revoked += Revoked;
+    ++Granter->PutBatches;
+
+    End = KeQueryPerformanceCounter(NULL);
+    Granter->Ticks += End.QuadPart - Start.QuadPart;
+    KeReleaseSpinLock(&Granter->Lock, Irql);
+}
 
-    GNTTAB(Put, Granter->GnttabInterface, Descriptor);
+VOID
+GranterPut(
+    IN  PXENVBD_GRANTER         Granter,
+    IN  PVOID                   Handle
+    )
+{
+    GranterPutMany(Granter, 1, &Handle);
 }
 
 ULONG
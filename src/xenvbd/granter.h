@@ -84,6 +84,12 @@ GranterDebugCallback(
     IN  PXENBUS_DEBUG_CALLBACK      Callback
     );
 
+extern VOID
+GranterReserve(
+    IN  PXENVBD_GRANTER             Granter,
+    IN  ULONG                       Count
+    );
+
 extern NTSTATUS
 GranterGet(
     IN  PXENVBD_GRANTER             Granter,
@@ -98,6 +104,22 @@ GranterPut(
     IN  PVOID                       Handle
     );
 
+extern NTSTATUS
+GranterGetMany(
+    IN  PXENVBD_GRANTER             Granter,
+    IN  ULONG                       Count,
+    IN  PPFN_NUMBER                 Pfn,
+    IN  BOOLEAN                     ReadOnly,
+    OUT PVOID                       *Handle
+    );
+
+extern VOID
+GranterPutMany(
+    IN  PXENVBD_GRANTER             Granter,
+    IN  ULONG                       Count,
+    IN  PVOID                       *Handle
+    );
+
 extern ULONG
 GranterReference(
     IN  PXENVBD_GRANTER             Granter,
@@ -58,18 +58,88 @@ typedef struct _XENVBD_SG_LIST {
     ULONG                       Index;
     ULONG                       Offset;
     ULONG                       Length;
+    // every element page aligned and page sized (bar the tail)
+    BOOLEAN                     Aligned;
 } XENVBD_SG_LIST, *PXENVBD_SG_LIST;
 
 #define PDO_SIGNATURE           'odpX'
 
-typedef struct _XENVBD_LOOKASIDE {
+// Integrity - one CRC32C per block, direct mapped on the block number
+typedef struct _XENVBD_CRC_ENTRY {
+    ULONG64                     Block;  // block number + 1, 0 when empty
+    ULONG                       Crc;
+} XENVBD_CRC_ENTRY, *PXENVBD_CRC_ENTRY;
+
+// Pool - pre-sized slab of Count objects, overflows to a lookaside list
+typedef struct _XENVBD_POOL {
+    SLIST_HEADER                Free;
+    PUCHAR                      Slab;
+    PMDL                        SlabMdl;
+    ULONG                       Count;
+    ULONG                       Size;
+    ULONG                       Tag;
     KEVENT                      Empty;
     LONG                        Used;
     LONG                        Max;
     ULONG                       Failed;
-    ULONG                       Size;
+    ULONG                       Overflow;
+    ULONG                       Deferred;
     NPAGED_LOOKASIDE_LIST       List;
-} XENVBD_LOOKASIDE, *PXENVBD_LOOKASIDE;
+    // Reserve - only used when both the slab and the lookaside list fail
+    SLIST_HEADER                Reserve;
+    PUCHAR                      ReserveSlab;
+    PMDL                        ReserveMdl;
+    ULONG                       ReserveCount;
+    ULONG                       Reserved;
+} XENVBD_POOL, *PXENVBD_POOL;
+
+#define SCHED_PRIORITIES        2
+#define SCHED_SIZE_CLASSES      4
+#define SCHED_QUANTUM           BLKIF_MAX_SEGMENTS_PER_REQUEST  // segments credited per visit
+#define SCHED_SLOT_SHARE        4   // one SRB holds at most 1/4 of the ring
+#define QOS_BURST_DIVISOR       10  // buckets hold 1/10th of a second at the limit
+#define QOS_MIN_DELAY           10000   // 1ms, in 100ns units
+#define QOS_TICKS_PER_SEC       1000000 // credit time base (us), independent of the QPC frequency
+
+#ifndef SRB_CLASS_FLAGS_PAGING
+#define SRB_CLASS_FLAGS_PAGING  0x40000000
+#endif
+
+// Stats - data path counters, one cache line per processor, summed when read
+typedef struct DECLSPEC_CACHEALIGN _XENVBD_PDO_STATS {
+    // SRB Counts by BLKIF_OP_
+    ULONG                       BlkOpRead;
+    ULONG                       BlkOpWrite;
+    ULONG                       BlkOpIndirectRead;
+    ULONG                       BlkOpIndirectWrite;
+    ULONG                       BlkOpBarrier;
+    ULONG                       BlkOpDiscard;
+    // Failures
+    ULONG                       FailedMaps;
+    ULONG                       FailedBounces;
+    ULONG                       FailedGrants;
+    ULONG                       ReserveBounces;
+    // Segments
+    ULONG64                     SegsGranted;
+    ULONG64                     SegsBounced;
+    // SG lists
+    ULONG                       SrbsAligned;
+    ULONG                       SrbsUnaligned;
+    // Zero detect - writes scanned, and those sent as BLKIF_OP_DISCARD
+    ULONG                       ZeroChecks;
+    ULONG                       ZeroWrites;
+    ULONG64                     ZeroBytesChecked;
+    ULONG64                     ZeroBytesElided;
+    LONGLONG                    ZeroTicks;
+    ULONG                       ZeroFallbacks;
+    // Service - completions, never reset, __PdoTuneQueueDepth works on the deltas
+    ULONG64                     SrbsServiced;
+    ULONG64                     ReqsServiced;
+    LONGLONG                    ServiceTicks;   // BuildIo to completion
+    // Integrity - bytes checksummed, and the time it took
+    ULONG64                     CrcBytes;
+    LONGLONG                    CrcTicks;
+} XENVBD_PDO_STATS, *PXENVBD_PDO_STATS;
 
 struct _XENVBD_PDO {
     ULONG                       Signature;
@@ -86,6 +156,12 @@ struct _XENVBD_PDO {
     PXENVBD_FRONTEND            Frontend;
     XENVBD_DEVICE_TYPE          DeviceType;
 
+    // Prepare - specialized for the backend, selected on connect
+    const struct _XENVBD_PREPARE*   Prepare;
+    ULONG                       IndirectSegments;
+    MM_PAGE_PRIORITY            Priority;
+    BOOLEAN                     ZeroFailed;     // a zero write discard failed, until reconnected
+
     // State
     BOOLEAN                     EmulatedUnplugged;
     LONG                        Paused;
@@ -97,29 +173,91 @@ struct _XENVBD_PDO {
     BOOLEAN                     Missing;
     const CHAR*                 Reason;
 
-    // SRBs
-    XENVBD_LOOKASIDE            SegmentList;
-    XENVBD_LOOKASIDE            MappingList;
-    XENVBD_LOOKASIDE            RequestList;
+    // SRBs - FreshSrbs is appended to by StartIo on any processor, PreparedReqs and
+    // the scheduler are worked by the ring's DPC, keep their locks on separate lines
+    XENVBD_POOL                 SegmentPool;
+    XENVBD_POOL                 IndirectPool;
+    XENVBD_POOL                 MappingPool;
+    XENVBD_POOL                 RequestPool;
+    DECLSPEC_CACHEALIGN
     XENVBD_QUEUE                FreshSrbs;
+    DECLSPEC_CACHEALIGN
     XENVBD_QUEUE                PreparedReqs;
-    XENVBD_QUEUE                SubmittedReqs;
     XENVBD_QUEUE                ShutdownSrbs;
-
-    // Stats - SRB Counts by BLKIF_OP_
-    ULONG                       BlkOpRead;
-    ULONG                       BlkOpWrite;
-    ULONG                       BlkOpIndirectRead;
-    ULONG                       BlkOpIndirectWrite;
-    ULONG                       BlkOpBarrier;
-    ULONG                       BlkOpDiscard;
-    // Stats - Failures
-    ULONG                       FailedMaps;
-    ULONG                       FailedBounces;
-    ULONG                       FailedGrants;
-    // Stats - Segments
-    ULONG64                     SegsGranted;
-    ULONG64                     SegsBounced;
+    BOOLEAN                     Reserved;
+
+    // Scheduler - SRBs with prepared requests, by priority
+    DECLSPEC_CACHEALIGN
+    KSPIN_LOCK                  SchedLock;
+    LIST_ENTRY                  SchedSrbs[SCHED_PRIORITIES];
+    ULONG                       SchedHeld;
+
+    // QoS - token buckets, credit is kept in units/sec * counter ticks
+    DECLSPEC_CACHEALIGN
+    KSPIN_LOCK                  QosLock;
+    ULONG                       QosIops;
+    ULONG64                     QosBytes;
+    LONGLONG                    QosIoCredit;
+    LONGLONG                    QosByteCredit;
+    LONGLONG                    QosLast;
+    KTIMER                      QosTimer;
+    KDPC                        QosDpc;
+
+    // Integrity - opt-in, CRC32C of completed writes checked against later reads
+    KSPIN_LOCK                  CrcLock;
+    PXENVBD_CRC_ENTRY           CrcMap;
+    ULONG                       CrcEntries;     // power of 2, 0 when off
+    // Stats - Integrity
+    ULONG64                     CrcStored;
+    ULONG64                     CrcVerified;
+    ULONG64                     CrcMissed;      // read blocks without an entry
+    ULONG                       CrcMismatches;
+
+    // Stats - per processor, see __PdoStats
+    PXENVBD_PDO_STATS           Stats;
+    ULONG                       StatsCount;
+    PVOID                       StatsBuffer;
+
+    // Queue Depth - applied with StorPortSetDeviceQueueDepth
+    ULONG                       QueueDepth;
+    LONG                        QueueDepthPending; // set by PdoSelectPrepare, see __PdoApplyQueueDepth
+    LONG                        Tuning;         // guards the fields below
+    ULONG                       QueueDepthRejected;
+    LONGLONG                    TuneStart;
+    ULONG                       RingFull;       // since TuneStart
+    ULONG64                     TuneSrbs;       // service stats at TuneStart
+    ULONG64                     TuneReqs;
+    LONGLONG                    TuneTicks;
+    // Stats - Queue Depth
+    ULONG                       TotalRingFull;
+    ULONG                       FreshWaits;
+    LONGLONG                    FreshTicks;
+    // Stats - Scheduler, queueing delay from BuildIo until the last request is on the ring
+    ULONG                       SchedCapped;
+    ULONG                       SchedSrbs[SCHED_SIZE_CLASSES];
+    LONGLONG                    SchedTicks[SCHED_SIZE_CLASSES];
+    LONGLONG                    SchedMaxTicks[SCHED_SIZE_CLASSES];
+    // Stats - QoS
+    ULONG                       QosDenied;
+    ULONG                       QosThrottled;
+    LONGLONG                    QosThrottleTicks;
+    ULONG                       QosMaxQueue;
+    // Stats - Connect, D3->D0 until the backend is connected
+    ULONG                       Connects;
+    LONGLONG                    ConnectTicks;   // last connect
+
+    // Resume - requests kept across a suspend/resume, in submission order
+    LONG                        Resuming;       // PdoPreResume until PdoPostResume
+    LONG                        Preparing;      // callers inside a prepare/submit section
+    LIST_ENTRY                  ResumeReqs;
+    LONGLONG                    ResumeStart;
+    ULONG                       ResumeSectorSize;
+    // Stats - Resume
+    ULONG                       Resumes;
+    ULONG                       ResumeReplayed; // re-granted and resubmitted
+    ULONG                       ResumeRebuilt;  // re-prepared from the SRB
+    LONGLONG                    ResumeTicks;    // last I/O blackout
+    LONGLONG                    ResumeMaxTicks;
 };
 
 //=============================================================================
@@ -127,9 +265,19 @@ struct _XENVBD_PDO {
 #define REQUEST_POOL_TAG        'qeRX'
 #define SEGMENT_POOL_TAG        'geSX'
 #define MAPPING_POOL_TAG        'paMX'
-#define SEGMENTS_PER_PAGE       (PAGE_SIZE / sizeof(XENVBD_SEGMENT))
-#define SEGMENT_LIST_SIZE       (SEGMENTS_PER_PAGE * sizeof(XENVBD_SEGMENT))
-#define MAPPING_LIST_SIZE       (SEGMENTS_PER_PAGE * sizeof(XENVBD_MAPPING))
+#define INDIRECT_POOL_TAG       'dnIX'
+#define SEGMENTS_PER_PAGE       (PAGE_SIZE / sizeof(struct blkif_request_segment))
+// an indirect page's grant handles, followed by the pages they grant (re-granted on resume)
+#define SEGMENT_LIST_SIZE       (SEGMENTS_PER_PAGE * (sizeof(PVOID) + sizeof(PFN_NUMBER)))
+#define SEGMENT_LIST_PFNS(_h)   ((PPFN_NUMBER)((PVOID*)(_h) + SEGMENTS_PER_PAGE))
+#define INDIRECT_POOL_REQUESTS  32
+#define GRANT_BATCH_SIZE        32
+#define QUEUE_DEPTH_MIN         4
+#define QUEUE_DEPTH_MAX         254     // StorPort's per-LUN limit
+#define QUEUE_DEPTH_INTERVAL_MS 1000
+#define RESUME_PAUSE_TIMEOUT_S  60
+#define CRC_BLOCK_SIZE          4096
+#define CRC_MAP_MAX_ENTRIES     (1 << 20)   // 16MiB, covering 4GiB of blocks
 
 __checkReturn
 __drv_allocatesMem(mem)
@@ -179,20 +327,111 @@ __PnpStateName(
 }
 
 static FORCEINLINE VOID
-__LookasideDebug(
-    IN  PXENVBD_LOOKASIDE           Lookaside,
+__PoolDebug(
+    IN  PXENVBD_POOL                Pool,
     IN  PXENBUS_DEBUG_INTERFACE     Debug,
     IN  PXENBUS_DEBUG_CALLBACK      Callback,
     IN  PCHAR                       Name
     )
 {
     DEBUG(Printf, Debug, Callback,
-          "PDO: %s: %u / %u (%u failed)\n",
-          Name, Lookaside->Used,
-          Lookaside->Max, Lookaside->Failed);
+          "PDO: %s: %u / %u of %u (%u overflow, %u failed, %u resizes deferred)\n",
+          Name, Pool->Used,
+          Pool->Max, Pool->Count,
+          Pool->Overflow, Pool->Failed, Pool->Deferred);
+    if (Pool->ReserveSlab) {
+        DEBUG(Printf, Debug, Callback,
+              "PDO: %s: Reserve %u (%u used)\n",
+              Name, Pool->ReserveCount, Pool->Reserved);
+    }
+
+    Pool->Max = Pool->Used;
+    Pool->Overflow = 0;
+    Pool->Failed = 0;
+    Pool->Reserved = 0;
+}
+
+static FORCEINLINE ULONG
+__PoolBytes(
+    IN  PXENVBD_POOL                Pool
+    )
+{
+    return (Pool->Count + Pool->ReserveCount) * Pool->Size;
+}
+
+// data path counters are updated at DISPATCH_LEVEL, so the slot cannot change under them
+// (the resume path re-grants at PASSIVE_LEVEL, a rare lost failure count is harmless)
+static FORCEINLINE PXENVBD_PDO_STATS
+__PdoStats(
+    __in PXENVBD_PDO             Pdo
+    )
+{
+    ULONG   Index = KeGetCurrentProcessorNumberEx(NULL);
+
+    // processors added after the PDO was created share the last slot
+    return &Pdo->Stats[__min(Index, Pdo->StatsCount - 1)];
+}
+
+static VOID
+__PdoStatsSum(
+    __in PXENVBD_PDO             Pdo,
+    __out PXENVBD_PDO_STATS      Total
+    )
+{
+    ULONG   Index;
+
+    RtlZeroMemory(Total, sizeof(XENVBD_PDO_STATS));
+    for (Index = 0; Index < Pdo->StatsCount; ++Index) {
+        PXENVBD_PDO_STATS   Stats = &Pdo->Stats[Index];
+
+        Total->BlkOpRead            += Stats->BlkOpRead;
+        Total->BlkOpWrite           += Stats->BlkOpWrite;
+        Total->BlkOpIndirectRead    += Stats->BlkOpIndirectRead;
+        Total->BlkOpIndirectWrite   += Stats->BlkOpIndirectWrite;
+        Total->BlkOpBarrier         += Stats->BlkOpBarrier;
+        Total->BlkOpDiscard         += Stats->BlkOpDiscard;
+        Total->FailedMaps           += Stats->FailedMaps;
+        Total->FailedBounces        += Stats->FailedBounces;
+        Total->FailedGrants         += Stats->FailedGrants;
+        Total->ReserveBounces       += Stats->ReserveBounces;
+        Total->SegsGranted          += Stats->SegsGranted;
+        Total->SegsBounced          += Stats->SegsBounced;
+        Total->SrbsAligned          += Stats->SrbsAligned;
+        Total->SrbsUnaligned        += Stats->SrbsUnaligned;
+        Total->ZeroChecks           += Stats->ZeroChecks;
+        Total->ZeroWrites           += Stats->ZeroWrites;
+        Total->ZeroBytesChecked     += Stats->ZeroBytesChecked;
+        Total->ZeroBytesElided      += Stats->ZeroBytesElided;
+        Total->ZeroTicks            += Stats->ZeroTicks;
+        Total->ZeroFallbacks        += Stats->ZeroFallbacks;
+        Total->CrcBytes             += Stats->CrcBytes;
+        Total->CrcTicks             += Stats->CrcTicks;
+        Total->SrbsServiced         += Stats->SrbsServiced;
+        Total->ReqsServiced         += Stats->ReqsServiced;
+        Total->ServiceTicks         += Stats->ServiceTicks;
+    }
+}
+
+// only the service counters, once per QUEUE_DEPTH_INTERVAL_MS
+static FORCEINLINE VOID
+__PdoServiceSum(
+    __in PXENVBD_PDO             Pdo,
+    __out PULONG64               Srbs,
+    __out PULONG64               Reqs,
+    __out PLONGLONG              Ticks
+    )
+{
+    ULONG   Index;
+
+    *Srbs = *Reqs = 0;
+    *Ticks = 0;
+    for (Index = 0; Index < Pdo->StatsCount; ++Index) {
+        PXENVBD_PDO_STATS   Stats = &Pdo->Stats[Index];
 
-    Lookaside->Max = Lookaside->Used;
-    Lookaside->Failed = 0;
+        *Srbs  += Stats->SrbsServiced;
+        *Reqs  += Stats->ReqsServiced;
+        *Ticks += Stats->ServiceTicks;
+    }
 }
 
 DECLSPEC_NOINLINE VOID
@@ -202,11 +441,15 @@ PdoDebugCallback(
     __in PXENBUS_DEBUG_CALLBACK  DebugCallback
     )
 {
+    XENVBD_PDO_STATS    Stats;
+
     if (Pdo == NULL || DebugInterface == NULL || DebugCallback == NULL)
         return;
     if (Pdo->Signature != PDO_SIGNATURE)
         return;
 
+    __PdoStatsSum(Pdo, &Stats);
+
     DEBUG(Printf, DebugInterface, DebugCallback,
           "PDO: Fdo 0x%p DeviceObject 0x%p\n",
           Pdo->Fdo,
@@ -228,35 +471,122 @@ PdoDebugCallback(
 
     DEBUG(Printf, DebugInterface, DebugCallback,
           "PDO: BLKIF_OPs: READ=%u WRITE=%u\n",
-          Pdo->BlkOpRead, Pdo->BlkOpWrite);
+          Stats.BlkOpRead, Stats.BlkOpWrite);
     DEBUG(Printf, DebugInterface, DebugCallback,
           "PDO: BLKIF_OPs: INDIRECT_READ=%u INDIRECT_WRITE=%u\n",
-          Pdo->BlkOpIndirectRead, Pdo->BlkOpIndirectWrite);
+          Stats.BlkOpIndirectRead, Stats.BlkOpIndirectWrite);
     DEBUG(Printf, DebugInterface, DebugCallback,
           "PDO: BLKIF_OPs: BARRIER=%u DISCARD=%u\n",
-          Pdo->BlkOpBarrier, Pdo->BlkOpDiscard);
+          Stats.BlkOpBarrier, Stats.BlkOpDiscard);
     DEBUG(Printf, DebugInterface, DebugCallback,
           "PDO: Failed: Maps=%u Bounces=%u Grants=%u\n",
-          Pdo->FailedMaps, Pdo->FailedBounces, Pdo->FailedGrants);
+          Stats.FailedMaps, Stats.FailedBounces, Stats.FailedGrants);
     DEBUG(Printf, DebugInterface, DebugCallback,
           "PDO: Segments Granted=%llu Bounced=%llu\n",
-          Pdo->SegsGranted, Pdo->SegsBounced);
+          Stats.SegsGranted, Stats.SegsBounced);
+    DEBUG(Printf, DebugInterface, DebugCallback,
+          "PDO: SG Lists Aligned=%u Unaligned=%u (%u%% fast path)\n",
+          Stats.SrbsAligned, Stats.SrbsUnaligned,
+          (Stats.SrbsAligned + Stats.SrbsUnaligned) ?
+                (Stats.SrbsAligned * 100) / (Stats.SrbsAligned + Stats.SrbsUnaligned) : 0);
+    {
+        static const CHAR*  SizeClassName[SCHED_SIZE_CLASSES] = { "<=4K", "<=64K", "<=512K", ">512K" };
+        LARGE_INTEGER       Frequency;
+        ULONG               Index;
+
+        (VOID) KeQueryPerformanceCounter(&Frequency);
+        DEBUG(Printf, DebugInterface, DebugCallback,
+              "PDO: Connects=%u (last %llu us)\n",
+              Pdo->Connects,
+              Frequency.QuadPart ? ((ULONG64)Pdo->ConnectTicks * 1000000ull) / Frequency.QuadPart : 0ull);
+        DEBUG(Printf, DebugInterface, DebugCallback,
+              "PDO: Resumes=%u Replayed=%u Rebuilt=%u Blackout=%llu us (max %llu us)\n",
+              Pdo->Resumes, Pdo->ResumeReplayed, Pdo->ResumeRebuilt,
+              Frequency.QuadPart ? ((ULONG64)Pdo->ResumeTicks * 1000000ull) / Frequency.QuadPart : 0ull,
+              Frequency.QuadPart ? ((ULONG64)Pdo->ResumeMaxTicks * 1000000ull) / Frequency.QuadPart : 0ull);
+        DEBUG(Printf, DebugInterface, DebugCallback,
+              "PDO: QueueDepth=%u RingFull=%u FreshWaits=%u (%llu us avg)\n",
+              Pdo->QueueDepth, Pdo->TotalRingFull, Pdo->FreshWaits,
+              (Pdo->FreshWaits && Frequency.QuadPart) ?
+                    ((ULONG64)Pdo->FreshTicks * 1000000ull) / (Frequency.QuadPart * Pdo->FreshWaits) : 0ull);
+        if (FrontendGetDiskInfo(Pdo->Frontend)->DiscardZeroes || Stats.ZeroChecks) {
+            // scan cost is normalised to the bytes offered to it, most non-zero writes stop early
+            DEBUG(Printf, DebugInterface, DebugCallback,
+                  "PDO: Zero Detect : %u / %u writes discarded, %llu bytes elided, %llu us/GiB, %u fallbacks\n",
+                  Stats.ZeroWrites, Stats.ZeroChecks, Stats.ZeroBytesElided,
+                  (Stats.ZeroBytesChecked && Frequency.QuadPart) ?
+                        ((((ULONG64)Stats.ZeroTicks * 1000000ull) / Frequency.QuadPart) << 30) /
+                        Stats.ZeroBytesChecked : 0ull,
+                  Stats.ZeroFallbacks);
+        }
+        if (Pdo->CrcEntries) {
+            DEBUG(Printf, DebugInterface, DebugCallback,
+                  "PDO: Integrity %u blocks : Stored=%llu Verified=%llu Missed=%llu MISMATCHED=%u\n",
+                  Pdo->CrcEntries, Pdo->CrcStored, Pdo->CrcVerified, Pdo->CrcMissed,
+                  Pdo->CrcMismatches);
+            DEBUG(Printf, DebugInterface, DebugCallback,
+                  "PDO: Integrity %llu bytes, %llu us/GiB\n",
+                  Stats.CrcBytes,
+                  (Stats.CrcBytes && Frequency.QuadPart) ?
+                        ((((ULONG64)Stats.CrcTicks * 1000000ull) / Frequency.QuadPart) << 30) /
+                        Stats.CrcBytes : 0ull);
+        }
+        DEBUG(Printf, DebugInterface, DebugCallback,
+              "PDO: Scheduler Held=%u Capped=%u\n",
+              Pdo->SchedHeld, Pdo->SchedCapped);
+        if (Pdo->QosIops || Pdo->QosBytes) {
+            DEBUG(Printf, DebugInterface, DebugCallback,
+                  "PDO: QoS %u IOPS %llu B/s : Denied=%u Throttled=%u (%llu us avg) MaxQueue=%u\n",
+                  Pdo->QosIops, Pdo->QosBytes,
+                  Pdo->QosDenied, Pdo->QosThrottled,
+                  (Pdo->QosThrottled && Frequency.QuadPart) ?
+                        ((ULONG64)Pdo->QosThrottleTicks * 1000000ull) / (Frequency.QuadPart * Pdo->QosThrottled) : 0ull,
+                  Pdo->QosMaxQueue);
+        }
+        for (Index = 0; Index < SCHED_SIZE_CLASSES; ++Index) {
+            if (Pdo->SchedSrbs[Index] == 0 || Frequency.QuadPart == 0)
+                continue;
+            DEBUG(Printf, DebugInterface, DebugCallback,
+                  "PDO: Scheduler %-6s : %u SRBs, %llu us avg / %llu us max queued\n",
+                  SizeClassName[Index], Pdo->SchedSrbs[Index],
+                  ((ULONG64)Pdo->SchedTicks[Index] * 1000000ull) / (Frequency.QuadPart * Pdo->SchedSrbs[Index]),
+                  ((ULONG64)Pdo->SchedMaxTicks[Index] * 1000000ull) / Frequency.QuadPart);
+        }
+    }
+    DEBUG(Printf, DebugInterface, DebugCallback,
+          "PDO: Reserve %s (Bounces=%u)\n",
+          Pdo->Reserved ? "HELD" : "NOT_HELD",
+          Stats.ReserveBounces);
 
-    __LookasideDebug(&Pdo->RequestList, DebugInterface, DebugCallback, "REQUESTs");
-    __LookasideDebug(&Pdo->SegmentList, DebugInterface, DebugCallback, "SEGMENTs");
-    __LookasideDebug(&Pdo->MappingList, DebugInterface, DebugCallback, "MAPPINGs");
+    DEBUG(Printf, DebugInterface, DebugCallback,
+          "PDO: Memory: %u bytes reserved (REQUEST=%u SEGMENTs=%u INDIRECT=%u MAPPING=%u bytes each)\n",
+          __PoolBytes(&Pdo->RequestPool) +
+          __PoolBytes(&Pdo->SegmentPool) +
+          __PoolBytes(&Pdo->IndirectPool) +
+          __PoolBytes(&Pdo->MappingPool),
+          Pdo->RequestPool.Size, Pdo->SegmentPool.Size,
+          Pdo->IndirectPool.Size, Pdo->MappingPool.Size);
+
+    __PoolDebug(&Pdo->RequestPool, DebugInterface, DebugCallback, "REQUESTs");
+    __PoolDebug(&Pdo->SegmentPool, DebugInterface, DebugCallback, "SEGMENTs");
+    __PoolDebug(&Pdo->IndirectPool, DebugInterface, DebugCallback, "INDIRECTs");
+    __PoolDebug(&Pdo->MappingPool, DebugInterface, DebugCallback, "MAPPINGs");
 
     FrontendDebugCallback(Pdo->Frontend, DebugInterface, DebugCallback);
     QueueDebugCallback(&Pdo->FreshSrbs,    "Fresh    ", DebugInterface, DebugCallback);
     QueueDebugCallback(&Pdo->PreparedReqs, "Prepared ", DebugInterface, DebugCallback);
-    QueueDebugCallback(&Pdo->SubmittedReqs, "Submitted", DebugInterface, DebugCallback);
     QueueDebugCallback(&Pdo->ShutdownSrbs, "Shutdown ", DebugInterface, DebugCallback);
 
-    Pdo->BlkOpRead = Pdo->BlkOpWrite = 0;
-    Pdo->BlkOpIndirectRead = Pdo->BlkOpIndirectWrite = 0;
-    Pdo->BlkOpBarrier = Pdo->BlkOpDiscard = 0;
-    Pdo->FailedMaps = Pdo->FailedBounces = Pdo->FailedGrants = 0;
-    Pdo->SegsGranted = Pdo->SegsBounced = 0;
+    RtlZeroMemory(Pdo->Stats, sizeof(XENVBD_PDO_STATS) * Pdo->StatsCount);
+    Pdo->TotalRingFull = Pdo->FreshWaits = 0;
+    Pdo->FreshTicks = 0;
+    Pdo->SchedCapped = 0;
+    Pdo->CrcStored = Pdo->CrcVerified = Pdo->CrcMissed = 0;
+    Pdo->QosDenied = Pdo->QosThrottled = Pdo->QosMaxQueue = 0;
+    Pdo->QosThrottleTicks = 0;
+    RtlZeroMemory(Pdo->SchedSrbs, sizeof(Pdo->SchedSrbs));
+    RtlZeroMemory(Pdo->SchedTicks, sizeof(Pdo->SchedTicks));
+    RtlZeroMemory(Pdo->SchedMaxTicks, sizeof(Pdo->SchedMaxTicks));
 }
 
 //=============================================================================
@@ -392,10 +722,10 @@ __PdoPauseDataPath(
     ++Pdo->Paused;
     KeReleaseSpinLock(&Pdo->Lock, Irql);
 
-    Verbose("Target[%d] : Waiting for %d Submitted requests\n", PdoGetTargetId(Pdo), QueueCount(&Pdo->SubmittedReqs));
+    Verbose("Target[%d] : Waiting for %d Submitted requests\n", PdoGetTargetId(Pdo), PdoOutstandingReqs(Pdo));
 
     Timeout.QuadPart = -10000000;
-    while (QueueCount(&Pdo->SubmittedReqs)) {
+    while (PdoOutstandingReqs(Pdo)) {
         NotifierSend(Notifier); // let backend know it needs to do some work
         KeDelayExecutionThread(KernelMode, FALSE, &Timeout);
     }
@@ -414,68 +744,533 @@ __PdoUnpauseDataPath(
 }
 
 static FORCEINLINE VOID
-__LookasideInit(
-    IN OUT  PXENVBD_LOOKASIDE   Lookaside,
+__PoolInit(
+    IN OUT  PXENVBD_POOL        Pool,
     IN  ULONG                   Size,
     IN  ULONG                   Tag
     )
 {
-    RtlZeroMemory(Lookaside, sizeof(XENVBD_LOOKASIDE));
-    Lookaside->Size = Size;
-    KeInitializeEvent(&Lookaside->Empty, SynchronizationEvent, TRUE);
-    ExInitializeNPagedLookasideList(&Lookaside->List, NULL, NULL, 0,
-                                    Size, Tag, 0);
+    RtlZeroMemory(Pool, sizeof(XENVBD_POOL));
+    // slab objects are linked through an SLIST_ENTRY while free
+    ASSERT3U(Size, >=, sizeof(SLIST_ENTRY));
+    Pool->Size = (ULONG)ROUND_TO_SIZE(Size, MEMORY_ALLOCATION_ALIGNMENT);
+    Pool->Tag = Tag;
+    InitializeSListHead(&Pool->Free);
+    InitializeSListHead(&Pool->Reserve);
+    KeInitializeEvent(&Pool->Empty, SynchronizationEvent, TRUE);
+    ExInitializeNPagedLookasideList(&Pool->List, NULL, NULL, 0,
+                                    Pool->Size, Tag, 0);
+}
+
+static PUCHAR
+__PoolAllocSlab(
+    IN  PXENVBD_POOL            Pool,
+    IN  ULONG                   Count,
+    OUT PMDL*                   Mdl
+    )
+{
+    PUCHAR  Slab;
+
+    // page sized objects are granted to the backend, so must be page aligned
+    if ((Pool->Size & (PAGE_SIZE - 1)) == 0)
+        Slab = __AllocPages((SIZE_T)Count * Pool->Size, Mdl);
+    else {
+        *Mdl = NULL;
+        Slab = __AllocateNonPagedPoolWithTag(__FUNCTION__, __LINE__,
+                                             (SIZE_T)Count * Pool->Size,
+                                             Pool->Tag);
+    }
+    if (Slab == NULL)
+        ++Pool->Failed;
+
+    return Slab;
+}
+
+static VOID
+__PoolFreeSlab(
+    IN  PXENVBD_POOL            Pool,
+    IN  PUCHAR                  Slab,
+    IN  PMDL                    Mdl
+    )
+{
+    if (Mdl)
+        __FreePages(Slab, Mdl);
+    else
+        __FreePoolWithTag(Slab, Pool->Tag);
+}
+
+static FORCEINLINE VOID
+__PoolRelease(
+    IN  PXENVBD_POOL            Pool
+    )
+{
+    ASSERT3U(Pool->Used, ==, 0);
+    InitializeSListHead(&Pool->Free);
+    if (Pool->Slab)
+        __PoolFreeSlab(Pool, Pool->Slab, Pool->SlabMdl);
+    Pool->Slab = NULL;
+    Pool->SlabMdl = NULL;
+    Pool->Count = 0;
+}
+
+static VOID
+__PoolResize(
+    IN  PXENVBD_POOL            Pool,
+    IN  ULONG                   Count
+    )
+{
+    PUCHAR  Slab;
+    PMDL    Mdl;
+    ULONG   Index;
+
+    if (Pool->Count == Count)
+        return;
+    // objects outstanding, keep the current slab and let the overflow cover the
+    // difference; every transition calls __PdoSizePools, so the next one retries
+    if (Pool->Used != 0) {
+        Warning("%08x tag : resize %u to %u deferred, %d objects in use\n",
+                Pool->Tag, Pool->Count, Count, Pool->Used);
+        ++Pool->Deferred;
+        return;
+    }
+
+    __PoolRelease(Pool);
+    if (Count == 0)
+        return;
+
+    Slab = __PoolAllocSlab(Pool, Count, &Mdl);
+    if (Slab == NULL)
+        return;
+
+    for (Index = 0; Index < Count; ++Index) {
+        InterlockedPushEntrySList(&Pool->Free, (PSLIST_ENTRY)(Slab + (SIZE_T)Index * Pool->Size));
+    }
+    Pool->Slab = Slab;
+    Pool->SlabMdl = Mdl;
+    Pool->Count = Count;
+}
+
+static VOID
+__PoolReserve(
+    IN  PXENVBD_POOL            Pool,
+    IN  ULONG                   Count,
+    IN  BOOLEAN                 Quiesced
+    )
+{
+    PUCHAR  Slab;
+    PMDL    Mdl;
+    ULONG   Index;
+
+    if (Pool->ReserveCount == Count)
+        return;
+    if (Pool->ReserveSlab) {
+        // __PoolAlloc/__PoolFree may be using the reserve slab unless the data
+        // path is paused and drained, try again on the next quiescent transition
+        if (!Quiesced || Pool->Used != 0)
+            return;
+
+        InitializeSListHead(&Pool->Reserve);
+        __PoolFreeSlab(Pool, Pool->ReserveSlab, Pool->ReserveMdl);
+        Pool->ReserveSlab = NULL;
+        Pool->ReserveMdl = NULL;
+        Pool->ReserveCount = 0;
+    }
+    if (Count == 0)
+        return;
+
+    Slab = __PoolAllocSlab(Pool, Count, &Mdl);
+    if (Slab == NULL)
+        return;
+
+    // publish the slab before any object on it can be allocated, so that a
+    // concurrent __PoolFree always recognises reserve objects
+    Pool->ReserveSlab = Slab;
+    Pool->ReserveMdl = Mdl;
+    Pool->ReserveCount = Count;
+    KeMemoryBarrier();
+
+    for (Index = 0; Index < Count; ++Index) {
+        InterlockedPushEntrySList(&Pool->Reserve, (PSLIST_ENTRY)(Slab + (SIZE_T)Index * Pool->Size));
+    }
 }
 
 static FORCEINLINE VOID
-__LookasideTerm(
-    IN  PXENVBD_LOOKASIDE       Lookaside
+__PoolTerm(
+    IN  PXENVBD_POOL            Pool
+    )
+{
+    ASSERT3U(Pool->Used, ==, 0);
+    __PoolReserve(Pool, 0, TRUE);
+    __PoolRelease(Pool);
+    ExDeleteNPagedLookasideList(&Pool->List);
+    RtlZeroMemory(Pool, sizeof(XENVBD_POOL));
+}
+
+static FORCEINLINE BOOLEAN
+__PoolOwns(
+    IN  PXENVBD_POOL            Pool,
+    IN  PUCHAR                  Slab,
+    IN  ULONG                   Count,
+    IN  PVOID                   Buffer
     )
 {
-    ASSERT3U(Lookaside->Used, ==, 0);
-    ExDeleteNPagedLookasideList(&Lookaside->List);
-    RtlZeroMemory(Lookaside, sizeof(XENVBD_LOOKASIDE));
+    return (PUCHAR)Buffer >= Slab &&
+           (PUCHAR)Buffer < Slab + (SIZE_T)Count * Pool->Size;
 }
 
 static FORCEINLINE PVOID
-__LookasideAlloc(
-    IN  PXENVBD_LOOKASIDE       Lookaside
+__PoolAlloc(
+    IN  PXENVBD_POOL            Pool
     )
 {
     LONG    Result;
     PVOID   Buffer;
 
-    Buffer = ExAllocateFromNPagedLookasideList(&Lookaside->List);
+    Buffer = InterlockedPopEntrySList(&Pool->Free);
+    if (Buffer == NULL) {
+        // pool exhausted, overflow to the lookaside list
+        ++Pool->Overflow;
+        Buffer = ExAllocateFromNPagedLookasideList(&Pool->List);
+    }
     if (Buffer == NULL) {
-        ++Lookaside->Failed;
-        return NULL;
+        // last resort, Paging/Hibernation/DumpFile targets only
+        Buffer = InterlockedPopEntrySList(&Pool->Reserve);
+        if (Buffer == NULL) {
+            ++Pool->Failed;
+            return NULL;
+        }
+        ++Pool->Reserved;
     }
 
-    RtlZeroMemory(Buffer, Lookaside->Size);
-    Result = InterlockedIncrement(&Lookaside->Used);
+    RtlZeroMemory(Buffer, Pool->Size);
+    Result = InterlockedIncrement(&Pool->Used);
     ASSERT3S(Result, >, 0);
-    if (Result > Lookaside->Max)
-        Lookaside->Max = Result;
-    KeClearEvent(&Lookaside->Empty);
+    if (Result > Pool->Max)
+        Pool->Max = Result;
+    KeClearEvent(&Pool->Empty);
 
     return Buffer;
 }
 
 static FORCEINLINE VOID
-__LookasideFree(
-    IN  PXENVBD_LOOKASIDE       Lookaside,
+__PoolFree(
+    IN  PXENVBD_POOL            Pool,
     IN  PVOID                   Buffer
     )
 {
     LONG            Result;
 
-    ExFreeToNPagedLookasideList(&Lookaside->List, Buffer);
-    Result = InterlockedDecrement(&Lookaside->Used);
+    if (__PoolOwns(Pool, Pool->Slab, Pool->Count, Buffer))
+        InterlockedPushEntrySList(&Pool->Free, Buffer);
+    else if (__PoolOwns(Pool, Pool->ReserveSlab, Pool->ReserveCount, Buffer))
+        InterlockedPushEntrySList(&Pool->Reserve, Buffer);
+    else
+        ExFreeToNPagedLookasideList(&Pool->List, Buffer);
+    Result = InterlockedDecrement(&Pool->Used);
     ASSERT3S(Result, >=, 0);
         
     if (Result == 0) {
-        KeSetEvent(&Lookaside->Empty, IO_NO_INCREMENT, FALSE);
+        KeSetEvent(&Pool->Empty, IO_NO_INCREMENT, FALSE);
+    }
+}
+
+static VOID
+__PdoSizePools(
+    IN  PXENVBD_PDO             Pdo
+    )
+{
+    const ULONG Depth = BlockRingSize(FrontendGetBlockRing(Pdo->Frontend));
+    const ULONG Indirect = FrontendGetFeatures(Pdo->Frontend)->Indirect;
+    ULONG       Pages = 0;
+
+    // an SRB never needs more segments than XENVBD_MAX_SEGMENTS_PER_SRB
+    if (Indirect) {
+        Pages = (__min(Indirect, XENVBD_MAX_SEGMENTS_PER_SRB) + SEGMENTS_PER_PAGE - 1) / SEGMENTS_PER_PAGE;
+        Pages = __min(Pages, BLKIF_MAX_INDIRECT_PAGES_PER_REQUEST);
+    }
+
+    // one request and one bounced segment per ring slot guarantees forward progress
+    __PoolResize(&Pdo->RequestPool, Depth);
+    __PoolResize(&Pdo->MappingPool, Depth);
+    __PoolResize(&Pdo->SegmentPool, __min(Depth, INDIRECT_POOL_REQUESTS) * Pages);
+    __PoolResize(&Pdo->IndirectPool, __min(Depth, INDIRECT_POOL_REQUESTS) * Pages);
+
+    Verbose("Target[%d] : Pools sized for %u requests, %u indirect pages\n",
+                PdoGetTargetId(Pdo), Pdo->RequestPool.Count, Pdo->IndirectPool.Count);
+}
+
+// Quiesced is FALSE while I/O may be live: a reserve can then be added but is
+// only changed or released at the next transition that drains the data path
+static VOID
+__PdoReserve(
+    IN  PXENVBD_PDO             Pdo,
+    IN  BOOLEAN                 Quiesced
+    )
+{
+    PXENVBD_CAPS    Caps = FrontendGetCaps(Pdo->Frontend);
+    BOOLEAN         Reserve;
+
+    // keep forward progress resources aside for disks the system cannot do without
+    Reserve = Caps->Connected &&
+              (Caps->Paging || Caps->Hibernation || Caps->DumpFile);
+
+    __PoolReserve(&Pdo->RequestPool, Reserve ? XENVBD_RESERVE_REQUESTS : 0, Quiesced);
+    __PoolReserve(&Pdo->MappingPool, Reserve ? XENVBD_RESERVE_SEGMENTS : 0, Quiesced);
+    __PoolReserve(&Pdo->SegmentPool, Reserve ? XENVBD_RESERVE_INDIRECT_PAGES : 0, Quiesced);
+    __PoolReserve(&Pdo->IndirectPool, Reserve ? XENVBD_RESERVE_INDIRECT_PAGES : 0, Quiesced);
+    if (Caps->Connected)
+        GranterReserve(FrontendGetGranter(Pdo->Frontend),
+                       Reserve ? XENVBD_RESERVE_GRANT_REFS : 0);
+
+    if (Pdo->Reserved != Reserve) {
+        if (Reserve)
+            BufferReserve(XENVBD_RESERVE_SEGMENTS);
+        else
+            BufferUnreserve(XENVBD_RESERVE_SEGMENTS);
+        Pdo->Reserved = Reserve;
+
+        Verbose("Target[%d] : Reserve %s\n", PdoGetTargetId(Pdo),
+                    Reserve ? "HELD" : "RELEASED");
+    }
+}
+
+//=============================================================================
+// QoS - optional IOPS and bandwidth token buckets, over-limit SRBs wait on
+// FreshSrbs until the QoS timer releases them
+static FORCEINLINE LONGLONG
+__PdoQosCap(
+    __in LONGLONG                Credit,
+    __in LONGLONG                Limit
+    )
+{
+    return (Credit < Limit) ? Credit : Limit;
+}
+
+// credits are counted in QOS_TICKS_PER_SEC units: with QosBytes capped at
+// XENVBD_QOS_MAX_BYTES_PER_SEC no product below can reach 2^63
+static FORCEINLINE VOID
+__PdoQosRefill(
+    __in PXENVBD_PDO             Pdo,
+    __in LONGLONG                Now,
+    __in LONGLONG                Frequency
+    )
+{
+    LONGLONG    Elapsed = Now - Pdo->QosLast;
+    LONGLONG    Ticks;
+    LONGLONG    Limit;
+
+    if (Elapsed <= 0)
+        return;
+    if (Elapsed > Frequency) {
+        Pdo->QosLast = Now - Frequency; // buckets are full long before this
+        Elapsed = Frequency;
+    }
+
+    // whole ticks only, the remainder is credited on the next refill
+    Ticks = (Elapsed * QOS_TICKS_PER_SEC) / Frequency;
+    if (Ticks == 0)
+        return;
+    Pdo->QosLast += (Ticks * Frequency) / QOS_TICKS_PER_SEC;
+
+    if (Pdo->QosIops) {
+        Limit = ((LONGLONG)QOS_TICKS_PER_SEC * Pdo->QosIops) / QOS_BURST_DIVISOR;
+        if (Limit < QOS_TICKS_PER_SEC)
+            Limit = QOS_TICKS_PER_SEC; // always room for 1 SRB
+        Pdo->QosIoCredit = __PdoQosCap(Pdo->QosIoCredit + Ticks * Pdo->QosIops, Limit);
+    }
+    if (Pdo->QosBytes) {
+        Limit = ((LONGLONG)QOS_TICKS_PER_SEC * (LONGLONG)Pdo->QosBytes) / QOS_BURST_DIVISOR;
+        if (Limit < (LONGLONG)QOS_TICKS_PER_SEC * XENVBD_MAX_TRANSFER_LENGTH)
+            Limit = (LONGLONG)QOS_TICKS_PER_SEC * XENVBD_MAX_TRANSFER_LENGTH; // always room for a maximal SRB
+        Pdo->QosByteCredit = __PdoQosCap(Pdo->QosByteCredit + Ticks * (LONGLONG)Pdo->QosBytes, Limit);
+    }
+}
+
+static BOOLEAN
+__PdoQosAdmit(
+    __in PXENVBD_PDO             Pdo,
+    __in PSCSI_REQUEST_BLOCK     Srb
+    )
+{
+    PXENVBD_SRBEXT  SrbExt = GetSrbExt(Srb);
+    LARGE_INTEGER   Frequency;
+    LARGE_INTEGER   Now;
+    LONGLONG        Cost;
+    LONGLONG        Wait = 0;
+    BOOLEAN         Admit = TRUE;
+    KIRQL           Irql;
+
+    if (Pdo->QosIops == 0 && Pdo->QosBytes == 0)
+        return TRUE;
+
+    // SYNCHRONIZE_CACHE and UNMAP move no payload, they are only charged an IO
+    Now = KeQueryPerformanceCounter(&Frequency);
+    Cost = 0;
+    switch (Cdb_OperationEx(Srb)) {
+    case SCSIOP_READ:
+    case SCSIOP_WRITE:
+        Cost = (LONGLONG)Srb->DataTransferLength * QOS_TICKS_PER_SEC;
+        break;
+    default:
+        break;
+    }
+
+    KeAcquireSpinLock(&Pdo->QosLock, &Irql);
+    __PdoQosRefill(Pdo, Now.QuadPart, Frequency.QuadPart);
+
+    // Wait is how long, in credit ticks, until the emptiest bucket has enough
+    if (Pdo->QosIops && Pdo->QosIoCredit < QOS_TICKS_PER_SEC) {
+        Admit = FALSE;
+        Wait = (QOS_TICKS_PER_SEC - Pdo->QosIoCredit) / Pdo->QosIops;
+    }
+    if (Pdo->QosBytes && Pdo->QosByteCredit < Cost) {
+        LONGLONG    ByteWait = (Cost - Pdo->QosByteCredit) / (LONGLONG)Pdo->QosBytes;
+
+        Admit = FALSE;
+        if (ByteWait > Wait)
+            Wait = ByteWait;
+    }
+
+    if (Admit) {
+        if (Pdo->QosIops)
+            Pdo->QosIoCredit -= QOS_TICKS_PER_SEC;
+        if (Pdo->QosBytes)
+            Pdo->QosByteCredit -= Cost;
+    } else {
+        LARGE_INTEGER   Due;
+
+        Due.QuadPart = (Wait * 10000000ll) / QOS_TICKS_PER_SEC;
+        if (Due.QuadPart < QOS_MIN_DELAY)
+            Due.QuadPart = QOS_MIN_DELAY;
+        Due.QuadPart = -Due.QuadPart;
+        (VOID) KeSetTimer(&Pdo->QosTimer, Due, &Pdo->QosDpc);
+        ++Pdo->QosDenied;
+    }
+    KeReleaseSpinLock(&Pdo->QosLock, Irql);
+
+    if (!Admit) {
+        ULONG   Queued = QueueCount(&Pdo->FreshSrbs) + 1;
+
+        if (Queued > Pdo->QosMaxQueue)
+            Pdo->QosMaxQueue = Queued;
+        SrbExt->Throttled = TRUE;
+    } else if (SrbExt->Throttled) {
+        SrbExt->Throttled = FALSE;
+        ++Pdo->QosThrottled;
+        Pdo->QosThrottleTicks += Now.QuadPart - SrbExt->Start;
+    }
+    return Admit;
+}
+
+// keep order behind throttled SRBs, the QoS timer releases them
+static FORCEINLINE BOOLEAN
+__PdoQosHold(
+    __in PXENVBD_PDO             Pdo,
+    __in PSCSI_REQUEST_BLOCK     Srb
+    )
+{
+    PXENVBD_SRBEXT  SrbExt = GetSrbExt(Srb);
+
+    if (Pdo->QosIops == 0 && Pdo->QosBytes == 0)
+        return FALSE;
+
+    if (QueueCount(&Pdo->FreshSrbs)) {
+        QueueAppend(&Pdo->FreshSrbs, &SrbExt->Entry);
+        (VOID) KeInsertQueueDpc(&Pdo->QosDpc, NULL, NULL);
+        return TRUE;
+    }
+    if (!__PdoQosAdmit(Pdo, Srb)) {
+        QueueAppend(&Pdo->FreshSrbs, &SrbExt->Entry);
+        return TRUE;
     }
+    return FALSE;
+}
+
+KDEFERRED_ROUTINE PdoQosDpc;
+
+VOID
+PdoQosDpc(
+    __in  PKDPC                     Dpc,
+    __in_opt PVOID                  Context,
+    __in_opt PVOID                  Arg1,
+    __in_opt PVOID                  Arg2
+    )
+{
+    PXENVBD_PDO     Pdo = Context;
+
+    UNREFERENCED_PARAMETER(Dpc);
+    UNREFERENCED_PARAMETER(Arg1);
+    UNREFERENCED_PARAMETER(Arg2);
+
+    ASSERT(Pdo);
+    if (PdoIsPaused(Pdo))
+        return;
+
+    PdoPrepareFresh(Pdo);
+    PdoSubmitPrepared(Pdo);
+}
+
+VOID
+PdoSetQos(
+    __in PXENVBD_PDO             Pdo,
+    __in ULONG                   Iops,
+    __in ULONG64                 BytesPerSec
+    )
+{
+    KIRQL       Irql;
+
+    if (Pdo->QosIops == Iops && Pdo->QosBytes == BytesPerSec)
+        return;
+
+    KeAcquireSpinLock(&Pdo->QosLock, &Irql);
+    Pdo->QosIops = Iops;
+    Pdo->QosBytes = BytesPerSec;
+    Pdo->QosIoCredit = Pdo->QosByteCredit = 0;
+    Pdo->QosLast = KeQueryPerformanceCounter(NULL).QuadPart;
+    KeReleaseSpinLock(&Pdo->QosLock, Irql);
+
+    Verbose("Target[%d] : QoS %u IOPS %llu B/s\n", PdoGetTargetId(Pdo), Iops, BytesPerSec);
+
+    // re-evaluate anything held back under the old limits
+    (VOID) KeInsertQueueDpc(&Pdo->QosDpc, NULL, NULL);
+}
+
+VOID
+PdoSetIntegrity(
+    __in PXENVBD_PDO             Pdo,
+    __in ULONG                   Entries
+    )
+{
+    PXENVBD_CRC_ENTRY   Map = NULL;
+    PXENVBD_CRC_ENTRY   Old;
+    KIRQL               Irql;
+
+    // a power of 2, so the block number masks to an entry
+    Entries = __min(Entries, CRC_MAP_MAX_ENTRIES);
+    while (Entries & (Entries - 1))
+        Entries &= Entries - 1;
+
+    if (Entries == Pdo->CrcEntries)
+        return; // entries survive a reconnect, the disk has not changed
+
+    if (Entries) {
+        Map = __PdoAlloc(sizeof(XENVBD_CRC_ENTRY) * Entries);
+        if (Map == NULL) {
+            Warning("Target[%d] : Integrity map of %u entries failed\n",
+                    PdoGetTargetId(Pdo), Entries);
+            Entries = 0;
+        }
+    }
+
+    KeAcquireSpinLock(&Pdo->CrcLock, &Irql);
+    Old = Pdo->CrcMap;
+    Pdo->CrcMap = Map;
+    Pdo->CrcEntries = Entries;
+    KeReleaseSpinLock(&Pdo->CrcLock, Irql);
+
+    __PdoFree(Old);
+
+    Verbose("Target[%d] : Integrity %u blocks\n", PdoGetTargetId(Pdo), Entries);
 }
 
 //=============================================================================
@@ -487,7 +1282,6 @@ PdoCreate(
     __in __nullterminated PCHAR  DeviceId,
     __in ULONG                   TargetId,
     __in BOOLEAN                 EmulatedUnplugged,
-    __in PKEVENT                 FrontendEvent,
     __in XENVBD_DEVICE_TYPE      DeviceType
     )
 {
@@ -513,43 +1307,68 @@ PdoCreate(
     Pdo->DevicePowerState = PowerDeviceD3;
     Pdo->EmulatedUnplugged = EmulatedUnplugged;
     Pdo->DeviceType     = DeviceType;
+    Pdo->Priority       = NormalPagePriority;
 
     KeInitializeSpinLock(&Pdo->Lock);
     QueueInit(&Pdo->FreshSrbs);
     QueueInit(&Pdo->PreparedReqs);
-    QueueInit(&Pdo->SubmittedReqs);
     QueueInit(&Pdo->ShutdownSrbs);
+    KeInitializeSpinLock(&Pdo->SchedLock);
+    InitializeListHead(&Pdo->SchedSrbs[0]);
+    InitializeListHead(&Pdo->SchedSrbs[1]);
+    InitializeListHead(&Pdo->ResumeReqs);
+    KeInitializeSpinLock(&Pdo->QosLock);
+    KeInitializeTimer(&Pdo->QosTimer);
+    KeInitializeDpc(&Pdo->QosDpc, PdoQosDpc, Pdo);
+    KeInitializeSpinLock(&Pdo->CrcLock);
+
+    Pdo->StatsCount = KeQueryMaximumProcessorCountEx(ALL_PROCESSOR_GROUPS);
+    Pdo->StatsBuffer = __PdoAlloc(sizeof(XENVBD_PDO_STATS) * Pdo->StatsCount +
+                                  SYSTEM_CACHE_ALIGNMENT_SIZE);
+    if (Pdo->StatsBuffer == NULL)
+        goto fail2;
+    Pdo->Stats = ALIGN_UP_POINTER_BY(Pdo->StatsBuffer, SYSTEM_CACHE_ALIGNMENT_SIZE);
 
-    Status = FrontendCreate(Pdo, DeviceId, TargetId, FrontendEvent, &Pdo->Frontend);
+    Status = FrontendCreate(Pdo, DeviceId, TargetId, &Pdo->Frontend);
     if (!NT_SUCCESS(Status))
-        goto fail2;
+        goto fail3;
+    PdoSelectPrepare(Pdo); // defaults, until the backend connects
 
-    __LookasideInit(&Pdo->RequestList, sizeof(XENVBD_REQUEST), REQUEST_POOL_TAG);
-    __LookasideInit(&Pdo->SegmentList, SEGMENT_LIST_SIZE, SEGMENT_POOL_TAG);
-    __LookasideInit(&Pdo->MappingList, MAPPING_LIST_SIZE, MAPPING_POOL_TAG);
+    __PoolInit(&Pdo->RequestPool, sizeof(XENVBD_REQUEST), REQUEST_POOL_TAG);
+    __PoolInit(&Pdo->SegmentPool, SEGMENT_LIST_SIZE, SEGMENT_POOL_TAG);
+    __PoolInit(&Pdo->IndirectPool, PAGE_SIZE, INDIRECT_POOL_TAG);
+    __PoolInit(&Pdo->MappingPool, sizeof(XENVBD_MAPPING), MAPPING_POOL_TAG);
 
     Status = PdoD3ToD0(Pdo);
     if (!NT_SUCCESS(Status))
-        goto fail3;
+        goto fail4;
 
     if (!FdoLinkPdo(Fdo, Pdo))
-        goto fail4;
+        goto fail5;
 
     Verbose("Target[%d] : Created (%s)\n", TargetId, EmulatedUnplugged ? "PV" : "Emulated");
     Trace("Target[%d] @ (%d) <=====\n", TargetId, KeGetCurrentIrql());
     return STATUS_SUCCESS;
 
+fail5:
+    Error("Fail5\n");
+    PdoD0ToD3(Pdo);
+
 fail4:
     Error("Fail4\n");
-    PdoD0ToD3(Pdo);
+    // FrontendConnect may have queued the QoS DPC
+    (VOID) KeCancelTimer(&Pdo->QosTimer);
+    KeFlushQueuedDpcs();
+    __PoolTerm(&Pdo->MappingPool);
+    __PoolTerm(&Pdo->IndirectPool);
+    __PoolTerm(&Pdo->SegmentPool);
+    __PoolTerm(&Pdo->RequestPool);
+    FrontendDestroy(Pdo->Frontend);
+    Pdo->Frontend = NULL;
 
 fail3:
     Error("Fail3\n");
-    __LookasideTerm(&Pdo->MappingList);
-    __LookasideTerm(&Pdo->SegmentList);
-    __LookasideTerm(&Pdo->RequestList);
-    FrontendDestroy(Pdo->Frontend);
-    Pdo->Frontend = NULL;
+    __PdoFree(Pdo->StatsBuffer);
 
 fail2:
     Error("Fail2\n");
@@ -566,7 +1385,7 @@ PdoDestroy(
     )
 {
     const ULONG TargetId = PdoGetTargetId(Pdo);
-    PVOID       Objects[4];
+    PVOID       Objects[5];
 
     Trace("Target[%d] @ (%d) =====>\n", TargetId, KeGetCurrentIrql());
     Verbose("Target[%d] : Destroying\n", TargetId);
@@ -579,23 +1398,36 @@ PdoDestroy(
     PdoD0ToD3(Pdo);
     PdoDereference(Pdo); // drop initial ref count
 
-    // Wait for ReferenceCount == 0 and RequestListUsed == 0
-    Verbose("Target[%d] : ReferenceCount %d, RequestListUsed %d\n", TargetId, Pdo->ReferenceCount, Pdo->RequestList.Used);
+    // Wait for ReferenceCount == 0 and RequestPoolUsed == 0
+    Verbose("Target[%d] : ReferenceCount %d, RequestPoolUsed %d\n", TargetId, Pdo->ReferenceCount, Pdo->RequestPool.Used);
     Objects[0] = &Pdo->RemoveEvent;
-    Objects[1] = &Pdo->RequestList.Empty;
-    Objects[2] = &Pdo->SegmentList.Empty;
-    Objects[3] = &Pdo->MappingList.Empty;
-    KeWaitForMultipleObjects(4, Objects, WaitAll, Executive, KernelMode, FALSE, NULL, NULL);
+    Objects[1] = &Pdo->RequestPool.Empty;
+    Objects[2] = &Pdo->SegmentPool.Empty;
+    Objects[3] = &Pdo->IndirectPool.Empty;
+    Objects[4] = &Pdo->MappingPool.Empty;
+    KeWaitForMultipleObjects(5, Objects, WaitAll, Executive, KernelMode, FALSE, NULL, NULL);
     ASSERT3S(Pdo->ReferenceCount, ==, 0);
+
+    (VOID) KeCancelTimer(&Pdo->QosTimer);
+    KeFlushQueuedDpcs();
     ASSERT3U(PdoGetDevicePnpState(Pdo), ==, Deleted);
 
-    __LookasideTerm(&Pdo->MappingList);
-    __LookasideTerm(&Pdo->SegmentList);
-    __LookasideTerm(&Pdo->RequestList);
+    __PoolTerm(&Pdo->MappingPool);
+    __PoolTerm(&Pdo->IndirectPool);
+    __PoolTerm(&Pdo->SegmentPool);
+    __PoolTerm(&Pdo->RequestPool);
 
     FrontendDestroy(Pdo->Frontend);
     Pdo->Frontend = NULL;
 
+    __PdoFree(Pdo->StatsBuffer);
+    Pdo->StatsBuffer = NULL;
+    Pdo->Stats = NULL;
+
+    __PdoFree(Pdo->CrcMap);
+    Pdo->CrcMap = NULL;
+    Pdo->CrcEntries = 0;
+
     ASSERT3U(Pdo->Signature, ==, PDO_SIGNATURE);
     RtlZeroMemory(Pdo, sizeof(XENVBD_PDO));
     __PdoFree(Pdo);
@@ -612,6 +1444,8 @@ PdoD3ToD0(
 {
     NTSTATUS    Status;
     const ULONG TargetId = PdoGetTargetId(Pdo);
+    LARGE_INTEGER   Start;
+    LARGE_INTEGER   End;
 
     if (!PdoSetDevicePowerState(Pdo, PowerDeviceD0))
         return STATUS_SUCCESS;
@@ -619,6 +1453,8 @@ PdoD3ToD0(
     Trace("Target[%d] @ (%d) =====>\n", TargetId, KeGetCurrentIrql());
     Verbose("Target[%d] : D3->D0 (%s)\n", TargetId, Pdo->EmulatedUnplugged ? "PV" : "Emulated");
 
+    Start = KeQueryPerformanceCounter(NULL);
+
     // power up frontend
     Status = FrontendD3ToD0(Pdo->Frontend);
     if (!NT_SUCCESS(Status))
@@ -629,9 +1465,15 @@ PdoD3ToD0(
         Status = FrontendSetState(Pdo->Frontend, XENVBD_ENABLED);
         if (!NT_SUCCESS(Status))
             goto fail2;
+        __PdoSizePools(Pdo);
+        __PdoReserve(Pdo, TRUE);
         __PdoUnpauseDataPath(Pdo);
     }
 
+    End = KeQueryPerformanceCounter(NULL);
+    Pdo->ConnectTicks = End.QuadPart - Start.QuadPart;
+    ++Pdo->Connects;
+
     Trace("Target[%d] @ (%d) <=====\n", TargetId, KeGetCurrentIrql());
     return STATUS_SUCCESS;
 
@@ -663,9 +1505,12 @@ PdoD0ToD3(
     // close frontend
     if (Pdo->EmulatedUnplugged) {
         __PdoPauseDataPath(Pdo);
+        (VOID) KeCancelTimer(&Pdo->QosTimer);
         (VOID) FrontendSetState(Pdo->Frontend, XENVBD_CLOSED);
         PdoAbortAllSrbs(Pdo);
-        ASSERT3U(QueueCount(&Pdo->SubmittedReqs), ==, 0);
+        ASSERT3U(PdoOutstandingReqs(Pdo), ==, 0);
+        __PdoSizePools(Pdo); // ring disconnected, releases the slabs
+        __PdoReserve(Pdo, TRUE);
     }
 
     // power down frontend
@@ -674,15 +1519,6 @@ PdoD0ToD3(
     Trace("Target[%d] @ (%d) <=====\n", TargetId, KeGetCurrentIrql());
 }
 
-__drv_requiresIRQL(DISPATCH_LEVEL)
-VOID
-PdoBackendPathChanged(
-    __in PXENVBD_PDO             Pdo
-    )
-{
-    FrontendBackendPathChanged(Pdo->Frontend);
-}
-
 //=============================================================================
 // Reference Counting
 FORCEINLINE LONG
@@ -775,13 +1611,22 @@ PdoIsPaused(
     return Paused;
 }
 
-__checkReturn
-FORCEINLINE ULONG
+// the old ring and grants are stale until the resume thread has reconnected
+static FORCEINLINE BOOLEAN
+__PdoIsResuming(
+    __in PXENVBD_PDO             Pdo
+    )
+{
+    return (InterlockedCompareExchange(&Pdo->Resuming, 0, 0) != 0) ? TRUE : FALSE;
+}
+
+__checkReturn
+FORCEINLINE ULONG
 PdoOutstandingReqs(
     __in PXENVBD_PDO             Pdo
     )
 {
-    return QueueCount(&Pdo->SubmittedReqs);
+    return BlockRingOutstanding(FrontendGetBlockRing(Pdo->Frontend));
 }
 
 __checkReturn
@@ -810,14 +1655,14 @@ __PdoIncBlkifOpCount(
     )
 {
     switch (Request->Operation) {
-    case BLKIF_OP_READ:             ++Pdo->BlkOpRead;       break;
-    case BLKIF_OP_WRITE:            ++Pdo->BlkOpWrite;      break;
-    case BLKIF_OP_WRITE_BARRIER:    ++Pdo->BlkOpBarrier;    break;
-    case BLKIF_OP_DISCARD:          ++Pdo->BlkOpDiscard;    break;
+    case BLKIF_OP_READ:             ++__PdoStats(Pdo)->BlkOpRead;       break;
+    case BLKIF_OP_WRITE:            ++__PdoStats(Pdo)->BlkOpWrite;      break;
+    case BLKIF_OP_WRITE_BARRIER:    ++__PdoStats(Pdo)->BlkOpBarrier;    break;
+    case BLKIF_OP_DISCARD:          ++__PdoStats(Pdo)->BlkOpDiscard;    break;
     case BLKIF_OP_INDIRECT:
         switch (Request->u.Indirect.Operation) {
-        case BLKIF_OP_READ:         ++Pdo->BlkOpIndirectRead;   break;
-        case BLKIF_OP_WRITE:        ++Pdo->BlkOpIndirectWrite;  break;
+        case BLKIF_OP_READ:         ++__PdoStats(Pdo)->BlkOpIndirectRead;   break;
+        case BLKIF_OP_WRITE:        ++__PdoStats(Pdo)->BlkOpIndirectWrite;  break;
         default:                    ASSERT(FALSE);              break;
         }
         break;
@@ -920,6 +1765,51 @@ SGListGet(
     }
 }
 
+static FORCEINLINE BOOLEAN
+SGListScan(
+    IN OUT  PXENVBD_SG_LIST         SGList,
+    IN  ULONG                       SectorSize
+    )
+{
+    const ULONG Count = SGList->SGList->NumberOfElements;
+    ULONG       Index;
+
+    // only the last element may end part way through a page
+    SGList->Aligned = FALSE;
+    for (Index = 0; Index < Count; ++Index) {
+        PSTOR_SCATTER_GATHER_ELEMENT    SGElement = &SGList->SGList->List[Index];
+        const ULONG                     Mask = (Index + 1 == Count) ? SectorSize - 1 : PAGE_SIZE - 1;
+
+        if ((SGElement->PhysicalAddress.QuadPart & (PAGE_SIZE - 1)) ||
+            (SGElement->Length & Mask))
+            return FALSE;
+    }
+    SGList->Aligned = TRUE;
+    return TRUE;
+}
+
+static FORCEINLINE PFN_NUMBER
+SGListNextPage(
+    IN OUT  PXENVBD_SG_LIST         SGList
+    )
+{
+    PSTOR_SCATTER_GATHER_ELEMENT    SGElement;
+    PFN_NUMBER                      Pfn;
+
+    ASSERT(SGList->Aligned);
+    ASSERT3U(SGList->Index, <, SGList->SGList->NumberOfElements);
+
+    SGElement = &SGList->SGList->List[SGList->Index];
+    Pfn = (PFN_NUMBER)((SGElement->PhysicalAddress.QuadPart + SGList->Offset) >> PAGE_SHIFT);
+
+    SGList->Offset += PAGE_SIZE;
+    if (SGList->Offset >= SGElement->Length) {
+        SGList->Index  = SGList->Index + 1;
+        SGList->Offset = 0;
+    }
+    return Pfn;
+}
+
 static FORCEINLINE BOOLEAN
 SGListNext(
     IN OUT  PXENVBD_SG_LIST         SGList,
@@ -970,7 +1860,7 @@ MapSegmentBuffer(
                 
     Mapping->Length = __min(Mdl->ByteCount, PAGE_SIZE);
     Mapping->Buffer = MmMapLockedPagesSpecifyCache(Mdl, KernelMode,
-                            MmCached, NULL, FALSE, __PdoPriority(Pdo));
+                            MmCached, NULL, FALSE, Pdo->Priority);
     if (!Mapping->Buffer) {
         goto fail;
     }
@@ -996,176 +1886,189 @@ UnmapSegmentBuffer(
     Mapping->Length = 0;
 }
 
+// revokes the request's grants, everything else is kept so it can be re-granted
 static FORCEINLINE VOID
-RequestCleanup(
+RequestRevoke(
     IN  PXENVBD_PDO             Pdo,
     IN  PXENVBD_REQUEST         Request
     )
 {
-    ULONG           Index, Index2;
+    ULONG           Index;
+    ULONG           NrSegments;
+    PVOID           Grants[BLKIF_MAX_SEGMENTS_PER_REQUEST];
     PXENVBD_GRANTER Granter = FrontendGetGranter(Pdo->Frontend);
 
-    // cleanup granted/mapped buffers
+    // each batch is revoked before GranterPutMany returns
     switch (Request->Operation) {
     case BLKIF_OP_READ:
     case BLKIF_OP_WRITE:
         for (Index = 0; Index < XENVBD_MAX_SEGMENTS_PER_REQUEST; ++Index) {
             PXENVBD_SEGMENT Segment = &Request->u.ReadWrite.Segments[Index];
-            if (Segment->Grant)
-                GranterPut(Granter, Segment->Grant);
+            Grants[Index] = Segment->Grant;
             Segment->Grant = NULL;
         }
-        for (Index = 0; Index < XENVBD_MAX_SEGMENTS_PER_REQUEST; ++Index) {
-            PXENVBD_MAPPING Mapping = &Request->u.ReadWrite.Mappings[Index];
-            if (Mapping->BufferId)
-                BufferPut(Mapping->BufferId);
-            Mapping->BufferId = NULL;
-            if (Mapping->Buffer)
-                UnmapSegmentBuffer(Mapping);
-        }
+        GranterPutMany(Granter, XENVBD_MAX_SEGMENTS_PER_REQUEST, Grants);
         break;
 
     case BLKIF_OP_INDIRECT:
+        GranterPutMany(Granter, BLKIF_MAX_INDIRECT_PAGES_PER_REQUEST,
+                       Request->u.Indirect.Grants);
+        RtlZeroMemory(Request->u.Indirect.Grants, sizeof(Request->u.Indirect.Grants));
+
+        NrSegments = Request->u.Indirect.NrSegments;
         for (Index = 0; Index < BLKIF_MAX_INDIRECT_PAGES_PER_REQUEST; ++Index) {
-            if (Request->u.Indirect.Grants[Index])
-                GranterPut(Granter, Request->u.Indirect.Grants[Index]);
-            Request->u.Indirect.Grants[Index] = 0;
-        }
-        for (Index = 0; Index < BLKIF_MAX_INDIRECT_PAGES_PER_REQUEST; ++Index) {
-            PXENVBD_SEGMENT SegmentList = Request->u.Indirect.Segments[Index];
-            if (SegmentList == NULL)
-                continue;
-            for (Index2 = 0; Index2 < SEGMENTS_PER_PAGE; ++Index2) {
-                PXENVBD_SEGMENT Segment = &SegmentList[Index2];
-                if (Segment->Grant)
-                    GranterPut(Granter, Segment->Grant);
-                Segment->Grant = NULL;
-            }
-            __LookasideFree(&Pdo->SegmentList, SegmentList);
-            Request->u.Indirect.Segments[Index] = NULL;
-        }
-        for (Index = 0; Index < BLKIF_MAX_INDIRECT_PAGES_PER_REQUEST; ++Index) {
-            PXENVBD_MAPPING MappingList = Request->u.Indirect.Mappings[Index];
-            if (MappingList == NULL)
-                continue;
-            for (Index2 = 0; Index2 < SEGMENTS_PER_PAGE; ++Index2) {
-                PXENVBD_MAPPING Mapping = &MappingList[Index2];
-                if (Mapping->BufferId)
-                    BufferPut(Mapping->BufferId);
-                Mapping->BufferId = NULL;
-                if (Mapping->Buffer)
-                    UnmapSegmentBuffer(Mapping);
+            PVOID*  Handles = Request->u.Indirect.Handles[Index];
+            if (Handles != NULL) {
+                ULONG   Count = __min(NrSegments, SEGMENTS_PER_PAGE);
+
+                GranterPutMany(Granter, Count, Handles);
+                RtlZeroMemory(Handles, Count * sizeof(PVOID));
+                NrSegments -= Count;
             }
-            __LookasideFree(&Pdo->MappingList, MappingList);
-            Request->u.Indirect.Mappings[Index] = NULL;
         }
         break;
 
     default:
-        // no special cleanup
+        // no grants
         break;
     }
 }
 
+static FORCEINLINE VOID
+RequestCleanup(
+    IN  PXENVBD_PDO             Pdo,
+    IN  PXENVBD_REQUEST         Request
+    )
+{
+    ULONG           Index;
+
+    // cleanup granted buffers
+    RequestRevoke(Pdo, Request);
+
+    if (Request->Operation == BLKIF_OP_INDIRECT) {
+        for (Index = 0; Index < BLKIF_MAX_INDIRECT_PAGES_PER_REQUEST; ++Index) {
+            if (Request->u.Indirect.Handles[Index] != NULL) {
+                __PoolFree(&Pdo->SegmentPool, Request->u.Indirect.Handles[Index]);
+                Request->u.Indirect.Handles[Index] = NULL;
+            }
+            if (Request->u.Indirect.Pages[Index] != NULL) {
+                __PoolFree(&Pdo->IndirectPool, Request->u.Indirect.Pages[Index]);
+                Request->u.Indirect.Pages[Index] = NULL;
+            }
+        }
+    }
+
+    // cleanup bounced buffers
+    while (Request->Mappings) {
+        PXENVBD_MAPPING Mapping = Request->Mappings;
+        Request->Mappings = Mapping->Next;
+
+        if (Mapping->BufferId)
+            BufferPut(Mapping->BufferId);
+        Mapping->BufferId = NULL;
+        if (Mapping->Buffer)
+            UnmapSegmentBuffer(Mapping);
+        __PoolFree(&Pdo->MappingPool, Mapping);
+    }
+}
+
 static FORCEINLINE VOID
 RequestCopyOutput(
     __in PXENVBD_REQUEST         Request
     )
 {
-    ULONG       Index, Index2;
-    ULONG       NrSegments;
+    PXENVBD_MAPPING Mapping;
 
     switch (Request->Operation) {
     case BLKIF_OP_READ:
-        NrSegments = Request->u.ReadWrite.NrSegments;
-        for (Index = 0;
-                    Index < BLKIF_MAX_SEGMENTS_PER_REQUEST &&
-                    NrSegments > 0;
-                            ++Index, --NrSegments) {
-            PXENVBD_MAPPING Mapping = &Request->u.ReadWrite.Mappings[Index];
-
-            if (Mapping->BufferId)
-                BufferCopyOut(Mapping->BufferId, Mapping->Buffer, Mapping->Length);
-        }
         break;
 
     case BLKIF_OP_INDIRECT:
         if (Request->u.Indirect.Operation != BLKIF_OP_READ)
-            break; // not an INDIRECT READ, dont copy any data
-
-        NrSegments = Request->u.Indirect.NrSegments;
-        for (Index = 0;
-                    Index < BLKIF_MAX_INDIRECT_PAGES_PER_REQUEST &&
-                    NrSegments > 0;
-                            ++Index) {
-            PXENVBD_MAPPING MappingList = Request->u.Indirect.Mappings[Index];
-            if (MappingList == NULL)
-                continue;
-            for (Index2 = 0;
-                        Index2 < SEGMENTS_PER_PAGE &&
-                        NrSegments > 0;
-                                ++Index2, --NrSegments) {
-                PXENVBD_MAPPING Mapping = &MappingList[Index2];
-
-                if (Mapping->BufferId)
-                    BufferCopyOut(Mapping->BufferId, Mapping->Buffer, Mapping->Length);
-            }
-        }
+            return; // not an INDIRECT READ, dont copy any data
         break;
 
     default:
         // not a READ, dont copy any data
-        break;
+        return;
+    }
+
+    // only bounced segments have a mapping
+    for (Mapping = Request->Mappings; Mapping != NULL; Mapping = Mapping->Next) {
+        if (Mapping->BufferId)
+            BufferCopyOut(Mapping->BufferId, Mapping->Buffer, Mapping->Length);
     }
 }
 
-static NTSTATUS
+// SectorSize is a constant in the specialized variants, see XENVBD_PREPARE
+static FORCEINLINE NTSTATUS
 PrepareSegment(
     IN  PXENVBD_PDO             Pdo,
+    IN  PXENVBD_REQUEST         Request,
     IN  PXENVBD_SEGMENT         Segment,
-    IN  PXENVBD_MAPPING         Mapping,
     IN  PXENVBD_SG_LIST         SGList,
     IN  BOOLEAN                 ReadOnly,
     IN  ULONG                   SectorsLeft,
-    OUT PULONG                  SectorsNow
+    OUT PULONG                  SectorsNow,
+    OUT PPFN_NUMBER             Pfn,
+    IN  const ULONG             SectorSize
     )
 {
-    PFN_NUMBER      Pfn;
+    PXENVBD_MAPPING Mapping;
     NTSTATUS        Status = STATUS_UNSUCCESSFUL;
-    PXENVBD_GRANTER Granter = FrontendGetGranter(Pdo->Frontend);
-    const ULONG     SectorSize = PdoSectorSize(Pdo);
     const ULONG     SectorsPerPage = __SectorsPerPage(SectorSize);
 
+    if (SGList->Aligned) {
+        // fast path, every segment starts a page, no bounce
+        ++__PdoStats(Pdo)->SegsGranted;
+        *SectorsNow             = __min(SectorsLeft, SectorsPerPage);
+        Segment->FirstSector    = 0;
+        Segment->LastSector     = (UCHAR)(*SectorsNow - 1);
+        *Pfn                    = SGListNextPage(SGList);
+        return STATUS_SUCCESS;
+    }
+
     if (SGListNext(SGList, SectorSize - 1)) {
-        ++Pdo->SegsGranted;
+        ++__PdoStats(Pdo)->SegsGranted;
         // get first sector, last sector and count
         Segment->FirstSector    = (UCHAR)((__Offset(SGList->PhysAddr) + SectorSize - 1) / SectorSize);
         *SectorsNow             = __min(SectorsLeft, SectorsPerPage - Segment->FirstSector);
         Segment->LastSector     = (UCHAR)(Segment->FirstSector + *SectorsNow - 1);
-        Mapping->BufferId       = NULL; // granted, ensure its null
-        Mapping->Buffer         = NULL; // granted, ensure its null
-        Mapping->Length         = 0;    // granted, ensure its 0
-        Pfn                     = __Phys2Pfn(SGList->PhysAddr);
+        *Pfn                    = __Phys2Pfn(SGList->PhysAddr);
 
         ASSERT3U((SGList->PhysLen / SectorSize), ==, *SectorsNow);
         ASSERT3U((SGList->PhysLen & (SectorSize - 1)), ==, 0);
     } else {
-        ++Pdo->SegsBounced;
+        ++__PdoStats(Pdo)->SegsBounced;
         // get first sector, last sector and count
         Segment->FirstSector    = 0;
         *SectorsNow             = __min(SectorsLeft, SectorsPerPage);
         Segment->LastSector     = (UCHAR)(*SectorsNow - 1);
 
-        // map SGList to Virtual Address. Populates Segment->Buffer and Segment->Length
+        // only bounced segments carry a mapping, link it so RequestCleanup finds it
+        Status = STATUS_NO_MEMORY;
+        Mapping = __PoolAlloc(&Pdo->MappingPool);
+        if (Mapping == NULL)
+            goto fail;
+
+        Mapping->Next       = Request->Mappings;
+        Request->Mappings   = Mapping;
+
+        Status = STATUS_UNSUCCESSFUL;
+        // map SGList to Virtual Address. Populates Mapping->Buffer and Mapping->Length
         if (!MapSegmentBuffer(Pdo, Mapping, SGList, SectorSize, *SectorsNow)) {
-            ++Pdo->FailedMaps;
+            ++__PdoStats(Pdo)->FailedMaps;
             goto fail;
         }
 
-        // get a buffer
-        if (!BufferGet(Segment, &Mapping->BufferId, &Pfn)) {
-            ++Pdo->FailedBounces;
-            goto fail;
+        // get a buffer, falling back to the reserve
+        if (!BufferGet(Request->Srb, &Mapping->BufferId, Pfn)) {
+            if (!Pdo->Reserved ||
+                !BufferGetReserved(Request->Srb, &Mapping->BufferId, Pfn)) {
+                ++__PdoStats(Pdo)->FailedBounces;
+                goto fail;
+            }
+            ++__PdoStats(Pdo)->ReserveBounces;
         }
 
         // copy contents in
@@ -1174,33 +2077,31 @@ PrepareSegment(
         }
     }
 
-    // Grant segment's page
-    Status = GranterGet(Granter, Pfn, ReadOnly, &Segment->Grant);
-    if (!NT_SUCCESS(Status)) {
-        ++Pdo->FailedGrants;
-        goto fail;
-    }
-
+    // segment's page is granted by the caller, in a batch
     return STATUS_SUCCESS;
 
 fail:
     return Status;
 }
 
-static NTSTATUS
+static FORCEINLINE NTSTATUS
 PrepareBlkifReadWrite(
     IN  PXENVBD_PDO             Pdo,
     IN  PXENVBD_REQUEST         Request,
     IN  PXENVBD_SG_LIST         SGList,
     IN  ULONG64                 SectorStart,
     IN  ULONG                   SectorsLeft,
-    OUT PULONG                  SectorsDone
+    OUT PULONG                  SectorsDone,
+    IN  const ULONG             SectorSize
     )
 {
     NTSTATUS        Status;
     UCHAR           Operation;
     BOOLEAN         ReadOnly;
     ULONG           Index;
+    PFN_NUMBER      Pfns[BLKIF_MAX_SEGMENTS_PER_REQUEST];
+    PVOID           Grants[BLKIF_MAX_SEGMENTS_PER_REQUEST];
+    PXENVBD_GRANTER Granter = FrontendGetGranter(Pdo->Frontend);
     __Operation(Cdb_OperationEx(Request->Srb), &Operation, &ReadOnly);
 
     Request->Operation  = Operation;
@@ -1212,17 +2113,18 @@ PrepareBlkifReadWrite(
                 SectorsLeft > 0;
                         ++Index) {
         PXENVBD_SEGMENT Segment = &Request->u.ReadWrite.Segments[Index];
-        PXENVBD_MAPPING Mapping = &Request->u.ReadWrite.Mappings[Index];
         ULONG           SectorsNow;
 
         Request->u.ReadWrite.NrSegments++;
         Status = PrepareSegment(Pdo,
+                                Request,
                                 Segment,
-                                Mapping,
                                 SGList,
                                 ReadOnly,
                                 SectorsLeft,
-                                &SectorsNow);
+                                &SectorsNow,
+                                &Pfns[Index],
+                                SectorSize);
         if (!NT_SUCCESS(Status))
             goto fail;
 
@@ -1232,6 +2134,21 @@ PrepareBlkifReadWrite(
     ASSERT3U(Request->u.ReadWrite.NrSegments, >, 0);
     ASSERT3U(Request->u.ReadWrite.NrSegments, <=, BLKIF_MAX_SEGMENTS_PER_REQUEST);
 
+    // Grant all segments' pages
+    Status = GranterGetMany(Granter,
+                            Request->u.ReadWrite.NrSegments,
+                            Pfns,
+                            ReadOnly,
+                            Grants);
+    if (!NT_SUCCESS(Status)) {
+        ++__PdoStats(Pdo)->FailedGrants;
+        goto fail;
+    }
+    for (Index = 0; Index < Request->u.ReadWrite.NrSegments; ++Index) {
+        Request->u.ReadWrite.Segments[Index].Grant = Grants[Index];
+        Request->u.ReadWrite.Segments[Index].Pfn = Pfns[Index];
+    }
+
     return STATUS_SUCCESS;
 
 fail:
@@ -1239,13 +2156,41 @@ fail:
 }
 
 static NTSTATUS
+PrepareIndirectGrants(
+    IN  PXENVBD_PDO                     Pdo,
+    IN  struct blkif_request_segment*   Page,
+    IN  PVOID*                          Handles,
+    IN  ULONG                           Count,
+    IN  PPFN_NUMBER                     Pfns,
+    IN  BOOLEAN                         ReadOnly
+    )
+{
+    ULONG           Index;
+    NTSTATUS        Status;
+    PXENVBD_GRANTER Granter = FrontendGetGranter(Pdo->Frontend);
+
+    Status = GranterGetMany(Granter, Count, Pfns, ReadOnly, Handles);
+    if (!NT_SUCCESS(Status)) {
+        ++__PdoStats(Pdo)->FailedGrants;
+        return Status;
+    }
+
+    // the indirect page is read by the backend, it must be in wire format
+    for (Index = 0; Index < Count; ++Index)
+        Page[Index].gref = GranterReference(Granter, Handles[Index]);
+
+    return STATUS_SUCCESS;
+}
+
+static FORCEINLINE NTSTATUS
 PrepareBlkifIndirect(
     IN  PXENVBD_PDO             Pdo,
     IN  PXENVBD_REQUEST         Request,
     IN  PXENVBD_SG_LIST         SGList,
     IN  ULONG64                 SectorStart,
     IN  ULONG                   SectorsLeft,
-    OUT PULONG                  SectorsDone
+    OUT PULONG                  SectorsDone,
+    IN  const ULONG             SectorSize
     )
 {
     ULONG           Index, Index2;
@@ -1253,7 +2198,7 @@ PrepareBlkifIndirect(
     BOOLEAN         ReadOnly;
     NTSTATUS        Status;
     PXENVBD_GRANTER Granter = FrontendGetGranter(Pdo->Frontend);
-    const ULONG     MaxSegments = FrontendGetFeatures(Pdo->Frontend)->Indirect;
+    const ULONG     MaxSegments = Pdo->IndirectSegments;
     __Operation(Cdb_OperationEx(Request->Srb), &Operation, &ReadOnly);
 
     Request->Operation = BLKIF_OP_INDIRECT;
@@ -1266,49 +2211,81 @@ PrepareBlkifIndirect(
                 SectorsLeft > 0 &&
                 Request->u.Indirect.NrSegments < MaxSegments;
                         ++Index) {
-        PXENVBD_SEGMENT SegmentList;
-        PXENVBD_MAPPING MappingList;
+        struct blkif_request_segment*   Page;
+        PVOID*                          Handles;
+        PPFN_NUMBER                     Pfns;
+        ULONG                           First = 0;
 
         Status = STATUS_NO_MEMORY;
-        Request->u.Indirect.Segments[Index] = SegmentList = __LookasideAlloc(&Pdo->SegmentList);
-        if (SegmentList == NULL)
+        Request->u.Indirect.Handles[Index] = Handles = __PoolAlloc(&Pdo->SegmentPool);
+        if (Handles == NULL)
             goto fail;
+        Pfns = SEGMENT_LIST_PFNS(Handles);
 
         Status = STATUS_NO_MEMORY;
-        Request->u.Indirect.Mappings[Index] = MappingList = __LookasideAlloc(&Pdo->MappingList);
-        if (MappingList == NULL)
+        Request->u.Indirect.Pages[Index] = Page = __PoolAlloc(&Pdo->IndirectPool);
+        if (Page == NULL)
             goto fail;
+        ASSERT3U(((ULONG_PTR)Page & (PAGE_SIZE - 1)), ==, 0);
 
         for (Index2 = 0;
                     Index2 < SEGMENTS_PER_PAGE &&
                     SectorsLeft > 0 &&
                     Request->u.Indirect.NrSegments < MaxSegments;
                             ++Index2) {
-            PXENVBD_SEGMENT Segment = &SegmentList[Index2];
-            PXENVBD_MAPPING Mapping = &MappingList[Index2];
+            XENVBD_SEGMENT  Segment;
             ULONG           SectorsNow = 0;
 
+            RtlZeroMemory(&Segment, sizeof(Segment));
             Request->u.Indirect.NrSegments++;
             Status = PrepareSegment(Pdo,
-                                    Segment,
-                                    Mapping,
+                                    Request,
+                                    &Segment,
                                     SGList,
                                     ReadOnly,
                                     SectorsLeft,
-                                    &SectorsNow);
+                                    &SectorsNow,
+                                    &Pfns[Index2],
+                                    SectorSize);
             if(!NT_SUCCESS(Status))
                 goto fail;
 
+            Page[Index2].first_sect = Segment.FirstSector;
+            Page[Index2].last_sect  = Segment.LastSector;
+
             *SectorsDone += SectorsNow;
             SectorsLeft  -= SectorsNow;
+
+            // grant the segments' pages in batches
+            if (Index2 + 1 - First == GRANT_BATCH_SIZE) {
+                Status = PrepareIndirectGrants(Pdo,
+                                               &Page[First],
+                                               &Handles[First],
+                                               Index2 + 1 - First,
+                                               &Pfns[First],
+                                               ReadOnly);
+                if (!NT_SUCCESS(Status))
+                    goto fail;
+                First = Index2 + 1;
+            }
+        }
+        if (Index2 > First) {
+            Status = PrepareIndirectGrants(Pdo,
+                                           &Page[First],
+                                           &Handles[First],
+                                           Index2 - First,
+                                           &Pfns[First],
+                                           ReadOnly);
+            if (!NT_SUCCESS(Status))
+                goto fail;
         }
 
         Status = GranterGet(Granter,
-                            __Virt2Pfn(SegmentList),
+                            __Virt2Pfn(Page),
                             TRUE,
                             &Request->u.Indirect.Grants[Index]);
         if (!NT_SUCCESS(Status)) {
-            ++Pdo->FailedGrants;
+            ++__PdoStats(Pdo)->FailedGrants;
             goto fail;
         }
     }
@@ -1321,28 +2298,100 @@ fail:
     return Status;
 }
 
-static FORCEINLINE BOOLEAN
-UseIndirect(
+// grants a kept request's pages to the current backend, see PdoPostResume
+static NTSTATUS
+RequestRegrant(
     IN  PXENVBD_PDO             Pdo,
-    IN  ULONG                   SectorsLeft
+    IN  PXENVBD_REQUEST         Request
     )
 {
-    const ULONG SectorsPerPage = __SectorsPerPage(PdoSectorSize(Pdo));
+    ULONG           Index;
+    ULONG           NrSegments;
+    BOOLEAN         ReadOnly;
+    NTSTATUS        Status;
+    PFN_NUMBER      Pfns[BLKIF_MAX_SEGMENTS_PER_REQUEST];
+    PVOID           Grants[BLKIF_MAX_SEGMENTS_PER_REQUEST];
+    PXENVBD_GRANTER Granter = FrontendGetGranter(Pdo->Frontend);
 
-    if (FrontendGetFeatures(Pdo->Frontend)->Indirect == 0)
+    switch (Request->Operation) {
+    case BLKIF_OP_READ:
+    case BLKIF_OP_WRITE:
+        ReadOnly = (Request->Operation == BLKIF_OP_WRITE) ? TRUE : FALSE;
+        NrSegments = Request->u.ReadWrite.NrSegments;
+        for (Index = 0; Index < NrSegments; ++Index)
+            Pfns[Index] = Request->u.ReadWrite.Segments[Index].Pfn;
+
+        Status = GranterGetMany(Granter, NrSegments, Pfns, ReadOnly, Grants);
+        if (!NT_SUCCESS(Status)) {
+            ++__PdoStats(Pdo)->FailedGrants;
+            return Status;
+        }
+        for (Index = 0; Index < NrSegments; ++Index)
+            Request->u.ReadWrite.Segments[Index].Grant = Grants[Index];
+        break;
+
+    case BLKIF_OP_INDIRECT:
+        ReadOnly = (Request->u.Indirect.Operation == BLKIF_OP_WRITE) ? TRUE : FALSE;
+        NrSegments = Request->u.Indirect.NrSegments;
+        for (Index = 0;
+                    Index < BLKIF_MAX_INDIRECT_PAGES_PER_REQUEST &&
+                    NrSegments != 0;
+                            ++Index) {
+            PVOID*  Handles = Request->u.Indirect.Handles[Index];
+            ULONG   Count = __min(NrSegments, SEGMENTS_PER_PAGE);
+
+            // rewrites the grefs in the indirect page
+            Status = PrepareIndirectGrants(Pdo,
+                                           Request->u.Indirect.Pages[Index],
+                                           Handles,
+                                           Count,
+                                           SEGMENT_LIST_PFNS(Handles),
+                                           ReadOnly);
+            if (!NT_SUCCESS(Status))
+                return Status;
+            NrSegments -= Count;
+
+            Status = GranterGet(Granter,
+                                __Virt2Pfn(Request->u.Indirect.Pages[Index]),
+                                TRUE,
+                                &Request->u.Indirect.Grants[Index]);
+            if (!NT_SUCCESS(Status)) {
+                ++__PdoStats(Pdo)->FailedGrants;
+                return Status;
+            }
+        }
+        break;
+
+    default:
+        // no grants
+        break;
+    }
+
+    return STATUS_SUCCESS;
+}
+
+static FORCEINLINE BOOLEAN
+UseIndirect(
+    IN  ULONG                   SectorsLeft,
+    IN  const BOOLEAN           Indirect,
+    IN  const ULONG             SectorSize
+    )
+{
+    if (!Indirect)
         return FALSE; // not supported
 
-    if (SectorsLeft < BLKIF_MAX_SEGMENTS_PER_REQUEST * SectorsPerPage)
+    if (SectorsLeft < BLKIF_MAX_SEGMENTS_PER_REQUEST * __SectorsPerPage(SectorSize))
         return FALSE; // first into a single BLKIF_OP_{READ/WRITE}
 
     return TRUE;
 }
 
-__checkReturn
-static NTSTATUS
-PrepareReadWrite(
+static FORCEINLINE NTSTATUS
+__PrepareReadWrite(
     __in PXENVBD_PDO             Pdo,
-    __in PSCSI_REQUEST_BLOCK     Srb
+    __in PSCSI_REQUEST_BLOCK     Srb,
+    __in const BOOLEAN           Indirect,
+    __in const ULONG             SectorSize
     )
 {
     NTSTATUS        Status;
@@ -1355,14 +2404,19 @@ PrepareReadWrite(
     InitializeListHead(&ReqList);
     RtlZeroMemory(&SGList, sizeof(SGList));
     SGList.SGList = StorPortGetScatterGatherList(PdoGetFdo(Pdo), Srb);
+    if (SGListScan(&SGList, SectorSize))
+        ++__PdoStats(Pdo)->SrbsAligned;
+    else
+        ++__PdoStats(Pdo)->SrbsUnaligned;
 
     SrbExt->Count = 0;
+    SrbExt->InFlight = 0;
     // mark the SRB as pending, completion will check for pending to detect failures
     Srb->SrbStatus = SRB_STATUS_PENDING;
 
     while (SectorsLeft > 0) {
         ULONG           SectorsDone = 0;
-        PXENVBD_REQUEST Request = __LookasideAlloc(&Pdo->RequestList);
+        PXENVBD_REQUEST Request = __PoolAlloc(&Pdo->RequestPool);
 
         Status = STATUS_NO_MEMORY;
         if (Request == NULL) 
@@ -1372,20 +2426,22 @@ PrepareReadWrite(
         InsertTailList(&ReqList, &Request->Entry);
         InterlockedIncrement(&SrbExt->Count);
 
-        if (UseIndirect(Pdo, SectorsLeft)) {
+        if (UseIndirect(SectorsLeft, Indirect, SectorSize)) {
             Status = PrepareBlkifIndirect(Pdo,
                                            Request,
                                            &SGList,
                                            SectorStart,
                                            SectorsLeft,
-                                           &SectorsDone);
+                                           &SectorsDone,
+                                           SectorSize);
         } else {
             Status = PrepareBlkifReadWrite(Pdo,
                                            Request,
                                            &SGList,
                                            SectorStart,
                                            SectorsLeft,
-                                           &SectorsDone);
+                                           &SectorsDone,
+                                           SectorSize);
         }
         if (!NT_SUCCESS(Status))
             goto fail;
@@ -1416,7 +2472,7 @@ fail:
 
         Request = CONTAINING_RECORD(Entry, XENVBD_REQUEST, Entry);
         RequestCleanup(Pdo, Request);
-        __LookasideFree(&Pdo->RequestList, Request);
+        __PoolFree(&Pdo->RequestPool, Request);
         InterlockedDecrement(&SrbExt->Count);
     }
     ASSERT3S(SrbExt->Count, ==, 0);
@@ -1424,6 +2480,236 @@ fail:
     return Status;
 }
 
+typedef NTSTATUS (*PXENVBD_PREPARE_READWRITE)(PXENVBD_PDO, PSCSI_REQUEST_BLOCK);
+
+typedef struct _XENVBD_PREPARE {
+    const CHAR*                 Name;
+    ULONG                       SectorSize; // 0 matches any
+    BOOLEAN                     Indirect;
+    PXENVBD_PREPARE_READWRITE   ReadWrite;
+} XENVBD_PREPARE, *PXENVBD_PREPARE;
+
+#define DEFINE_PREPARE_READWRITE(_Name, _Indirect, _SectorSize)         \
+static NTSTATUS                                                         \
+PrepareReadWrite ## _Name(                                              \
+    __in PXENVBD_PDO             Pdo,                                   \
+    __in PSCSI_REQUEST_BLOCK     Srb                                    \
+    )                                                                   \
+{                                                                       \
+    return __PrepareReadWrite(Pdo, Srb, _Indirect, _SectorSize);        \
+}
+
+DEFINE_PREPARE_READWRITE(512,           FALSE,  512)
+DEFINE_PREPARE_READWRITE(512Indirect,   TRUE,   512)
+DEFINE_PREPARE_READWRITE(4096,          FALSE,  4096)
+DEFINE_PREPARE_READWRITE(4096Indirect,  TRUE,   4096)
+
+static NTSTATUS
+PrepareReadWriteAny(
+    __in PXENVBD_PDO             Pdo,
+    __in PSCSI_REQUEST_BLOCK     Srb
+    )
+{
+    return __PrepareReadWrite(Pdo, Srb, Pdo->IndirectSegments != 0, PdoSectorSize(Pdo));
+}
+
+static const XENVBD_PREPARE PrepareVariants[] = {
+    { "512",            512,    FALSE,  PrepareReadWrite512 },
+    { "512-INDIRECT",   512,    TRUE,   PrepareReadWrite512Indirect },
+    { "4096",           4096,   FALSE,  PrepareReadWrite4096 },
+    { "4096-INDIRECT",  4096,   TRUE,   PrepareReadWrite4096Indirect },
+    { "ANY",            0,      FALSE,  PrepareReadWriteAny },
+};
+
+__checkReturn
+static FORCEINLINE NTSTATUS
+PrepareReadWrite(
+    __in PXENVBD_PDO             Pdo,
+    __in PSCSI_REQUEST_BLOCK     Srb
+    )
+{
+    return Pdo->Prepare->ReadWrite(Pdo, Srb);
+}
+
+//=============================================================================
+// Queue Depth
+static FORCEINLINE ULONG
+__PdoQueueDepthLimit(
+    __in PXENVBD_PDO             Pdo,
+    __in ULONG64                 Srbs,
+    __in ULONG64                 Reqs
+    )
+{
+    ULONG   Slots = BlockRingSize(FrontendGetBlockRing(Pdo->Frontend));
+    ULONG   ReqsPerSrb;
+    ULONG   Limit;
+
+    if (Slots == 0)
+        return 0;
+
+    // an indirect request carries a whole SRB, otherwise use the observed fan out
+    ReqsPerSrb = 1;
+    if (Pdo->IndirectSegments == 0 && Srbs)
+        ReqsPerSrb = (ULONG)((Reqs + Srbs - 1) / Srbs);
+
+    Limit = Slots / ReqsPerSrb;
+    if (Limit > QUEUE_DEPTH_MAX)
+        Limit = QUEUE_DEPTH_MAX;
+    return (Limit < QUEUE_DEPTH_MIN) ? QUEUE_DEPTH_MIN : Limit;
+}
+
+static FORCEINLINE VOID
+__PdoSetQueueDepth(
+    __in PXENVBD_PDO             Pdo,
+    __in ULONG                   Depth
+    )
+{
+    if (Depth == 0 || Depth == Pdo->QueueDepth || Depth == Pdo->QueueDepthRejected)
+        return;
+
+    if (!StorPortSetDeviceQueueDepth(PdoGetFdo(Pdo), 0, (UCHAR)PdoGetTargetId(Pdo), 0, Depth)) {
+        // remembered until the next connect, so the tuner does not retry it every interval
+        Warning("Target[%d] : QueueDepth %u not applied\n", PdoGetTargetId(Pdo), Depth);
+        Pdo->QueueDepthRejected = Depth;
+        return;
+    }
+
+    Verbose("Target[%d] : QueueDepth %u -> %u\n", PdoGetTargetId(Pdo), Pdo->QueueDepth, Depth);
+    Pdo->QueueDepth = Depth;
+}
+
+// PdoSelectPrepare runs from FrontendConnect, which PdoCreate calls before StorPort
+// has enumerated the LUN, so the initial depth is applied on the first read/write
+static FORCEINLINE VOID
+__PdoApplyQueueDepth(
+    __in PXENVBD_PDO             Pdo
+    )
+{
+    if (Pdo->QueueDepthPending == 0)
+        return;
+
+    if (InterlockedExchange(&Pdo->Tuning, 1) != 0)
+        return; // left pending for the next read/write
+
+    if (InterlockedExchange(&Pdo->QueueDepthPending, 0)) {
+        Pdo->QueueDepthRejected = 0;
+        __PdoSetQueueDepth(Pdo, __PdoQueueDepthLimit(Pdo, 0, 0));
+    }
+
+    InterlockedExchange(&Pdo->Tuning, 0);
+}
+
+// caller holds Pdo->Tuning
+static FORCEINLINE VOID
+__PdoResetQueueDepth(
+    __in PXENVBD_PDO             Pdo,
+    __in LONGLONG                Now
+    )
+{
+    Pdo->TuneStart = Now;
+    Pdo->RingFull = 0;
+    __PdoServiceSum(Pdo, &Pdo->TuneSrbs, &Pdo->TuneReqs, &Pdo->TuneTicks);
+}
+
+static VOID
+__PdoTuneQueueDepth(
+    __in PXENVBD_PDO             Pdo
+    )
+{
+    LARGE_INTEGER   Frequency;
+    LARGE_INTEGER   Now;
+    LONGLONG        Elapsed;
+    ULONG64         Srbs;
+    ULONG64         Reqs;
+    LONGLONG        Ticks;
+    ULONG           Limit;
+    ULONG           InFlight;
+    ULONG           Depth;
+
+    Now = KeQueryPerformanceCounter(&Frequency);
+    Elapsed = Now.QuadPart - Pdo->TuneStart;
+    if (Elapsed < (Frequency.QuadPart * QUEUE_DEPTH_INTERVAL_MS) / 1000)
+        return;
+
+    if (InterlockedExchange(&Pdo->Tuning, 1) != 0)
+        return;
+
+    // TuneStart may have moved while the guard was taken
+    Elapsed = Now.QuadPart - Pdo->TuneStart;
+    if (Elapsed <= 0)
+        goto done;
+
+    __PdoServiceSum(Pdo, &Srbs, &Reqs, &Ticks);
+    if (Srbs < Pdo->TuneSrbs || Reqs < Pdo->TuneReqs || Ticks < Pdo->TuneTicks)
+        goto done; // the debug callback zeroed the stats, start a new interval
+    Srbs -= Pdo->TuneSrbs;
+    Reqs -= Pdo->TuneReqs;
+    Ticks -= Pdo->TuneTicks;
+
+    Limit = __PdoQueueDepthLimit(Pdo, Srbs, Reqs);
+    if (Limit == 0 || Srbs == 0)
+        goto done;
+
+    // Little's law: mean SRBs in flight = throughput * mean service time,
+    // which is the summed service time over the elapsed interval
+    InFlight = (ULONG)((Ticks + Elapsed - 1) / Elapsed);
+
+    Depth = Pdo->QueueDepth ? Pdo->QueueDepth : Limit;
+    if (Pdo->RingFull > Srbs / 16) {
+        // the ring keeps rejecting, back off towards what the backend sustains
+        Depth = Depth - Depth / 4;
+        if (Depth <= InFlight)
+            Depth = InFlight + 1;
+    } else {
+        Depth = Depth + Depth / 4 + 1;
+    }
+    if (Depth < QUEUE_DEPTH_MIN)
+        Depth = QUEUE_DEPTH_MIN;
+    Depth = __min(Depth, Limit);
+
+    __PdoSetQueueDepth(Pdo, Depth);
+
+done:
+    __PdoResetQueueDepth(Pdo, Now.QuadPart);
+    InterlockedExchange(&Pdo->Tuning, 0);
+}
+
+VOID
+PdoSelectPrepare(
+    __in PXENVBD_PDO             Pdo
+    )
+{
+    const ULONG     SectorSize = PdoSectorSize(Pdo);
+    const ULONG     Indirect = FrontendGetFeatures(Pdo->Frontend)->Indirect;
+    ULONG           Index;
+
+    Pdo->IndirectSegments = Indirect;
+    Pdo->Priority = __PdoPriority(Pdo);
+    Pdo->ZeroFailed = FALSE;
+
+    for (Index = 0; Index < ARRAYSIZE(PrepareVariants); ++Index) {
+        const XENVBD_PREPARE*   Prepare = &PrepareVariants[Index];
+
+        if (Prepare->SectorSize == 0 ||
+            (Prepare->SectorSize == SectorSize &&
+             Prepare->Indirect == (Indirect != 0)))
+            break;
+    }
+    ASSERT3U(Index, <, ARRAYSIZE(PrepareVariants));
+
+    if (Pdo->Prepare != &PrepareVariants[Index])
+        Verbose("Target[%d] : Prepare %s\n", PdoGetTargetId(Pdo),
+                    PrepareVariants[Index].Name);
+    Pdo->Prepare = &PrepareVariants[Index];
+
+    // start from the ring's capacity, __PdoTuneQueueDepth adapts from there
+    if (InterlockedExchange(&Pdo->Tuning, 1) == 0) {
+        __PdoResetQueueDepth(Pdo, KeQueryPerformanceCounter(NULL).QuadPart);
+        InterlockedExchange(&Pdo->Tuning, 0);
+    }
+    InterlockedExchange(&Pdo->QueueDepthPending, 1);
+}
+
 __checkReturn
 static NTSTATUS
 PrepareSyncCache(
@@ -1432,11 +2718,12 @@ PrepareSyncCache(
     )
 {
     PXENVBD_SRBEXT  SrbExt = GetSrbExt(Srb);
-    PXENVBD_REQUEST Request = __LookasideAlloc(&Pdo->RequestList);
+    PXENVBD_REQUEST Request = __PoolAlloc(&Pdo->RequestPool);
     if (Request == NULL)
         return STATUS_UNSUCCESSFUL;
     
     SrbExt->Count = 1;
+    SrbExt->InFlight = 0;
     // mark the SRB as pending, completion will check for pending to detect failures
     Srb->SrbStatus = SRB_STATUS_PENDING;
 
@@ -1450,73 +2737,327 @@ PrepareSyncCache(
     return STATUS_SUCCESS;
 }
 
-__checkReturn
-static NTSTATUS
-PrepareUnmap(
+__checkReturn
+static NTSTATUS
+PrepareUnmap(
+    __in PXENVBD_PDO             Pdo,
+    __in PSCSI_REQUEST_BLOCK     Srb
+    )
+{
+    PXENVBD_SRBEXT  SrbExt = GetSrbExt(Srb);
+    PXENVBD_REQUEST Request = __PoolAlloc(&Pdo->RequestPool);
+    if (Request == NULL)
+        return STATUS_UNSUCCESSFUL;
+
+    SrbExt->Count = 1;
+    SrbExt->InFlight = 0;
+    // mark the SRB as pending, completion will check for pending to detect failures
+    Srb->SrbStatus = SRB_STATUS_PENDING;
+
+    Request->Srb = Srb;
+    Request->Operation      = BLKIF_OP_DISCARD;
+
+    Request->u.Discard.FirstSector = Cdb_LogicalBlock(Srb);
+    Request->u.Discard.NrSectors   = Cdb_TransferBlock(Srb);
+    Request->u.Discard.Flags       = 0;
+
+    __PdoIncBlkifOpCount(Pdo, Request);
+    QueueAppend(&Pdo->PreparedReqs, &Request->Entry);
+    return STATUS_SUCCESS;
+}
+
+// a write of whole, aligned discard units that is all zeroes can be sent as a BLKIF_OP_DISCARD,
+// the buffer is only mapped and scanned when the target has opted in, see FrontendConnect
+static BOOLEAN
+__PdoZeroWrite(
+    __in PXENVBD_PDO             Pdo,
+    __in PSCSI_REQUEST_BLOCK     Srb
+    )
+{
+    const XENVBD_DISKINFO*  DiskInfo = FrontendGetDiskInfo(Pdo->Frontend);
+    const ULONG64           Start = Cdb_LogicalBlock(Srb) * DiskInfo->SectorSize;
+    const ULONG64           Length = (ULONG64)Cdb_TransferBlock(Srb) * DiskInfo->SectorSize;
+    ULONG64                 Granularity;
+    PXENVBD_PDO_STATS       Stats;
+    PVOID                   Buffer;
+    LONGLONG                Begin;
+    BOOLEAN                 Zero;
+
+    if (!DiskInfo->Discard || !DiskInfo->DiscardZeroes || Pdo->ZeroFailed)
+        return FALSE;
+    if (Cdb_OperationEx(Srb) != SCSIOP_WRITE)
+        return FALSE;
+
+    // partial units would leave stale data either side, those are written as normal
+    Granularity = __max(DiskInfo->DiscardGranularity, DiskInfo->SectorSize);
+    if (Length < PAGE_SIZE ||
+        Length != Srb->DataTransferLength ||
+        (Length % Granularity) != 0 ||
+        ((Start + Granularity - (DiskInfo->DiscardAlignment % Granularity)) % Granularity) != 0)
+        return FALSE;
+
+    Begin = KeQueryPerformanceCounter(NULL).QuadPart;
+    Zero = FALSE;
+    if (StorPortGetSystemAddress(PdoGetFdo(Pdo), Srb, &Buffer) == STOR_STATUS_SUCCESS &&
+        Buffer != NULL)
+        Zero = BufferIsZero(Buffer, Srb->DataTransferLength);
+
+    Stats = __PdoStats(Pdo);
+    ++Stats->ZeroChecks;
+    Stats->ZeroBytesChecked += Length;
+    Stats->ZeroTicks += KeQueryPerformanceCounter(NULL).QuadPart - Begin;
+    if (Zero) {
+        ++Stats->ZeroWrites;
+        Stats->ZeroBytesElided += Length;
+    }
+    return Zero;
+}
+
+// every read/write SRB is prepared here, from StartIo or from FreshSrbs
+__checkReturn
+static FORCEINLINE NTSTATUS
+__PdoPrepareReadWrite(
+    __in PXENVBD_PDO             Pdo,
+    __in PSCSI_REQUEST_BLOCK     Srb
+    )
+{
+    // same LBA and length, PrepareUnmap reads both from the CDB
+    if (__PdoZeroWrite(Pdo, Srb))
+        return PrepareUnmap(Pdo, Srb);
+    return PrepareReadWrite(Pdo, Srb);
+}
+
+//=============================================================================
+// Queue-Related
+static VOID
+__PdoPrepareFresh(
+    __in PXENVBD_PDO             Pdo
+    )
+{
+    for (;;) {
+        NTSTATUS        Status;
+        PXENVBD_SRBEXT  SrbExt;
+        PLIST_ENTRY     Entry = QueuePop(&Pdo->FreshSrbs);
+        if (Entry == NULL)
+            break;
+        SrbExt = CONTAINING_RECORD(Entry, XENVBD_SRBEXT, Entry);
+
+        // over the QoS limits, the QoS timer resumes from here
+        if (!__PdoQosAdmit(Pdo, SrbExt->Srb)) {
+            QueueUnPop(&Pdo->FreshSrbs, &SrbExt->Entry);
+            return;
+        }
+
+        // popped a SRB, process it
+        switch (Cdb_OperationEx(SrbExt->Srb)) {
+        case SCSIOP_READ:
+        case SCSIOP_WRITE:
+            Status = __PdoPrepareReadWrite(Pdo, SrbExt->Srb);
+            break;
+        case SCSIOP_SYNCHRONIZE_CACHE:
+            Status = PrepareSyncCache(Pdo, SrbExt->Srb);
+            break;
+        case SCSIOP_UNMAP:
+            Status = PrepareUnmap(Pdo, SrbExt->Srb);
+            break;
+        default:
+            ASSERT(FALSE);
+            Status = STATUS_NOT_SUPPORTED;
+            break;
+        }
+
+        // if failed to prepare, put on fresh and finish up
+        if (!NT_SUCCESS(Status)) {
+            QueueUnPop(&Pdo->FreshSrbs, &SrbExt->Entry);
+            break;
+        }
+
+        ++Pdo->FreshWaits;
+        Pdo->FreshTicks += KeQueryPerformanceCounter(NULL).QuadPart - SrbExt->Start;
+    }
+}
+
+VOID
+PdoPrepareFresh(
+    __in PXENVBD_PDO             Pdo
+    )
+{
+    // nothing is granted while resuming, the grants would belong to a backend that has gone
+    InterlockedIncrement(&Pdo->Preparing);
+    if (!__PdoIsResuming(Pdo))
+        __PdoPrepareFresh(Pdo);
+    InterlockedDecrement(&Pdo->Preparing);
+}
+
+//=============================================================================
+// Scheduler - interleaves prepared requests from different SRBs onto the ring
+static FORCEINLINE ULONG
+__RequestCost(
+    __in PXENVBD_REQUEST         Request
+    )
+{
+    switch (Request->Operation) {
+    case BLKIF_OP_READ:
+    case BLKIF_OP_WRITE:
+        return Request->u.ReadWrite.NrSegments ? Request->u.ReadWrite.NrSegments : 1;
+    case BLKIF_OP_INDIRECT:
+        return Request->u.Indirect.NrSegments;
+    default:
+        return 1;
+    }
+}
+
+static FORCEINLINE UCHAR
+__SchedSizeClass(
+    __in ULONG                   Length
+    )
+{
+    if (Length <= 4 * 1024)
+        return 0;
+    if (Length <= 64 * 1024)
+        return 1;
+    if (Length <= 512 * 1024)
+        return 2;
+    return 3;
+}
+
+static FORCEINLINE VOID
+__PdoSchedAdd(
+    __in PXENVBD_PDO             Pdo,
+    __in PXENVBD_REQUEST         Request
+    )
+{
+    PSCSI_REQUEST_BLOCK Srb = Request->Srb;
+    PXENVBD_SRBEXT      SrbExt = GetSrbExt(Srb);
+
+    if (!SrbExt->Scheduled) {
+        BOOLEAN Urgent = (Srb->SrbFlags & SRB_CLASS_FLAGS_PAGING) ||
+                         ((Srb->SrbFlags & SRB_FLAGS_QUEUE_ACTION_ENABLE) &&
+                          Srb->QueueAction == SRB_HEAD_OF_QUEUE_TAG_REQUEST);
+
+        SrbExt->Priority  = Urgent ? 0 : 1;
+        SrbExt->SizeClass = __SchedSizeClass(Srb->DataTransferLength);
+        SrbExt->Deficit   = 0;
+        SrbExt->Scheduled = TRUE;
+        InsertTailList(&Pdo->SchedSrbs[SrbExt->Priority], &SrbExt->Entry);
+    }
+
+    InsertTailList(&SrbExt->Requests, &Request->Entry);
+    ++Pdo->SchedHeld;
+}
+
+static FORCEINLINE VOID
+__PdoSchedRemove(
+    __in PXENVBD_PDO             Pdo,
+    __in PXENVBD_SRBEXT          SrbExt
+    )
+{
+    const UCHAR Class = SrbExt->SizeClass;
+    LONGLONG    Delay = KeQueryPerformanceCounter(NULL).QuadPart - SrbExt->Start;
+
+    ASSERT(IsListEmpty(&SrbExt->Requests));
+    RemoveEntryList(&SrbExt->Entry);
+    SrbExt->Scheduled = FALSE;
+    SrbExt->Deficit = 0;
+
+    ++Pdo->SchedSrbs[Class];
+    Pdo->SchedTicks[Class] += Delay;
+    if (Delay > Pdo->SchedMaxTicks[Class])
+        Pdo->SchedMaxTicks[Class] = Delay;
+}
+
+static VOID
+__PdoSchedFlush(
+    __in PXENVBD_PDO             Pdo
+    )
+{
+    KIRQL       Irql;
+    ULONG       Index;
+
+    // return held requests to PreparedReqs so abort paths see every request
+    KeAcquireSpinLock(&Pdo->SchedLock, &Irql);
+    for (Index = 0; Index < SCHED_PRIORITIES; ++Index) {
+        while (!IsListEmpty(&Pdo->SchedSrbs[Index])) {
+            PLIST_ENTRY     Entry = RemoveHeadList(&Pdo->SchedSrbs[Index]);
+            PXENVBD_SRBEXT  SrbExt = CONTAINING_RECORD(Entry, XENVBD_SRBEXT, Entry);
+
+            while (!IsListEmpty(&SrbExt->Requests)) {
+                QueueAppend(&Pdo->PreparedReqs, RemoveHeadList(&SrbExt->Requests));
+                --Pdo->SchedHeld;
+            }
+            SrbExt->Scheduled = FALSE;
+            SrbExt->Deficit = 0;
+        }
+    }
+    ASSERT3U(Pdo->SchedHeld, ==, 0);
+    KeReleaseSpinLock(&Pdo->SchedLock, Irql);
+}
+
+static FORCEINLINE BOOLEAN
+__PdoSchedRound(
     __in PXENVBD_PDO             Pdo,
-    __in PSCSI_REQUEST_BLOCK     Srb
+    __in PXENVBD_BLOCKRING       BlockRing,
+    __in PLIST_ENTRY             Head,
+    __in ULONG                   Cap,
+    __inout PULONG               Submitted,
+    __out PBOOLEAN               Full
     )
 {
-    PXENVBD_SRBEXT  SrbExt = GetSrbExt(Srb);
-    PXENVBD_REQUEST Request = __LookasideAlloc(&Pdo->RequestList);
-    if (Request == NULL)
-        return STATUS_UNSUCCESSFUL;
+    PLIST_ENTRY Entry;
+    BOOLEAN     Progress = FALSE;
 
-    SrbExt->Count = 1;
-    // mark the SRB as pending, completion will check for pending to detect failures
-    Srb->SrbStatus = SRB_STATUS_PENDING;
+    *Full = FALSE;
 
-    Request->Srb = Srb;
-    Request->Operation      = BLKIF_OP_DISCARD;
+    for (Entry = Head->Flink; Entry != Head; ) {
+        PXENVBD_SRBEXT  SrbExt = CONTAINING_RECORD(Entry, XENVBD_SRBEXT, Entry);
+        PXENVBD_REQUEST Request;
+        ULONG           Cost;
 
-    Request->u.Discard.FirstSector = Cdb_LogicalBlock(Srb);
-    Request->u.Discard.NrSectors   = Cdb_TransferBlock(Srb);
-    Request->u.Discard.Flags       = 0;
+        Entry = Entry->Flink;
 
-    __PdoIncBlkifOpCount(Pdo, Request);
-    QueueAppend(&Pdo->PreparedReqs, &Request->Entry);
-    return STATUS_SUCCESS;
-}
+        if ((ULONG)SrbExt->InFlight >= Cap) {
+            ++Pdo->SchedCapped;
+            continue;
+        }
 
-//=============================================================================
-// Queue-Related
-VOID
-PdoPrepareFresh(
-    __in PXENVBD_PDO             Pdo
-    )
-{
-    for (;;) {
-        NTSTATUS        Status;
-        PXENVBD_SRBEXT  SrbExt;
-        PLIST_ENTRY     Entry = QueuePop(&Pdo->FreshSrbs);
-        if (Entry == NULL)
-            break;
-        SrbExt = CONTAINING_RECORD(Entry, XENVBD_SRBEXT, Entry);
+        // deficit round robin, every visit gets at least the head request out
+        Request = CONTAINING_RECORD(SrbExt->Requests.Flink, XENVBD_REQUEST, Entry);
+        Cost = __RequestCost(Request);
+        SrbExt->Deficit += (Cost > SCHED_QUANTUM) ? Cost : SCHED_QUANTUM;
 
-        // popped a SRB, process it
-        switch (Cdb_OperationEx(SrbExt->Srb)) {
-        case SCSIOP_READ:
-        case SCSIOP_WRITE:
-            Status = PrepareReadWrite(Pdo, SrbExt->Srb);
-            break;
-        case SCSIOP_SYNCHRONIZE_CACHE:
-            Status = PrepareSyncCache(Pdo, SrbExt->Srb);
-            break;
-        case SCSIOP_UNMAP:
-            Status = PrepareUnmap(Pdo, SrbExt->Srb);
-            break;
-        default:
-            ASSERT(FALSE);
-            Status = STATUS_NOT_SUPPORTED;
-            break;
-        }
+        while (!IsListEmpty(&SrbExt->Requests) &&
+               (ULONG)SrbExt->InFlight < Cap) {
+            Request = CONTAINING_RECORD(SrbExt->Requests.Flink, XENVBD_REQUEST, Entry);
+            Cost = __RequestCost(Request);
+            if (Cost > SrbExt->Deficit)
+                break;
 
-        // if failed to prepare, put on fresh and finish up
-        if (!NT_SUCCESS(Status)) {
-            QueueUnPop(&Pdo->FreshSrbs, &SrbExt->Entry);
-            break;
+            // the ring's tag table tracks the request from here on
+            RemoveEntryList(&Request->Entry);
+            if (!BlockRingSubmit(BlockRing, Request)) {
+                InsertHeadList(&SrbExt->Requests, &Request->Entry);
+                ++Pdo->RingFull;
+                ++Pdo->TotalRingFull;
+
+                // resume with this SRB once the ring has space
+                RemoveEntryList(Head);
+                InsertTailList(&SrbExt->Entry, Head);
+                *Full = TRUE;
+                return Progress;
+            }
+
+            SrbExt->Deficit -= Cost;
+            InterlockedIncrement(&SrbExt->InFlight);
+            --Pdo->SchedHeld;
+            ++*Submitted;
+            Progress = TRUE;
         }
+
+        if (IsListEmpty(&SrbExt->Requests))
+            __PdoSchedRemove(Pdo, SrbExt);
     }
+
+    return Progress;
 }
 
 VOID
@@ -1526,26 +3067,167 @@ PdoSubmitPrepared(
 {
     PXENVBD_BLOCKRING   BlockRing = FrontendGetBlockRing(Pdo->Frontend);
     PXENVBD_NOTIFIER    Notifier = FrontendGetNotifier(Pdo->Frontend);
+    ULONG               Submitted = 0;
+    ULONG               Cap;
+    BOOLEAN             Full = FALSE;
+    KIRQL               Irql;
+
+    // no single normal priority SRB may hold more than its share of the ring
+    Cap = BlockRingSize(BlockRing) / SCHED_SLOT_SHARE;
+    if (Cap == 0)
+        Cap = 1;
+
+    KeAcquireSpinLock(&Pdo->SchedLock, &Irql);
+
+    // the ring is stale while resuming, PdoResumeDrain collects prepared requests
+    if (__PdoIsResuming(Pdo)) {
+        KeReleaseSpinLock(&Pdo->SchedLock, Irql);
+        return;
+    }
 
     for (;;) {
-        PXENVBD_REQUEST Request;
         PLIST_ENTRY     Entry = QueuePop(&Pdo->PreparedReqs);
         if (Entry == NULL)
             break;
-        Request = CONTAINING_RECORD(Entry, XENVBD_REQUEST, Entry);
+        __PdoSchedAdd(Pdo, CONTAINING_RECORD(Entry, XENVBD_REQUEST, Entry));
+    }
 
-        QueueAppend(&Pdo->SubmittedReqs, &Request->Entry);
-        KeMemoryBarrier();
-        if (!BlockRingSubmit(BlockRing, Request)) {
-            QueueRemove(&Pdo->SubmittedReqs, &Request->Entry);
-            QueueUnPop(&Pdo->PreparedReqs, &Request->Entry);
+    // paging and head-of-queue SRBs first, and uncapped
+    while (!Full && !IsListEmpty(&Pdo->SchedSrbs[0])) {
+        if (!__PdoSchedRound(Pdo, BlockRing, &Pdo->SchedSrbs[0], MAXULONG, &Submitted, &Full))
+            break;
+    }
+    while (!Full && !IsListEmpty(&Pdo->SchedSrbs[1])) {
+        if (!__PdoSchedRound(Pdo, BlockRing, &Pdo->SchedSrbs[1], Cap, &Submitted, &Full))
             break;
-        }
     }
 
+    KeReleaseSpinLock(&Pdo->SchedLock, Irql);
+
     if (BlockRingPush(BlockRing)) {
         NotifierSend(Notifier);
     }
+
+    // busy-poll targets harvest their own responses, skipping the interrupt and DPC
+    if (Submitted && BlockRingSpin(BlockRing))
+        BlockRingPoll(BlockRing);
+}
+
+// drops the entries of the blocks overlapping the sectors, their contents are no longer known
+static VOID
+__PdoCrcInvalidate(
+    __in PXENVBD_PDO             Pdo,
+    __in ULONG64                 Sector,
+    __in ULONG64                 Count
+    )
+{
+    const ULONG     SectorSize = PdoSectorSize(Pdo);
+    ULONG64         Block = (Sector * SectorSize) / CRC_BLOCK_SIZE;
+    const ULONG64   Last = ((Sector + Count) * SectorSize + CRC_BLOCK_SIZE - 1) / CRC_BLOCK_SIZE;
+    KIRQL           Irql;
+
+    if (Pdo->CrcEntries == 0 || Count == 0)
+        return;
+
+    KeAcquireSpinLock(&Pdo->CrcLock, &Irql);
+    if (Pdo->CrcMap == NULL) {
+        // turned off
+    } else if (Last - Block >= Pdo->CrcEntries) {
+        RtlZeroMemory(Pdo->CrcMap, sizeof(XENVBD_CRC_ENTRY) * Pdo->CrcEntries);
+    } else {
+        for (; Block < Last; ++Block) {
+            PXENVBD_CRC_ENTRY   Entry = &Pdo->CrcMap[Block & (Pdo->CrcEntries - 1)];
+
+            if (Entry->Block == Block + 1)
+                Entry->Block = 0;
+        }
+    }
+    KeReleaseSpinLock(&Pdo->CrcLock, Irql);
+}
+
+// records the CRC32C of each whole block a completed write covers, and checks the blocks a
+// completed read covers, by now all of the SRB's data is in its buffer (bounces copied out)
+// Windows does not keep a write's pages stable while it is in flight, so the buffer may no
+// longer hold what the backend read: a mismatch is a lead to follow up, not proof of corruption
+static VOID
+__PdoCrcSrb(
+    __in PXENVBD_PDO             Pdo,
+    __in PSCSI_REQUEST_BLOCK     Srb
+    )
+{
+    const UCHAR     Operation = Cdb_OperationEx(Srb);
+    const ULONG     SectorSize = PdoSectorSize(Pdo);
+    const ULONG64   Sector = Cdb_LogicalBlock(Srb);
+    const ULONG     Count = Cdb_TransferBlock(Srb);
+    const ULONG64   Start = Sector * SectorSize;
+    const ULONG64   End = Start + (ULONG64)Count * SectorSize;
+    ULONG64         Block;
+    PUCHAR          Buffer;
+    LONGLONG        Begin;
+    PXENVBD_PDO_STATS Stats;
+
+    if (Pdo->CrcEntries == 0 || Count == 0)
+        return;
+    if (Operation != SCSIOP_READ && Operation != SCSIOP_WRITE)
+        return;
+
+    Begin = KeQueryPerformanceCounter(NULL).QuadPart;
+
+    if (StorPortGetSystemAddress(PdoGetFdo(Pdo), Srb, (PVOID*)&Buffer) != STOR_STATUS_SUCCESS ||
+        Buffer == NULL) {
+        if (Operation == SCSIOP_WRITE)
+            __PdoCrcInvalidate(Pdo, Sector, Count);
+        return;
+    }
+
+    // a write leaves the blocks it only partly covers unknown
+    if (Operation == SCSIOP_WRITE) {
+        if (Start % CRC_BLOCK_SIZE)
+            __PdoCrcInvalidate(Pdo, Sector, 1);
+        if (End % CRC_BLOCK_SIZE)
+            __PdoCrcInvalidate(Pdo, Sector + Count - 1, 1);
+    }
+
+    for (Block = (Start + CRC_BLOCK_SIZE - 1) / CRC_BLOCK_SIZE;
+                (Block + 1) * CRC_BLOCK_SIZE <= End;
+                        ++Block) {
+        const ULONG         Crc = BufferCrc32c(Buffer + (ULONG_PTR)(Block * CRC_BLOCK_SIZE - Start),
+                                               CRC_BLOCK_SIZE);
+        PXENVBD_CRC_ENTRY   Entry;
+        ULONG               Expected = 0;
+        BOOLEAN             Mismatch = FALSE;
+        KIRQL               Irql;
+
+        KeAcquireSpinLock(&Pdo->CrcLock, &Irql);
+        if (Pdo->CrcMap == NULL) {
+            KeReleaseSpinLock(&Pdo->CrcLock, Irql);
+            break;
+        }
+        Entry = &Pdo->CrcMap[Block & (Pdo->CrcEntries - 1)];
+        if (Operation == SCSIOP_WRITE) {
+            Entry->Block = Block + 1;
+            Entry->Crc   = Crc;
+            ++Pdo->CrcStored;
+        } else if (Entry->Block != Block + 1) {
+            ++Pdo->CrcMissed;
+        } else if (Entry->Crc == Crc) {
+            ++Pdo->CrcVerified;
+        } else {
+            ++Pdo->CrcMismatches;
+            Expected = Entry->Crc;
+            Mismatch = TRUE;
+        }
+        KeReleaseSpinLock(&Pdo->CrcLock, Irql);
+
+        if (Mismatch)
+            Warning("Target[%d] : CRC32C MISMATCH block %llu (sector %llu) read %08x written %08x\n",
+                    PdoGetTargetId(Pdo), Block, (Block * CRC_BLOCK_SIZE) / SectorSize,
+                    Crc, Expected);
+    }
+
+    Stats = __PdoStats(Pdo);
+    Stats->CrcBytes += End - Start;
+    Stats->CrcTicks += KeQueryPerformanceCounter(NULL).QuadPart - Begin;
 }
 
 VOID
@@ -1559,6 +3241,30 @@ PdoCompleteSubmitted(
     PXENVBD_SRBEXT      SrbExt = GetSrbExt(Srb);
     ASSERT3P(SrbExt, !=, NULL);
 
+    // a zero write the backend would not discard is not an error, write it out instead
+    if (Status != BLKIF_RSP_OKAY &&
+        Request->Operation == BLKIF_OP_DISCARD &&
+        Cdb_OperationEx(Srb) == SCSIOP_WRITE) {
+        if (Status == BLKIF_RSP_EOPNOTSUPP)
+            FrontendRemoveFeature(Pdo->Frontend, BLKIF_OP_DISCARD);
+        Warning("Target[%d] : zero write discard failed (%d), writing\n",
+                PdoGetTargetId(Pdo), Status);
+        Pdo->ZeroFailed = TRUE;
+
+        RequestCleanup(Pdo, Request);
+        __PoolFree(&Pdo->RequestPool, Request);
+        InterlockedDecrement(&SrbExt->InFlight);
+        ++__PdoStats(Pdo)->ZeroFallbacks;
+
+        // a zero write is a single request, the SRB is back where StartIo left it
+        if (InterlockedDecrement(&SrbExt->Count) == 0) {
+            Srb->SrbStatus = SRB_STATUS_PENDING;
+            QueueUnPop(&Pdo->FreshSrbs, &SrbExt->Entry);
+            (VOID) KeInsertQueueDpc(&Pdo->QosDpc, NULL, NULL);
+        }
+        return;
+    }
+
     switch (Status) {
     case BLKIF_RSP_OKAY:
         RequestCopyOutput(Request);
@@ -1580,23 +3286,40 @@ PdoCompleteSubmitted(
         break;
     }
 
-    QueueRemove(&Pdo->SubmittedReqs, &Request->Entry);
+    // an unmap, even a failed one, may have changed what reads of its blocks return
+    if (Request->Operation == BLKIF_OP_DISCARD &&
+        Cdb_OperationEx(Srb) != SCSIOP_WRITE)
+        __PdoCrcInvalidate(Pdo,
+                           Request->u.Discard.FirstSector,
+                           Request->u.Discard.NrSectors);
+
     RequestCleanup(Pdo, Request);
-    __LookasideFree(&Pdo->RequestList, Request);
+    __PoolFree(&Pdo->RequestPool, Request);
+    ++__PdoStats(Pdo)->ReqsServiced;
+    InterlockedDecrement(&SrbExt->InFlight);
 
     // complete srb
     if (InterlockedDecrement(&SrbExt->Count) == 0) {
+        PXENVBD_PDO_STATS   Stats = __PdoStats(Pdo);
+
+        ++Stats->SrbsServiced;
+        Stats->ServiceTicks += KeQueryPerformanceCounter(NULL).QuadPart - SrbExt->Start;
+
         if (Srb->SrbStatus == SRB_STATUS_PENDING) {
             // SRB has not hit a failure condition (BLKIF_RSP_ERROR | BLKIF_RSP_EOPNOTSUPP)
             // from any of its responses. SRB must have succeeded
             Srb->SrbStatus = SRB_STATUS_SUCCESS;
             Srb->ScsiStatus = 0x00; // SCSI_GOOD
+            __PdoCrcSrb(Pdo, Srb);
         } else {
             // Srb->SrbStatus has already been set by 1 or more requests with Status != BLKIF_RSP_OKAY
             Srb->ScsiStatus = 0x40; // SCSI_ABORTED
+            if (Cdb_OperationEx(Srb) == SCSIOP_WRITE)
+                __PdoCrcInvalidate(Pdo, Cdb_LogicalBlock(Srb), Cdb_TransferBlock(Srb));
         }
 
         FdoCompleteSrb(PdoGetFdo(Pdo), Srb);
+        __PdoTuneQueueDepth(Pdo);
     }
 }
 
@@ -1610,7 +3333,8 @@ PdoCompleteShutdown(
 
     if (QueueCount(&Pdo->FreshSrbs) ||
         QueueCount(&Pdo->PreparedReqs) ||
-        QueueCount(&Pdo->SubmittedReqs))
+        Pdo->SchedHeld ||
+        PdoOutstandingReqs(Pdo))
         return;
 
     for (;;) {
@@ -1624,64 +3348,151 @@ PdoCompleteShutdown(
     }
 }
 
-VOID
-PdoPreResume(
-    __in PXENVBD_PDO             Pdo
+static FORCEINLINE ULONG64
+__RequestFirstSector(
+    __in PXENVBD_REQUEST         Request
     )
 {
-    LIST_ENTRY      List;
-    
-    InitializeListHead(&List);
+    switch (Request->Operation) {
+    case BLKIF_OP_READ:
+    case BLKIF_OP_WRITE:
+        return Request->u.ReadWrite.FirstSector;
+    case BLKIF_OP_INDIRECT:
+        return Request->u.Indirect.FirstSector;
+    case BLKIF_OP_WRITE_BARRIER:
+        return Request->u.Barrier.FirstSector;
+    case BLKIF_OP_DISCARD:
+        return Request->u.Discard.FirstSector;
+    default:
+        return 0;
+    }
+}
 
-    // pop all submitted requests, cleanup and add associated SRB to a list
-    for (;;) {
-        PXENVBD_SRBEXT  SrbExt;
-        PXENVBD_REQUEST Request;
-        PLIST_ENTRY     Entry = QueuePop(&Pdo->SubmittedReqs);
-        if (Entry == NULL)
+// submission order, SRBs by arrival then each SRB's requests by sector
+static FORCEINLINE BOOLEAN
+__RequestBefore(
+    __in PXENVBD_REQUEST         Request,
+    __in PXENVBD_REQUEST         Other
+    )
+{
+    const LONGLONG  Start = GetSrbExt(Request->Srb)->Start;
+    const LONGLONG  OtherStart = GetSrbExt(Other->Srb)->Start;
+
+    if (Request->Srb != Other->Srb)
+        return (Start < OtherStart) ? TRUE : FALSE;
+
+    return (__RequestFirstSector(Request) < __RequestFirstSector(Other)) ? TRUE : FALSE;
+}
+
+static FORCEINLINE VOID
+__PdoResumeKeep(
+    __in PXENVBD_PDO             Pdo,
+    __in PXENVBD_REQUEST         Request
+    )
+{
+    PLIST_ENTRY     Entry;
+
+    // the grants belong to the old backend, the rest is kept for PdoPostResume
+    RequestRevoke(Pdo, Request);
+    GetSrbExt(Request->Srb)->InFlight = 0;
+
+    for (Entry = Pdo->ResumeReqs.Blink; Entry != &Pdo->ResumeReqs; Entry = Entry->Blink) {
+        PXENVBD_REQUEST Other = CONTAINING_RECORD(Entry, XENVBD_REQUEST, Entry);
+        if (!__RequestBefore(Request, Other))
             break;
-        Request = CONTAINING_RECORD(Entry, XENVBD_REQUEST, Entry);
-        SrbExt = GetSrbExt(Request->Srb);
+    }
+    InsertHeadList(Entry, &Request->Entry);
+}
 
-        RequestCleanup(Pdo, Request);
-        __LookasideFree(&Pdo->RequestList, Request);
+static FORCEINLINE BOOLEAN
+__PdoCanReplay(
+    __in PXENVBD_PDO             Pdo,
+    __in PXENVBD_REQUEST         Request
+    )
+{
+    PXENVBD_DISKINFO    DiskInfo = FrontendGetDiskInfo(Pdo->Frontend);
 
-        if (InterlockedDecrement(&SrbExt->Count) == 0) {
-            InsertTailList(&List, &SrbExt->Entry);
-        }
+    switch (Request->Operation) {
+    case BLKIF_OP_INDIRECT:
+        return (Request->u.Indirect.NrSegments <= Pdo->IndirectSegments) ? TRUE : FALSE;
+    case BLKIF_OP_WRITE_BARRIER:
+        return DiskInfo->Barrier;
+    case BLKIF_OP_FLUSH_DISKCACHE:
+        return DiskInfo->FlushCache;
+    case BLKIF_OP_DISCARD:
+        return DiskInfo->Discard;
+    default:
+        return TRUE;
+    }
+}
+
+// keeps every request on the old ring or prepared for it, see __PdoResumeKeep
+static VOID
+__PdoResumeSweep(
+    __in PXENVBD_PDO             Pdo
+    )
+{
+    ULONG           Kept = 0;
+
+    __PdoSchedFlush(Pdo);
+
+    // submitted requests will never complete on the old ring, take them from its tag table
+    for (;;) {
+        PXENVBD_REQUEST Request = BlockRingAbort(FrontendGetBlockRing(Pdo->Frontend));
+        if (Request == NULL)
+            break;
+        __PdoResumeKeep(Pdo, Request);
+        ++Kept;
     }
 
-    // pop all prepared requests, cleanup and add associated SRB to a list
     for (;;) {
-        PXENVBD_SRBEXT  SrbExt;
-        PXENVBD_REQUEST Request;
         PLIST_ENTRY     Entry = QueuePop(&Pdo->PreparedReqs);
         if (Entry == NULL)
             break;
-        Request = CONTAINING_RECORD(Entry, XENVBD_REQUEST, Entry);
-        SrbExt = GetSrbExt(Request->Srb);
+        __PdoResumeKeep(Pdo, CONTAINING_RECORD(Entry, XENVBD_REQUEST, Entry));
+        ++Kept;
+    }
 
-        RequestCleanup(Pdo, Request);
-        __LookasideFree(&Pdo->RequestList, Request);
+    if (Kept)
+        Verbose("Target[%d] : %u Requests kept\n", PdoGetTargetId(Pdo), Kept);
+}
 
-        if (InterlockedDecrement(&SrbExt->Count) == 0) {
-            InsertTailList(&List, &SrbExt->Entry);
-        }
-    }
+VOID
+PdoPreResume(
+    __in PXENVBD_PDO             Pdo
+    )
+{
+    KIRQL           Irql;
 
-    // foreach SRB in list, put on start of FreshSrbs
-    for (;;) {
-        PXENVBD_SRBEXT  SrbExt;
-        PLIST_ENTRY     Entry = RemoveTailList(&List);
-        if (Entry == &List)
-            break;
-        SrbExt = CONTAINING_RECORD(Entry, XENVBD_SRBEXT, Entry);
+    Pdo->ResumeStart = KeQueryPerformanceCounter(NULL).QuadPart;
+    Pdo->ResumeSectorSize = FrontendGetDiskInfo(Pdo->Frontend)->SectorSize;
 
-        QueueUnPop(&Pdo->FreshSrbs, &SrbExt->Entry);
-    }
+    // hold StorPort and the data path until the backend is reconnected
+    KeAcquireSpinLock(&Pdo->Lock, &Irql);
+    ++Pdo->Paused;
+    KeReleaseSpinLock(&Pdo->Lock, Irql);
+    (VOID) InterlockedExchange(&Pdo->Resuming, 1);
+    StorPortPauseDevice(PdoGetFdo(Pdo), 0, (UCHAR)PdoGetTargetId(Pdo), 0, RESUME_PAUSE_TIMEOUT_S);
+
+    // only this vCPU is running, the resume thread sweeps again with the others running
+    __PdoResumeSweep(Pdo);
+}
+
+VOID
+PdoResumeDrain(
+    __in PXENVBD_PDO             Pdo
+    )
+{
+    LARGE_INTEGER   Timeout;
+
+    ASSERT(__PdoIsResuming(Pdo));
+
+    // other vCPUs may have been stopped inside a prepare/submit section, let them leave it
+    Timeout.QuadPart = -10000; // 1ms
+    while (InterlockedCompareExchange(&Pdo->Preparing, 0, 0) != 0)
+        KeDelayExecutionThread(KernelMode, FALSE, &Timeout);
 
-    // now the first set of requests popped off submitted list is the next SRB 
-    // to be popped off the fresh list
+    __PdoResumeSweep(Pdo);
 }
 
 VOID
@@ -1689,7 +3500,12 @@ PdoPostResume(
     __in PXENVBD_PDO             Pdo
     )
 {
-    KIRQL   Irql;
+    KIRQL           Irql;
+    PLIST_ENTRY     Entry;
+    BOOLEAN         Replay;
+    ULONG           Replayed = 0;
+    ULONG           Rebuilt = 0;
+    LONGLONG        Ticks;
 
     Verbose("Target[%d] : %d Fresh SRBs\n", PdoGetTargetId(Pdo), QueueCount(&Pdo->FreshSrbs));
     
@@ -1699,6 +3515,74 @@ PdoPostResume(
     Pdo->Missing = FALSE;
     Pdo->Reason = NULL;
     KeReleaseSpinLock(&Pdo->Lock, Irql);
+
+    // ring depth and indirect segments may differ on the new backend
+    __PdoSizePools(Pdo);
+    __PdoReserve(Pdo, TRUE);
+
+    // kept requests are replayed as they are if the new backend takes all of them
+    Replay = FrontendGetCaps(Pdo->Frontend)->Connected &&
+             FrontendGetDiskInfo(Pdo->Frontend)->SectorSize == Pdo->ResumeSectorSize;
+    for (Entry = Pdo->ResumeReqs.Flink;
+                Replay && Entry != &Pdo->ResumeReqs;
+                        Entry = Entry->Flink) {
+        PXENVBD_REQUEST Request = CONTAINING_RECORD(Entry, XENVBD_REQUEST, Entry);
+
+        if (!__PdoCanReplay(Pdo, Request) ||
+            !NT_SUCCESS(RequestRegrant(Pdo, Request)))
+            Replay = FALSE;
+    }
+
+    if (Replay) {
+        // the data path is paused, nothing has been prepared since
+        while (!IsListEmpty(&Pdo->ResumeReqs)) {
+            QueueAppend(&Pdo->PreparedReqs, RemoveHeadList(&Pdo->ResumeReqs));
+            ++Replayed;
+        }
+    } else {
+        LIST_ENTRY      List;
+
+        // cleanup, and put each SRB back on the start of FreshSrbs in order
+        InitializeListHead(&List);
+        while (!IsListEmpty(&Pdo->ResumeReqs)) {
+            PXENVBD_REQUEST Request;
+            PXENVBD_SRBEXT  SrbExt;
+
+            Entry = RemoveHeadList(&Pdo->ResumeReqs);
+            Request = CONTAINING_RECORD(Entry, XENVBD_REQUEST, Entry);
+            SrbExt = GetSrbExt(Request->Srb);
+
+            RequestCleanup(Pdo, Request);
+            __PoolFree(&Pdo->RequestPool, Request);
+            ++Rebuilt;
+
+            if (InterlockedDecrement(&SrbExt->Count) == 0)
+                InsertTailList(&List, &SrbExt->Entry);
+        }
+        for (;;) {
+            Entry = RemoveTailList(&List);
+            if (Entry == &List)
+                break;
+            QueueUnPop(&Pdo->FreshSrbs, Entry);
+        }
+    }
+
+    (VOID) InterlockedExchange(&Pdo->Resuming, 0);
+    KeAcquireSpinLock(&Pdo->Lock, &Irql);
+    --Pdo->Paused;
+    KeReleaseSpinLock(&Pdo->Lock, Irql);
+    StorPortResumeDevice(PdoGetFdo(Pdo), 0, (UCHAR)PdoGetTargetId(Pdo), 0);
+
+    // I/O restarts when the caller triggers the notifier
+    Ticks = KeQueryPerformanceCounter(NULL).QuadPart - Pdo->ResumeStart;
+    ++Pdo->Resumes;
+    Pdo->ResumeReplayed += Replayed;
+    Pdo->ResumeRebuilt += Rebuilt;
+    Pdo->ResumeTicks = Ticks;
+    if (Ticks > Pdo->ResumeMaxTicks)
+        Pdo->ResumeMaxTicks = Ticks;
+
+    Verbose("Target[%d] : %u Requests replayed, %u rebuilt\n", PdoGetTargetId(Pdo), Replayed, Rebuilt);
 }
 
 //=============================================================================
@@ -1767,11 +3651,20 @@ PdoReadWrite(
         return TRUE; // Complete now
     }
 
-    Status = PrepareReadWrite(Pdo, Srb);
-    if (NT_SUCCESS(Status)) {
+    if (__PdoQosHold(Pdo, Srb))
+        return FALSE;
+
+    // the ring is stale while resuming, the resume thread triggers the notifier for these
+    InterlockedIncrement(&Pdo->Preparing);
+    Status = STATUS_DEVICE_BUSY;
+    if (!__PdoIsResuming(Pdo))
+        Status = __PdoPrepareReadWrite(Pdo, Srb);
+    if (NT_SUCCESS(Status))
         PdoSubmitPrepared(Pdo);
+    InterlockedDecrement(&Pdo->Preparing);
+
+    if (NT_SUCCESS(Status))
         return FALSE;
-    }
 
     QueueAppend(&Pdo->FreshSrbs, &SrbExt->Entry);
     NotifierTrigger(Notifier);
@@ -1803,11 +3696,20 @@ PdoSyncCache(
         return TRUE;
     }
 
-    Status = PrepareSyncCache(Pdo, Srb);
-    if (NT_SUCCESS(Status)) {
+    if (__PdoQosHold(Pdo, Srb))
+        return FALSE;
+
+    // the ring is stale while resuming, the resume thread triggers the notifier for these
+    InterlockedIncrement(&Pdo->Preparing);
+    Status = STATUS_DEVICE_BUSY;
+    if (!__PdoIsResuming(Pdo))
+        Status = PrepareSyncCache(Pdo, Srb);
+    if (NT_SUCCESS(Status))
         PdoSubmitPrepared(Pdo);
+    InterlockedDecrement(&Pdo->Preparing);
+
+    if (NT_SUCCESS(Status))
         return FALSE;
-    }
 
     QueueAppend(&Pdo->FreshSrbs, &SrbExt->Entry);
     NotifierTrigger(Notifier);
@@ -1839,11 +3741,20 @@ PdoUnmap(
         return TRUE;
     }
 
-    Status = PrepareUnmap(Pdo, Srb);
-    if (NT_SUCCESS(Status)) {
+    if (__PdoQosHold(Pdo, Srb))
+        return FALSE;
+
+    // the ring is stale while resuming, the resume thread triggers the notifier for these
+    InterlockedIncrement(&Pdo->Preparing);
+    Status = STATUS_DEVICE_BUSY;
+    if (!__PdoIsResuming(Pdo))
+        Status = PrepareUnmap(Pdo, Srb);
+    if (NT_SUCCESS(Status))
         PdoSubmitPrepared(Pdo);
+    InterlockedDecrement(&Pdo->Preparing);
+
+    if (NT_SUCCESS(Status))
         return FALSE;
-    }
 
     QueueAppend(&Pdo->FreshSrbs, &SrbExt->Entry);
     NotifierTrigger(Notifier);
@@ -2113,6 +4024,7 @@ __PdoExecuteScsi(
     switch (Operation) {
     case SCSIOP_READ:
     case SCSIOP_WRITE:
+        __PdoApplyQueueDepth(Pdo);
         return PdoReadWrite(Pdo, Srb);
         break;
         
@@ -2183,36 +4095,35 @@ PdoReset(
 {
     ULONG               Count;
     PXENVBD_NOTIFIER    Notifier = FrontendGetNotifier(Pdo->Frontend);
+    PXENVBD_BLOCKRING   BlockRing = FrontendGetBlockRing(Pdo->Frontend);
 
     Trace("Target[%d] ====> (Irql=%d)\n", PdoGetTargetId(Pdo), KeGetCurrentIrql());
 
     // Handles FreshSrbs and PreparedReqs
     PdoAbortAllSrbs(Pdo);
 
-    // SubmittedReqs (5 secs)
-    for (Count = 0; QueueCount(&Pdo->SubmittedReqs) && Count < 50000; ++Count) {
+    // Submitted requests (5 secs)
+    for (Count = 0; BlockRingOutstanding(BlockRing) && Count < 50000; ++Count) {
         FrontendNotifyResponses(Pdo->Frontend);
         NotifierSend(Notifier);
         StorPortStallExecution(100); // 100 micro-seconds
     }
-    if (QueueCount(&Pdo->SubmittedReqs)) {
+    if (BlockRingOutstanding(BlockRing)) {
         Warning("Target[%d] : Still have %u requests outstanding\n", PdoGetTargetId(Pdo),
-                                QueueCount(&Pdo->SubmittedReqs));
+                                BlockRingOutstanding(BlockRing));
 
         for (;;) {
             PXENVBD_SRBEXT  SrbExt;
-            PXENVBD_REQUEST Request;
-            PLIST_ENTRY     Entry = QueuePop(&Pdo->SubmittedReqs);
-            if (Entry == NULL)
+            PXENVBD_REQUEST Request = BlockRingAbort(BlockRing);
+            if (Request == NULL)
                 break;
-            Request = CONTAINING_RECORD(Entry, XENVBD_REQUEST, Entry);
             SrbExt = GetSrbExt(Request->Srb);
 
             Verbose("Target[%d] : SubmittedReq 0x%p -> FAILED\n", PdoGetTargetId(Pdo), Request);
         
             SrbExt->Srb->SrbStatus = SRB_STATUS_ABORTED;
             RequestCleanup(Pdo, Request);
-            __LookasideFree(&Pdo->RequestList, Request);
+            __PoolFree(&Pdo->RequestPool, Request);
 
             if (InterlockedDecrement(&SrbExt->Count) == 0) {
                 SrbExt->Srb->ScsiStatus = 0x40; // SCSI_ABORTED
@@ -2318,7 +4229,10 @@ PdoAbortAllSrbs(
         FdoCompleteSrb(PdoGetFdo(Pdo), SrbExt->Srb);
     }
 
-    // Fail PreparedReqs
+    // Fail PreparedReqs, and any kept across a resume that has not completed
+    __PdoSchedFlush(Pdo);
+    while (!IsListEmpty(&Pdo->ResumeReqs))
+        QueueAppend(&Pdo->PreparedReqs, RemoveHeadList(&Pdo->ResumeReqs));
     for (;;) {
         PXENVBD_SRBEXT  SrbExt;
         PXENVBD_REQUEST Request;
@@ -2332,7 +4246,7 @@ PdoAbortAllSrbs(
         
         SrbExt->Srb->SrbStatus = SRB_STATUS_ABORTED;
         RequestCleanup(Pdo, Request);
-        __LookasideFree(&Pdo->RequestList, Request);
+        __PoolFree(&Pdo->RequestPool, Request);
 
         if (InterlockedDecrement(&SrbExt->Count) == 0) {
             SrbExt->Srb->ScsiStatus = 0x40; // SCSI_ABORTED
@@ -2410,6 +4324,8 @@ __PdoDeviceUsageNotification(
         return;
     }
     FrontendWriteUsage(Pdo->Frontend);
+    Pdo->Priority = __PdoPriority(Pdo);
+    __PdoReserve(Pdo, FALSE);
 }
 
 static FORCEINLINE VOID
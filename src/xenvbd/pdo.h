@@ -56,7 +56,6 @@ PdoCreate(
     __in __nullterminated PCHAR  DeviceId,
     __in ULONG                   TargetId,
     __in BOOLEAN                 EmulatedMasked,
-    __in PKEVENT                 FrontendEvent,
     __in XENVBD_DEVICE_TYPE      DeviceType
     );
 
@@ -76,12 +75,6 @@ PdoD0ToD3(
     __in PXENVBD_PDO             Pdo
     );
 
-__drv_requiresIRQL(DISPATCH_LEVEL)
-extern VOID
-PdoBackendPathChanged(
-    __in PXENVBD_PDO             Pdo
-    );
-
 // PnP States
 extern VOID
 PdoSetMissing(
@@ -176,6 +169,25 @@ PdoSectorSize(
     __in PXENVBD_PDO             Pdo
     );
 
+extern VOID
+PdoSelectPrepare(
+    __in PXENVBD_PDO             Pdo
+    );
+
+extern VOID
+PdoSetQos(
+    __in PXENVBD_PDO             Pdo,
+    __in ULONG                   Iops,
+    __in ULONG64                 BytesPerSec
+    );
+
+__drv_maxIRQL(PASSIVE_LEVEL)
+extern VOID
+PdoSetIntegrity(
+    __in PXENVBD_PDO             Pdo,
+    __in ULONG                   Entries
+    );
+
 // Queue-Related
 extern VOID
 PdoPrepareFresh(
@@ -204,6 +216,11 @@ PdoPreResume(
     __in PXENVBD_PDO             Pdo
     );
 
+extern VOID
+PdoResumeDrain(
+    __in PXENVBD_PDO             Pdo
+    );
+
 extern VOID
 PdoPostResume(
     __in PXENVBD_PDO             Pdo
@@ -40,11 +40,14 @@
 // Segments - extension of blkif_segment_t
 typedef struct _XENVBD_SEGMENT {
     PVOID               Grant;
+    PFN_NUMBER          Pfn;        // granted page, re-granted on resume
     UCHAR               FirstSector;
     UCHAR               LastSector;
 } XENVBD_SEGMENT, *PXENVBD_SEGMENT;
 
+// Mapping - bounce state, only allocated for segments that cannot be granted directly
 typedef struct _XENVBD_MAPPING {
+    struct _XENVBD_MAPPING* Next;
     PVOID               BufferId;
     PVOID               Buffer; // VirtAddr mapped to PhysAddr(s)
     ULONG               Length;
@@ -57,7 +60,6 @@ typedef struct _XENVBD_REQUEST_READWRITE {
     UCHAR               NrSegments;
     ULONG64             FirstSector;
     XENVBD_SEGMENT      Segments[BLKIF_MAX_SEGMENTS_PER_REQUEST];
-    XENVBD_MAPPING      Mappings[BLKIF_MAX_SEGMENTS_PER_REQUEST];
 } XENVBD_REQUEST_READWRITE, *PXENVBD_REQUEST_READWRITE;
 
 typedef struct _XENVBD_REQUEST_BARRIER {
@@ -74,9 +76,9 @@ typedef struct _XENVBD_REQUEST_INDIRECT {
     UCHAR               Operation;  // BLKIF_OP_{READ/WRITE}
     USHORT              NrSegments; // 1-4096
     ULONG64             FirstSector;
-    PVOID               Grants[BLKIF_MAX_INDIRECT_PAGES_PER_REQUEST];
-    PXENVBD_SEGMENT     Segments[BLKIF_MAX_INDIRECT_PAGES_PER_REQUEST];
-    PXENVBD_MAPPING     Mappings[BLKIF_MAX_INDIRECT_PAGES_PER_REQUEST];
+    PVOID               Grants[BLKIF_MAX_INDIRECT_PAGES_PER_REQUEST];  // indirect page grants
+    struct blkif_request_segment*   Pages[BLKIF_MAX_INDIRECT_PAGES_PER_REQUEST];    // indirect pages
+    PVOID*              Handles[BLKIF_MAX_INDIRECT_PAGES_PER_REQUEST]; // segment grants, per indirect page
 } XENVBD_REQUEST_INDIRECT, *PXENVBD_REQUEST_INDIRECT;
 
 typedef struct _XENVBD_REQUEST {
@@ -84,6 +86,8 @@ typedef struct _XENVBD_REQUEST {
     LIST_ENTRY          Entry;
 
     UCHAR               Operation;
+    SHORT               Status;     // BLKIF_RSP_*, set when the response is harvested
+    PXENVBD_MAPPING     Mappings;   // bounced segments only
     union _XENVBD_REQUEST_TYPE {
         XENVBD_REQUEST_READWRITE    ReadWrite;  // BLKIF_OP_{READ/WRITE}
         XENVBD_REQUEST_BARRIER      Barrier;    // BLKIF_OP_WRITE_BARRIER
@@ -98,6 +102,17 @@ typedef struct _XENVBD_SRBEXT {
     PSCSI_REQUEST_BLOCK     Srb;
     LIST_ENTRY              Entry;
     LONG                    Count;
+    ULONG                   Processor;  // submitting processor index
+    LONGLONG                Start;      // performance counter at BuildIo
+
+    // Scheduler - see PdoSubmitPrepared
+    LIST_ENTRY              Requests;   // prepared, not yet on the ring
+    LONG                    InFlight;   // on the ring
+    ULONG                   Deficit;    // segments that may still be submitted this round
+    UCHAR                   Priority;   // 0 = paging or head-of-queue, 1 = normal
+    UCHAR                   SizeClass;
+    BOOLEAN                 Scheduled;  // Entry is on a scheduler list
+    BOOLEAN                 Throttled;  // held back by the target's QoS limits
 } XENVBD_SRBEXT, *PXENVBD_SRBEXT;
 
 FORCEINLINE PXENVBD_SRBEXT
@@ -121,6 +136,9 @@ InitSrbExt(
     if (SrbExt) {
         RtlZeroMemory(SrbExt, sizeof(XENVBD_SRBEXT));
         SrbExt->Srb = Srb;
+        SrbExt->Processor = KeGetCurrentProcessorNumberEx(NULL);
+        SrbExt->Start = KeQueryPerformanceCounter(NULL).QuadPart;
+        InitializeListHead(&SrbExt->Requests);
     }
     Srb->SrbStatus = SRB_STATUS_INVALID_REQUEST;
 }